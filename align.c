@@ -0,0 +1,944 @@
+
+/*  align.c -- estimate the time offset and scale by the reference
+    Copyright (C) 2009-2025  "Andy Xuming" <xuming@users.sourceforge.net>
+
+    This file is part of Subsync, a utility to resync subtitle files
+
+    Subsync is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Subsync is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+
+#include "align.h"
+
+/* the little endian integers in the WAV file */
+#define ALIGN_LE16(p)	((p)[0] | ((p)[1] << 8))
+#define ALIGN_LE32(p)	((unsigned long) ALIGN_LE16(p) | \
+			((unsigned long) ALIGN_LE16((p) + 2) << 16))
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* the transformed reference and the workspace of the correlation */
+typedef	struct	{
+	double	*rr, *ri;	/* the spectrum of the reference */
+	double	*tr, *ti;	/* the cues and the correlation */
+	double	*tw;		/* the twiddle factors */
+	int	n;		/* points of the transform */
+	int	res;		/* milliseconds per bin */
+} ALIGNFFT;
+
+static int align_open(ALIGNFFT *af, time_t *ref, int nref, double tmax);
+static int align_alloc(ALIGNFFT *af, double tmax, int limit);
+static void align_close(ALIGNFFT *af);
+static double align_lag(ALIGNFFT *af, time_t *cue, int ncue, double scale,
+		double *peak);
+static double align_correlate(ALIGNFFT *af, double *peak);
+static double *align_twiddle(int n);
+static void align_transform(double *re, double *im, int n, double *tw,
+		int inverse);
+static int align_local(time_t *ref, int nref, time_t *cue, int ncue,
+		double *a, double *b, double win);
+static int align_theil(double *x, double *y, int n, double *slope, 
+		double *c);
+static double align_median(double *v, int n);
+static int align_compare(const void *a, const void *b);
+static int align_fit(time_t *ref, int nref, time_t *cue, int ncue,
+		double *a, double *b, double tol, int fixed);
+static int align_nearest(time_t *ref, int nref, double x);
+static int align_seed(time_t *x, time_t *y, int n, char *keep, 
+		double *dev);
+static int align_line(time_t *x, time_t *y, int n, char *keep, 
+		double *a, double *b, double *sxx);
+static float align_sample(unsigned char *in, int fmt, int bits);
+static unsigned char *align_vad(float *eng, int n);
+static double align_spans(ALIGNFFT *af, time_t *cue, int ncue, double scale);
+static int align_groups(int *sum, int nv, double mean, time_t *cue, 
+		int ncue, double *a, double *b, int win);
+static double align_speech(int *sum, int nv, double mean, time_t *cue,
+		int from, int to, double a, double b, int win);
+
+
+/* In-place radix-2 FFT of 'n' complex numbers, which must be power of 2.
+ * The inverse transform is scaled by 1/n */
+int align_fft(double *re, double *im, int n, int inverse)
+{
+	double	*tw;
+
+	if ((n < 2) || (n & (n - 1))) {
+		return -1;
+	}
+	if ((tw = align_twiddle(n)) == NULL) {
+		return -1;
+	}
+	align_transform(re, im, n, tw, inverse);
+	free(tw);
+	return 0;
+}
+
+/* Estimate 'a' and 'b' of ref = a * cue + b by the sorted start times of
+ * the cues. The cues are binned into trains of impulses and the reference
+ * train is blurred a little for the jitters. For each candidate scale,
+ * the cross correlation of the trains is worked out by FFT and the peak
+ * gives the coarse offset; the best peak of all scales wins. The drift
+ * around the best scale is scanned by the steps which move the last cue
+ * by the blur. Then the nearest cues are paired and fitted by the least
+ * squares with shrinking tolerance. Return the number of the paired cues,
+ * or -1 if failed */
+int align_cues(time_t *ref, int nref, time_t *cue, int ncue,
+		double *scale, int nscale, double *a, double *b)
+{
+	ALIGNFFT	af;
+	double	peak, best = 0, tmax, tol, lag, step, drift, s0, a1, b1;
+	int	i, n, m = 0;
+
+	if ((nref < 2) || (ncue < 2) || (nscale < 1)) {
+		return -1;
+	}
+	tmax = (double) ref[nref-1];
+	for (i = 0; i < nscale; i++) {
+		tmax = MAX(tmax, cue[ncue-1] * scale[i]);
+	}
+	if (align_open(&af, ref, nref, tmax) < 0) {
+		return -1;
+	}
+	*a = 1.0;
+	*b = 0.0;
+	for (i = 0; i < nscale; i++) {
+		lag = align_lag(&af, cue, ncue, scale[i], &peak);
+		if (peak > best) {
+			best = peak;
+			*a = scale[i];
+			*b = lag;
+		}
+	}
+	s0 = *a;
+	step = (double) ALIGN_BLUR * af.res / tmax;
+	for (drift = -ALIGN_DRIFT; drift <= ALIGN_DRIFT; drift += step) {
+		lag = align_lag(&af, cue, ncue, s0 * (1.0 + drift), &peak);
+		if (peak > best) {
+			best = peak;
+			*a = s0 * (1.0 + drift);
+			*b = lag;
+		}
+	}
+	tol = (double) ALIGN_BLUR * af.res;
+	align_close(&af);
+
+	/* the coarse bins leave the error too large for pairing the cues */
+	if ((tol > ALIGN_BLUR * ALIGN_BIN) && 
+			(align_local(ref, nref, cue, ncue, a, b, tol) == 0)) {
+		tol = ALIGN_BLUR * ALIGN_BIN;
+	}
+
+	/* refine by the paired cues */
+	for ( ; tol >= ALIGN_BIN; tol /= 2) {
+		m = align_fit(ref, nref, cue, ncue, a, b, tol, 0);
+	}
+	/* take the scale as 1 if it still pairs the cues as well */
+	if (fabs(*a - 1.0) < ALIGN_UNITY) {
+		a1 = 1.0;
+		b1 = *b;
+		if ((n = align_fit(ref, nref, cue, ncue, &a1, &b1, tol * 2, 1)) 
+				>= m - m / 100) {
+			*a = a1;
+			*b = b1;
+			m = n;
+		}
+	}
+	return m;
+}
+
+/* Bin the reference into the blurred train and transform it. The bins are
+ * widened if the transform would be too large. The zero padding is for 
+ * the linear correlation of both directions */
+static int align_open(ALIGNFFT *af, time_t *ref, int nref, double tmax)
+{
+	int	i, j, k;
+
+	if (align_alloc(af, tmax, ALIGN_MAX_FFT) < 0) {
+		return -1;
+	}
+	for (i = 0; i < nref; i++) {
+		k = (int)(ref[i] / af->res);
+		for (j = -ALIGN_BLUR; j <= ALIGN_BLUR; j++) {
+			if ((k + j >= 0) && (k + j < af->n)) {
+				af->rr[k+j] += ALIGN_BLUR + 1 - abs(j);
+			}
+		}
+	}
+	align_transform(af->rr, af->ri, af->n, af->tw, 0);
+	return 0;
+}
+
+/* allocate the transform of the bins up to 'tmax', which are widened
+ * until the transform is no more than 'limit' points */
+static int align_alloc(ALIGNFFT *af, double tmax, int limit)
+{
+	int	k;
+
+	for (af->res = ALIGN_BIN; ; af->res *= 2) {
+		k = (int)(tmax / af->res) + ALIGN_BLUR + 1;
+		for (af->n = 2; af->n < k * 2; af->n <<= 1);
+		if (af->n <= limit) {
+			break;
+		}
+	}
+	if ((af->rr = calloc(af->n * 4, sizeof(double))) == NULL) {
+		return -1;
+	}
+	af->ri = af->rr + af->n;
+	af->tr = af->ri + af->n;
+	af->ti = af->tr + af->n;
+	if ((af->tw = align_twiddle(af->n)) == NULL) {
+		free(af->rr);
+		return -1;
+	}
+	return 0;
+}
+
+static void align_close(ALIGNFFT *af)
+{
+	free(af->rr);
+	free(af->tw);
+}
+
+/* Correlate the scaled cues to the reference. Return the lag of the peak
+ * in milliseconds and the height of the peak in '*peak' */
+static double align_lag(ALIGNFFT *af, time_t *cue, int ncue, double scale,
+		double *peak)
+{
+	int	i, k, n = af->n;
+
+	memset(af->tr, 0, n * 2 * sizeof(double));
+	for (i = 0; i < ncue; i++) {
+		k = (int)(cue[i] * scale / af->res + 0.5);
+		if ((k >= 0) && (k < n)) {
+			af->tr[k] += 1;
+		}
+	}
+	return align_correlate(af, peak);
+}
+
+/* Correlate the train in 'tr' to the reference. Return the lag of the 
+ * peak in milliseconds and the height of the peak in '*peak' */
+static double align_correlate(ALIGNFFT *af, double *peak)
+{
+	double	re, im;
+	int	i, n = af->n, lag = 0;
+
+	align_transform(af->tr, af->ti, n, af->tw, 0);
+	/* correlation: REF * conj(CUE) */
+	for (i = 0; i < n; i++) {
+		re = af->rr[i] * af->tr[i] + af->ri[i] * af->ti[i];
+		im = af->ri[i] * af->tr[i] - af->rr[i] * af->ti[i];
+		af->tr[i] = re;
+		af->ti[i] = im;
+	}
+	align_transform(af->tr, af->ti, n, af->tw, 1);
+	*peak = 0;
+	for (i = 0; i < n; i++) {
+		if (af->tr[i] > *peak) {
+			*peak = af->tr[i];
+			lag = (i < n / 2) ? i : i - n;
+		}
+	}
+	return (double) lag * af->res;
+}
+
+/* the twiddle factors of the 'n' points transform, cos and sin in pairs */
+static double *align_twiddle(int n)
+{
+	double	*tw;
+	int	i;
+
+	if ((tw = malloc(n * sizeof(double))) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < n / 2; i++) {
+		tw[i*2]   = cos(-2 * M_PI * i / n);
+		tw[i*2+1] = sin(-2 * M_PI * i / n);
+	}
+	return tw;
+}
+
+/* the iterative radix-2 transform by the twiddle factors */
+static void align_transform(double *re, double *im, int n, double *tw,
+		int inverse)
+{
+	double	wr, wi, ur, ui, tr, ti;
+	int	i, j, k, len, half, step;
+
+	/* bit reversal permutation */
+	for (i = 1, j = 0; i < n; i++) {
+		for (k = n >> 1; j & k; k >>= 1) {
+			j ^= k;
+		}
+		j |= k;
+		if (i < j) {
+			tr = re[i]; re[i] = re[j]; re[j] = tr;
+			ti = im[i]; im[i] = im[j]; im[j] = ti;
+		}
+	}
+	/* butterflies block by block so the memory is walked in sequence */
+	for (len = 2; len <= n; len <<= 1) {
+		half = len >> 1;
+		step = n / len;
+		for (i = 0; i < n; i += len) {
+			for (k = 0; k < half; k++) {
+				wr = tw[k*step*2];
+				wi = inverse ? -tw[k*step*2+1] : tw[k*step*2+1];
+				j = i + k + half;
+				tr = re[j] * wr - im[j] * wi;
+				ti = re[j] * wi + im[j] * wr;
+				ur = re[i+k];
+				ui = im[i+k];
+				re[i+k] = ur + tr;
+				im[i+k] = ui + ti;
+				re[j] = ur - tr;
+				im[j] = ui - ti;
+			}
+		}
+	}
+	if (inverse) {
+		for (i = 0; i < n; i++) {
+			re[i] /= n;
+			im[i] /= n;
+		}
+	}
+}
+
+/* Narrow down the coarse estimation by the fine bins. The cues are split
+ * into groups, and the lag of each group within 'win' is searched in the
+ * fine reference train directly. The groups are short enough for the left
+ * drift so the lags against the time make a line, which is fitted by the
+ * median of the slopes of all group pairs against the random peaks */
+static int align_local(time_t *ref, int nref, time_t *cue, int ncue,
+		double *a, double *b, double win)
+{
+	float	*fine;
+	double	x[ALIGN_GROUP], y[ALIGN_GROUP];
+	double	score, peak, slope, c;
+	int	i, j, g, n, lag, from, to, pad = (int)(win / ALIGN_BIN) + 1;
+
+	if (ncue < ALIGN_GROUP * 4) {
+		return -1;
+	}
+	n = (int)(MAX(ref[nref-1], *a * cue[ncue-1] + *b) / ALIGN_BIN) + pad;
+	if ((fine = calloc(n + pad * 2, sizeof(float))) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < nref; i++) {
+		g = (int)(ref[i] / ALIGN_BIN) + pad;
+		for (j = -ALIGN_BLUR; j <= ALIGN_BLUR; j++) {
+			fine[g+j] += ALIGN_BLUR + 1 - abs(j);
+		}
+	}
+	for (g = 0; g < ALIGN_GROUP; g++) {
+		from = ncue * g / ALIGN_GROUP;
+		to = ncue * (g + 1) / ALIGN_GROUP;
+		peak = -1;
+		for (lag = -pad + 1; lag < pad; lag++) {
+			for (score = 0, i = from; i < to; i++) {
+				j = (int)((*a * cue[i] + *b) / ALIGN_BIN + 0.5);
+				if ((j + lag >= -pad) && (j + lag < n + pad)) {
+					score += fine[j+lag+pad];
+				}
+			}
+			if (score > peak) {
+				peak = score;
+				y[g] = (double) lag * ALIGN_BIN;
+			}
+		}
+		x[g] = *a * (cue[from] + cue[to-1]) / 2.0;
+	}
+	free(fine);
+
+	if (align_theil(x, y, ALIGN_GROUP, &slope, &c) < 0) {
+		return -1;
+	}
+	/* ref = a * t + b + c + slope * a * t */
+	*a *= 1.0 + slope;
+	*b += c;
+	return 0;
+}
+
+/* Fit the line y = slope * x + c by the median of the slopes of all point
+ * pairs, and the median of the intercepts, which ignores the random peaks */
+static int align_theil(double *x, double *y, int n, double *slope, 
+		double *c)
+{
+	double	k[ALIGN_GROUP*ALIGN_GROUP];
+	int	i, j, m;
+
+	for (i = m = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (x[j] != x[i]) {
+				k[m++] = (y[j] - y[i]) / (x[j] - x[i]);
+			}
+		}
+	}
+	if (m == 0) {
+		return -1;
+	}
+	*slope = align_median(k, m);
+	for (i = 0; i < n; i++) {
+		k[i] = y[i] - *slope * x[i];
+	}
+	*c = align_median(k, n);
+	return 0;
+}
+
+static double align_median(double *v, int n)
+{
+	qsort(v, n, sizeof(double), align_compare);
+	return (n & 1) ? v[n/2] : (v[n/2-1] + v[n/2]) / 2.0;
+}
+
+static int align_compare(const void *a, const void *b)
+{
+	double	x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Pair each cue to the nearest reference within 'tol' and fit them by the
+ * least squares. The scale 'a' is kept if 'fixed'. Return the pairs */
+static int align_fit(time_t *ref, int nref, time_t *cue, int ncue,
+		double *a, double *b, double tol, int fixed)
+{
+	double	x, t, r, st = 0, sr = 0, stt = 0, str = 0, den;
+	int	i, k, m = 0;
+
+	for (i = 0; i < ncue; i++) {
+		x = *a * cue[i] + *b;
+		k = align_nearest(ref, nref, x);
+		if (fabs(ref[k] - x) > tol) {
+			continue;
+		}
+		/* relative to the first cue to keep the sums small */
+		t = (double)(cue[i] - cue[0]);
+		r = (double) ref[k];
+		st += t;
+		sr += r;
+		stt += t * t;
+		str += t * r;
+		m++;
+	}
+	if (m < 2) {
+		return m;
+	}
+	den = m * stt - st * st;
+	if (!fixed && (den > 0)) {
+		*a = (m * str - st * sr) / den;
+	}
+	*b = (sr - *a * st) / m - *a * cue[0];
+	return m;
+}
+
+/* the index of the reference nearest to 'x' */
+static int align_nearest(time_t *ref, int nref, double x)
+{
+	int	lo = 0, hi = nref - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ref[mid] < x) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo > 0) && (x - ref[lo-1] < ref[lo] - x)) {
+		lo--;
+	}
+	return lo;
+}
+
+/* Fit the pairs of the expected 'y' and the actual 'x' by y = a * x + b
+ * with the least squares. The outliers are rejected first by the robust
+ * fit of align_seed(), since a far outlier pulls the least squares so
+ * much that the good pairs look deviated. The pairs deviating more than
+ * ALIGN_OUTLIER robust sigmas are rejected and the rest are fitted again
+ * until stable.
+ * The scale is taken as 1 if it's within ALIGN_SIGNIF standard errors.
+ * Return the pairs kept with the RMS residual in 'rms', or -1 if failed */
+int align_pairs(time_t *x, time_t *y, int n, double *a, double *b, 
+		double *rms)
+{
+	double	*dev, r, tol, sxx, ssr;
+	char	*keep;
+	int	i, k, m, loop, changed;
+
+	if ((dev = malloc(n * (sizeof(double) + 1))) == NULL) {
+		return -1;
+	}
+	keep = (char *)(dev + n);
+	if (align_seed(x, y, n, keep, dev) < 2) {
+		memset(keep, 1, n);
+	}
+	m = n;
+	for (loop = 0; loop < 16; loop++) {
+		if (align_line(x, y, n, keep, a, b, &sxx) < 2) {
+			break;
+		}
+		/* the median absolute deviation of the kept pairs */
+		for (i = k = 0; i < n; i++) {
+			if (keep[i]) {
+				dev[k++] = fabs(y[i] - (*a * x[i] + *b));
+			}
+		}
+		tol = MAX(ALIGN_OUTLIER * 1.4826 * align_median(dev, k), 
+				ALIGN_FRAME);
+		/* the rejected pairs may come back by the better fit */
+		for (i = m = changed = 0; i < n; i++) {
+			k = fabs(y[i] - (*a * x[i] + *b)) <= tol;
+			changed += (k != keep[i]);
+			keep[i] = k;
+			m += k;
+		}
+		if (!changed) {
+			break;
+		}
+	}
+	if ((m = align_line(x, y, n, keep, a, b, &sxx)) < 2) {
+		free(dev);
+		return m;
+	}
+	for (i = 0, ssr = 0; i < n; i++) {
+		if (keep[i]) {
+			r = y[i] - (*a * x[i] + *b);
+			ssr += r * r;
+		}
+	}
+	/* the standard error of the scale needs more than 2 pairs */
+	if ((m > 2) && (fabs(*a - 1.0) <= 
+			ALIGN_SIGNIF * sqrt(ssr / (m - 2) / sxx))) {
+		for (i = 0, *a = 1.0, *b = 0; i < n; i++) {
+			*b += keep[i] ? y[i] - x[i] : 0;
+		}
+		*b /= m;
+		for (i = 0, ssr = 0; i < n; i++) {
+			if (keep[i]) {
+				r = y[i] - (x[i] + *b);
+				ssr += r * r;
+			}
+		}
+	}
+	*rms = sqrt(ssr / m);
+	free(dev);
+	return m;
+}
+
+/* Fit the pairs by the median of the pairwise slopes and the median of 
+ * the intercepts, the Theil-Sen estimator, which stands until nearly 30% 
+ * of the pairs are outliers. Only ALIGN_SEED slopes are sampled evenly 
+ * from the large input. The pairs beyond ALIGN_OUTLIER robust sigmas of
+ * the fit are cleared in 'keep'. 'dev' is the scratch of 'n' doubles.
+ * Return the pairs kept, or -1 if failed */
+static int align_seed(time_t *x, time_t *y, int n, char *keep, 
+		double *dev)
+{
+	double	*k, a, b, tol;
+	long	total, step, q;
+	int	i, j, m;
+
+	total = (long) n * (n - 1) / 2;
+	step = total / ALIGN_SEED + 1;
+	if ((k = malloc((total / step + 1) * sizeof(double))) == NULL) {
+		return -1;
+	}
+	for (i = m = 0, q = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++, q++) {
+			if ((q % step == 0) && (x[j] != x[i])) {
+				k[m++] = (double)(y[j] - y[i]) / (x[j] - x[i]);
+			}
+		}
+	}
+	if (m == 0) {
+		free(k);
+		return -1;
+	}
+	a = align_median(k, m);
+	free(k);
+	/* relative to the first pair to keep the intercepts exact */
+	for (i = 0; i < n; i++) {
+		dev[i] = (y[i] - y[0]) - a * (x[i] - x[0]);
+	}
+	b = align_median(dev, n);
+	for (i = 0; i < n; i++) {
+		dev[i] = fabs((y[i] - y[0]) - a * (x[i] - x[0]) - b);
+	}
+	tol = MAX(ALIGN_OUTLIER * 1.4826 * align_median(dev, n), ALIGN_FRAME);
+	for (i = m = 0; i < n; i++) {
+		keep[i] = fabs((y[i] - y[0]) - a * (x[i] - x[0]) - b) <= tol;
+		m += keep[i];
+	}
+	return m;
+}
+
+/* the least squares of the kept pairs. Only the offset is fitted if all 
+ * actual time stamps are the same. Return the pairs */
+static int align_line(time_t *x, time_t *y, int n, char *keep, 
+		double *a, double *b, double *sxx)
+{
+	double	mx = 0, my = 0, sxy = 0;
+	int	i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		if (keep[i]) {
+			mx += x[i];
+			my += y[i];
+			m++;
+		}
+	}
+	if (m == 0) {
+		return 0;
+	}
+	mx /= m;
+	my /= m;
+	for (i = 0, *sxx = 0; i < n; i++) {
+		if (keep[i]) {
+			*sxx += (x[i] - mx) * (x[i] - mx);
+			sxy += (x[i] - mx) * (y[i] - my);
+		}
+	}
+	*a = (*sxx > 0) ? sxy / *sxx : 1.0;
+	*b = my - *a * mx;
+	return m;
+}
+
+/* Read the PCM WAV file block by block and decide the voice activity of
+ * each ALIGN_VAD_MS frame by its energy. The samples are mixed to mono and
+ * pre-emphasized so the speech stands out of the rumble and the music.
+ * Return the number of the frames in '*voice', or -1 if failed */
+int align_wave(FILE *fp, unsigned char **voice)
+{
+	unsigned char	hdr[64], *buf;
+	unsigned long	size, left = (unsigned long) -1;
+	float	*eng = NULL, *p;
+	double	x, y, last = 0, sum = 0;
+	long long	pos = 0, next;
+	int	fmt = 0, chans = 0, rate = 0, bits = 0, align = 0;
+	int	i, c, n, nf = 0, max = 0, cnt = 0;
+
+	if ((fread(hdr, 1, 12, fp) != 12) || memcmp(hdr, "RIFF", 4) ||
+			memcmp(hdr + 8, "WAVE", 4)) {
+		return -1;
+	}
+	while (fread(hdr, 1, 8, fp) == 8) {
+		size = ALIGN_LE32(hdr + 4);
+		if (!memcmp(hdr, "data", 4)) {
+			/* the size of the streamed WAV may be unknown */
+			left = size ? size : left;
+			break;
+		}
+		if (memcmp(hdr, "fmt ", 4) || (size < 16) || (size > 
+				sizeof(hdr))) {
+			if (fseek(fp, size + (size & 1), SEEK_CUR) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (fread(hdr, 1, size + (size & 1), fp) != size + (size & 1)) {
+			return -1;
+		}
+		fmt   = ALIGN_LE16(hdr);
+		chans = ALIGN_LE16(hdr + 2);
+		rate  = (int) ALIGN_LE32(hdr + 4);
+		align = ALIGN_LE16(hdr + 12);
+		bits  = ALIGN_LE16(hdr + 14);
+		if ((fmt == 0xfffe) && (size >= 26)) {
+			fmt = ALIGN_LE16(hdr + 24);	/* WAVE_FORMAT_EXTENSIBLE */
+		}
+	}
+	if ((chans < 1) || (rate < 1000) || (align != chans * bits / 8) ||
+			!(((fmt == 1) && (bits == 8 || bits == 16 || 
+			bits == 24 || bits == 32)) || 
+			((fmt == 3) && (bits == 32)))) {
+		return -1;	/* not the PCM WAV */
+	}
+	n = 4096;
+	if ((buf = malloc(n * align)) == NULL) {
+		return -1;
+	}
+	next = (long long) rate * ALIGN_VAD_MS / 1000;
+	while (left >= (unsigned long) align) {
+		n = (int) MIN(4096, left / align);
+		if ((n = (int) fread(buf, align, n, fp)) <= 0) {
+			break;
+		}
+		left -= (unsigned long) n * align;
+		for (i = 0; i < n; i++) {
+			for (x = 0, c = 0; c < chans; c++) {
+				x += align_sample(buf + i * align + c * bits / 8,
+						fmt, bits);
+			}
+			x /= chans;
+			y = x - 0.97 * last;	/* pre-emphasis */
+			last = x;
+			sum += y * y;
+			cnt++;
+			if (++pos < next) {
+				continue;
+			}
+			if ((nf == max) && ((p = realloc(eng, 
+					(max + 65536) * sizeof(float))) != NULL)) {
+				eng = p;
+				max += 65536;
+			}
+			if (nf < max) {
+				eng[nf++] = (float)(sum / cnt);
+			}
+			sum = 0;
+			cnt = 0;
+			next = (long long) rate * ALIGN_VAD_MS * (nf + 1) / 1000;
+		}
+	}
+	free(buf);
+	if ((nf < 2) || ((*voice = align_vad(eng, nf)) == NULL)) {
+		free(eng);
+		return -1;
+	}
+	free(eng);
+	return nf;
+}
+
+/* Estimate 'a' and 'b' of voice = a * cue + b by the voice activity of
+ * the ALIGN_VAD_MS frames and the cues in pairs of the start and the end
+ * time. The voice is decimated to the bins and correlated by FFT with the
+ * spans of the cues for each candidate scale; the best peak wins. Then the
+ * cues are split into groups, and the lag of each group is searched in the
+ * frames by the prefix sums of the voice. The lags are fitted by Theil-Sen
+ * twice, firstly within the drift, secondly within the blur.
+ * Return the number of cues mostly voiced, or -1 if failed */
+int align_voice(unsigned char *voice, int nv, time_t *cue, int ncue,
+		double *scale, int nscale, double *a, double *b)
+{
+	ALIGNFFT	af;
+	double	peak, best = 0, tmax, tend = 0, lag, mean, energy, in, len;
+	int	*sum, i, k, per, nb, m, s, e;
+
+	if ((nv < 2) || (ncue < 2) || (nscale < 1)) {
+		return -1;
+	}
+	for (i = 0; i < ncue; i++) {
+		tend = MAX(tend, cue[i*2+1]);
+	}
+	tmax = (double) nv * ALIGN_VAD_MS;
+	for (i = 0; i < nscale; i++) {
+		tmax = MAX(tmax, tend * scale[i]);
+	}
+	if (align_alloc(&af, tmax, ALIGN_MAX_VOICE) < 0) {
+		return -1;
+	}
+	/* decimate the voice to the bins without the bias */
+	per = af.res / ALIGN_VAD_MS;
+	for (i = 0; i < nv; i++) {
+		af.rr[i/per] += voice[i];
+	}
+	nb = (nv + per - 1) / per;
+	for (i = 0, mean = 0; i < nb; i++) {
+		mean += af.rr[i] /= per;
+	}
+	for (i = 0, mean /= nb; i < nb; i++) {
+		af.rr[i] -= mean;
+	}
+	align_transform(af.rr, af.ri, af.n, af.tw, 0);
+
+	for (i = 0; i < nscale; i++) {
+		energy = align_spans(&af, cue, ncue, scale[i]);
+		lag = align_correlate(&af, &peak);
+		/* the stretched spans should not win by more energy */
+		peak /= sqrt(MAX(energy, 1.0));
+		if (peak > best) {
+			best = peak;
+			*a = scale[i];
+			*b = lag;
+		}
+	}
+	k = (int)((ALIGN_DRIFT * tmax + ALIGN_BLUR * af.res) / ALIGN_VAD_MS);
+	align_close(&af);
+	if (best <= 0) {
+		return -1;
+	}
+
+	/* the prefix sums of the voice for the score of any span */
+	if ((sum = malloc((nv + 1) * sizeof(int))) == NULL) {
+		return -1;
+	}
+	for (i = 0, sum[0] = 0; i < nv; i++) {
+		sum[i+1] = sum[i] + voice[i];
+	}
+	mean = (double) sum[nv] / nv;
+	align_groups(sum, nv, mean, cue, ncue, a, b, k);
+	align_groups(sum, nv, mean, cue, ncue, a, b, 
+			ALIGN_BLUR * ALIGN_BIN / ALIGN_VAD_MS);
+
+	for (i = m = 0, in = len = 0; i < ncue; i++) {
+		s = (int)((*a * cue[i*2] + *b) / ALIGN_VAD_MS);
+		e = (int)((*a * cue[i*2+1] + *b) / ALIGN_VAD_MS);
+		s = MAX(0, MIN(s, nv));
+		e = MAX(s, MIN(e, nv));
+		if ((e > s) && ((sum[e] - sum[s]) * 2 >= e - s)) {
+			m++;
+		}
+		in  += sum[e] - sum[s];
+		len += e - s;
+	}
+	/* the cues must be more voiced than the rest, or it's not matched */
+	if ((len == 0) || (in / len - (sum[nv] - MIN(in, sum[nv])) / 
+			MAX(nv - len, 1.0) < ALIGN_CONTRAST)) {
+		m = 0;
+	}
+	free(sum);
+	return m;
+}
+
+/* decode one sample to [-1, 1] */
+static float align_sample(unsigned char *in, int fmt, int bits)
+{
+	union	{
+		unsigned int	u;
+		float	f;
+	} v;
+
+	switch (bits) {
+	case 8:
+		return (in[0] - 128) / 128.0f;
+	case 16:
+		return (short) ALIGN_LE16(in) / 32768.0f;
+	case 24:
+		/* shift to the top for the sign */
+		v.u = ((unsigned) in[2] << 24) | ((unsigned) in[1] << 16) | 
+			((unsigned) in[0] << 8);
+		return (int) v.u / 2147483648.0f;
+	}
+	v.u = (unsigned int) ALIGN_LE32(in);
+	return (fmt == 3) ? v.f : (int) v.u / 2147483648.0f;
+}
+
+/* The frames well above the noise floor are voiced. The floor and the
+ * loudness are the lower and the upper percentiles of the energy by dB */
+static unsigned char *align_vad(float *eng, int n)
+{
+	unsigned char	*voice;
+	int	hist[121], i, k, floor, loud;
+
+	if ((voice = malloc(n)) == NULL) {
+		return NULL;
+	}
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < n; i++) {
+		k = (int)(-10.0 * log10(eng[i] + 1e-12));
+		voice[i] = (unsigned char) MAX(0, MIN(k, 120));
+		hist[voice[i]]++;
+	}
+	/* the dB is negative so the index counts from the loudest */
+	for (i = k = 0; (i < 120) && (k + hist[i] <= n / 20); k += hist[i++]);
+	loud = i;
+	for (i = 120, k = 0; (i > 0) && (k + hist[i] <= n / 5); k += hist[i--]);
+	floor = i;
+	for (i = 0; i < n; i++) {
+		voice[i] = voice[i] * 2 < floor + loud;
+	}
+	return voice;
+}
+
+/* Set the train of the scaled cue spans without the bias. Return its 
+ * energy */
+static double align_spans(ALIGNFFT *af, time_t *cue, int ncue, double scale)
+{
+	double	mean = 0, energy = 0;
+	int	i, k, s, e, last = 0;
+
+	memset(af->tr, 0, af->n * 2 * sizeof(double));
+	for (i = 0; i < ncue; i++) {
+		s = (int)(cue[i*2] * scale / af->res);
+		e = (int)(cue[i*2+1] * scale / af->res);
+		for (k = MAX(s, 0); (k <= e) && (k < af->n / 2); k++) {
+			af->tr[k] = 1.0;
+		}
+		last = MAX(last, MIN(e + 1, af->n / 2));
+	}
+	for (k = 0; k < last; k++) {
+		mean += af->tr[k];
+	}
+	mean /= MAX(last, 1);
+	for (k = 0; k < last; k++) {
+		af->tr[k] -= mean;
+		energy += af->tr[k] * af->tr[k];
+	}
+	return energy;
+}
+
+/* Split the cues into groups and search the lag of each group within 'win'
+ * frames. The lags against the time are fitted by Theil-Sen. Only the
+ * offset is searched if too few cues for the groups */
+static int align_groups(int *sum, int nv, double mean, time_t *cue, 
+		int ncue, double *a, double *b, int win)
+{
+	double	x[ALIGN_GROUP], y[ALIGN_GROUP], slope, c;
+	int	g, n = MIN(ALIGN_GROUP, ncue / 8), from, to;
+
+	if (n < 2) {
+		*b += align_speech(sum, nv, mean, cue, 0, ncue, *a, *b, win);
+		return 0;
+	}
+	for (g = 0; g < n; g++) {
+		from = ncue * g / n;
+		to = ncue * (g + 1) / n;
+		y[g] = align_speech(sum, nv, mean, cue, from, to, *a, *b, win);
+		x[g] = *a * (cue[from*2] + cue[(to-1)*2]) / 2.0;
+	}
+	if (align_theil(x, y, n, &slope, &c) < 0) {
+		return -1;
+	}
+	/* voice = a * t + b + c + slope * a * t */
+	*a *= 1.0 + slope;
+	*b += c;
+	return 0;
+}
+
+/* the lag in milliseconds of the cues which cover the most voice */
+static double align_speech(int *sum, int nv, double mean, time_t *cue,
+		int from, int to, double a, double b, int win)
+{
+	double	score, peak = 0;
+	int	i, k, s, e, lo = 0, hi = 0;
+
+	for (k = -win; k <= win; k++) {
+		for (score = 0, i = from; i < to; i++) {
+			s = (int)((a * cue[i*2] + b) / ALIGN_VAD_MS) + k;
+			e = (int)((a * cue[i*2+1] + b) / ALIGN_VAD_MS) + k;
+			s = MAX(0, MIN(s, nv));
+			e = MAX(s, MIN(e, nv));
+			score += sum[e] - sum[s] - mean * (e - s);
+		}
+		/* the cues are often longer than the voice so the peak
+		 * may be flat; take the middle of it */
+		if (score > peak) {
+			peak = score;
+			lo = hi = k;
+		} else if ((score == peak) && (hi == k - 1)) {
+			hi = k;
+		}
+	}
+	return (lo + hi) / 2.0 * ALIGN_VAD_MS;
+}
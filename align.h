@@ -0,0 +1,40 @@
+
+#ifndef _SUBSYNC_ALIGN_H_
+#define _SUBSYNC_ALIGN_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#define ALIGN_BIN	100	/* milliseconds per bin of the cue trains */
+#define ALIGN_BLUR	3	/* bins of the tolerance around the cues */
+#define ALIGN_MAX_FFT	(1 << 16)	/* the bins are widened beyond it */
+#define ALIGN_DRIFT	0.003	/* the drift scanned around the best scale */
+#define ALIGN_GROUP	32	/* groups of cues for the fine estimation */
+#define ALIGN_UNITY	1e-4	/* the scale closer to 1 is taken as 1 */
+#define ALIGN_OUTLIER	3.0	/* the pairs beyond the robust sigmas are rejected */
+#define ALIGN_FRAME	40	/* the residual within a frame is never rejected */
+#define ALIGN_SIGNIF	2.0	/* the scale within the standard errors of 1 */
+#define ALIGN_SEED	65536	/* the pairwise slopes sampled for the first fit */
+#define ALIGN_VAD_MS	10	/* milliseconds per frame of the voice activity */
+#define ALIGN_MAX_VOICE	(1 << 20)	/* the voice bins are widened beyond it */
+#define ALIGN_CONTRAST	0.2	/* the least voice in the cues over the rest */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int align_fft(double *re, double *im, int n, int inverse);
+int align_cues(time_t *ref, int nref, time_t *cue, int ncue,
+		double *scale, int nscale, double *a, double *b);
+int align_wave(FILE *fp, unsigned char **voice);
+int align_voice(unsigned char *voice, int nv, time_t *cue, int ncue,
+		double *scale, int nscale, double *a, double *b);
+int align_pairs(time_t *x, time_t *y, int n, double *a, double *b, 
+		double *rms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SUBSYNC_ALIGN_H_ */
+
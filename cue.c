@@ -0,0 +1,324 @@
+/*  cue.c -- the parsed subtitle in the structure of arrays
+    Copyright (C) 2009-2025  "Andy Xuming" <xuming@users.sourceforge.net>
+
+    This file is part of Subsync, a utility to resync subtitle files
+
+    Subsync is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Subsync is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cue.h"
+
+#define CUE_MIN		1024		/* the initial number of cues */
+#define CUE_ARENA	(256 * 1024)	/* the initial size of the arena */
+
+static int cue_grow(CUETAB *tab);
+static int cue_bound(CUETAB *tab, int *index, int n, int64_t ms);
+static void cue_merge(int *dst, int *src, int lo, int mid, int hi,
+		int64_t *key);
+
+
+/* Create the empty table. If 'base' is given, the arena is borrowed from
+ * the memory holding all contents, like the memory mapping of the file, so
+ * the records are located in place. Otherwise the contents are copied */
+CUETAB *cue_open(char *base)
+{
+	CUETAB	*tab;
+
+	if ((tab = calloc(1, sizeof(CUETAB))) == NULL) {
+		return NULL;
+	}
+	tab->arena = base;
+	if (cue_grow(tab) < 0) {
+		cue_close(tab);
+		return NULL;
+	}
+	return tab;
+}
+
+void cue_close(CUETAB *tab)
+{
+	free(tab->start);
+	free(tab->end);
+	free(tab->index);
+	free(tab->text);
+	free(tab->stamp);
+	free(tab->style);
+	free(tab->dirty);
+	if (tab->size) {
+		free(tab->arena);
+	}
+	free(tab);
+}
+
+/* Append the contents to the arena, or locate them in the borrowed arena.
+ * The contents must be appended in sequence. Return the offset, or -1 */
+long cue_text(CUETAB *tab, char *s, size_t len)
+{
+	char	*p;
+	size_t	n;
+
+	if (tab->arena && !tab->size) {
+		tab->used = (size_t)(s - tab->arena) + len;
+		return (long)(s - tab->arena);
+	}
+	if (tab->used + len > tab->size) {
+		for (n = tab->size ? tab->size : CUE_ARENA;
+				n < tab->used + len; n *= 2);
+		if ((p = realloc(tab->arena, n)) == NULL) {
+			return -1;
+		}
+		tab->arena = p;
+		tab->size = n;
+	}
+	memcpy(tab->arena + tab->used, s, len);
+	tab->used += len;
+	return (long)(tab->used - len);
+}
+
+/* Add the cue whose record starts at 'rec' in the arena. The 'stamp' is
+ * the beginning and the end of the start and the end time stamps in the
+ * record, and the 'style' is of the two time stamps, so the changed ones
+ * are written back the same way. Return the number of cues, or -1 */
+int cue_add(CUETAB *tab, size_t rec, int64_t start, int64_t end,
+		int *stamp, int *style)
+{
+	int	i = tab->num;
+
+	if ((i == tab->max) && (cue_grow(tab) < 0)) {
+		return -1;
+	}
+	tab->start[i] = start;
+	tab->end[i]   = end;
+	tab->index[i] = i;
+	tab->text[i]  = rec;
+	tab->dirty[i] = 0;
+	memcpy(tab->stamp + i * 4, stamp, 4 * sizeof(int));
+	tab->style[i*2]   = (unsigned char) style[0];
+	tab->style[i*2+1] = (unsigned char) style[1];
+	if (end - start > tab->longest) {
+		tab->longest = end - start;
+	}
+	if ((i > 0) && (start < tab->start[i-1])) {
+		tab->disorder++;
+	}
+	tab->num = tab->order = i + 1;
+	return tab->num;
+}
+
+/* the time stamps are worked out like subsync_tweak(), which is
+ * (ms + offset) * num / den truncated toward zero, and the 'den' 0 means
+ * no scale. The product is split by the quotient and the remainder of
+ * 'den' so it never overflows */
+void cue_linear(CUETAB *tab, int64_t offset, int64_t num, int64_t den)
+{
+	int64_t	*start = tab->start, *end = tab->end;
+	int	i, n = tab->num;
+
+	if (offset || den) {
+		memset(tab->dirty, 1, n);
+	}
+	if (offset) {
+		for (i = 0; i < n; i++) {
+			start[i] += offset;
+			end[i]   += offset;
+		}
+	}
+	if (den) {
+		for (i = 0; i < n; i++) {
+			start[i] = start[i] / den * num + start[i] % den * num / den;
+			end[i]   = end[i] / den * num + end[i] % den * num / den;
+		}
+	}
+}
+
+/* Remove the cues from 'from' to 'to' (from 1) in the file order out of the
+ * output order, the same as chop_filter(). Return the number of cues left */
+int cue_chop(CUETAB *tab, int from, int to)
+{
+	int	i, k, n;
+
+	if ((from < 0) && (to < 0)) {
+		return tab->order;	/* disabled */
+	}
+	for (i = n = 0; i < tab->order; i++) {
+		k = tab->index[i] + 1;
+		if (((from > 0) && (k < from)) || ((to > 0) && (k > to))) {
+			tab->index[n++] = tab->index[i];
+		}
+	}
+	return tab->order = n;
+}
+
+/* Remove the cues starting from 'from' to 'to' by milliseconds out of the
+ * output order, where 'to' -1 means to the end. If the cues are in order,
+ * the window is found by binary search and removed in one move. 
+ * Return the number of cues left */
+int cue_chop_time(CUETAB *tab, int64_t from, int64_t to)
+{
+	int64_t	ms;
+	int	i, lo, hi, n;
+
+	if (from < 0) {
+		return tab->order;	/* disabled */
+	}
+	if (tab->disorder) {
+		for (i = n = 0; i < tab->order; i++) {
+			ms = tab->start[tab->index[i]];
+			if ((ms < from) || ((to >= 0) && (ms > to))) {
+				tab->index[n++] = tab->index[i];
+			}
+		}
+		return tab->order = n;
+	}
+	lo = cue_bound(tab, tab->index, tab->order, from);
+	hi = (to < 0) ? tab->order : 
+		cue_bound(tab, tab->index, tab->order, to + 1);
+	if (hi > lo) {
+		memmove(tab->index + lo, tab->index + hi, 
+				(tab->order - hi) * sizeof(int));
+		tab->order -= hi - lo;
+	}
+	return tab->order;
+}
+
+/* Return the first cue in the file order starting at or after 'ms'. 
+ * The cues must be in order of the start time */
+int cue_search(CUETAB *tab, int64_t ms)
+{
+	return cue_bound(tab, NULL, tab->num, ms);
+}
+
+/* stable sort of the output order by the start time, which are mostly
+ * sorted already */
+void cue_sort(CUETAB *tab)
+{
+	int	*tmp, *src, *dst, *swap;
+	int	i, w, n = tab->order;
+
+	for (i = 1; i < n; i++) {
+		if (tab->start[tab->index[i]] < tab->start[tab->index[i-1]]) {
+			break;
+		}
+	}
+	if ((i >= n) || ((tmp = malloc(n * sizeof(int))) == NULL)) {
+		return;
+	}
+	/* bottom-up merge sort between the index and the temporary */
+	src = tab->index;
+	dst = tmp;
+	for (w = 1; w < n; w *= 2) {
+		for (i = 0; i < n; i += w * 2) {
+			cue_merge(dst, src, i, MIN(i + w, n), MIN(i + w * 2, n),
+					tab->start);
+		}
+		swap = src; src = dst; dst = swap;
+	}
+	if (src != tab->index) {
+		memcpy(tab->index, src, n * sizeof(int));
+	}
+	free(tmp);
+}
+
+/* Return the number of cues starting before the end of any cue ahead of
+ * them in the output order */
+int cue_overlap(CUETAB *tab)
+{
+	int64_t	last = INT64_MIN;
+	int	i, k, n = 0;
+
+	for (i = 0; i < tab->order; i++) {
+		k = tab->index[i];
+		n += tab->start[k] < last;
+		last = (tab->end[k] > last) ? tab->end[k] : last;
+	}
+	return n;
+}
+
+/* double the arrays. The record offsets have one more for the end */
+static int cue_grow(CUETAB *tab)
+{
+	void	*p;
+	int	max = tab->max ? tab->max * 2 : CUE_MIN;
+
+	if ((p = realloc(tab->start, max * sizeof(int64_t))) == NULL) {
+		return -1;
+	}
+	tab->start = p;
+	if ((p = realloc(tab->end, max * sizeof(int64_t))) == NULL) {
+		return -1;
+	}
+	tab->end = p;
+	if ((p = realloc(tab->index, max * sizeof(int))) == NULL) {
+		return -1;
+	}
+	tab->index = p;
+	if ((p = realloc(tab->text, (max + 1) * sizeof(size_t))) == NULL) {
+		return -1;
+	}
+	tab->text = p;
+	if ((p = realloc(tab->stamp, max * 4 * sizeof(int))) == NULL) {
+		return -1;
+	}
+	tab->stamp = p;
+	if ((p = realloc(tab->style, max * 2)) == NULL) {
+		return -1;
+	}
+	tab->style = p;
+	if ((p = realloc(tab->dirty, max)) == NULL) {
+		return -1;
+	}
+	tab->dirty = p;
+	tab->max = max;
+	return 0;
+}
+
+/* binary search of the first cue at or after 'ms' in the 'index', or in
+ * the file order if 'index' is NULL */
+static int cue_bound(CUETAB *tab, int *index, int n, int64_t ms)
+{
+	int	lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tab->start[index ? index[mid] : mid] < ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void cue_merge(int *dst, int *src, int lo, int mid, int hi,
+		int64_t *key)
+{
+	int	i = lo, j = mid, k = lo;
+
+	while ((i < mid) && (j < hi)) {
+		/* the left one goes first in the ties for stable */
+		dst[k++] = (key[src[j]] < key[src[i]]) ? src[j++] : src[i++];
+	}
+	while (i < mid) {
+		dst[k++] = src[i++];
+	}
+	while (j < hi) {
+		dst[k++] = src[j++];
+	}
+}
+
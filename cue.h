@@ -0,0 +1,53 @@
+
+#ifndef _SUBSYNC_CUE_H_
+#define _SUBSYNC_CUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The parsed subtitle by the structure of arrays, so the batch operations
+ * run through the time arrays only. Each cue has a record in the arena,
+ * from its own offset to the offset of the next cue, like the SRT serial
+ * number, the timing line and the text lines. The contents before the
+ * first cue is the head, like the ASS script info and styles */
+typedef	struct	_CUETAB	{
+	int64_t	*start;		/* the start time by milliseconds */
+	int64_t	*end;		/* the end time by milliseconds */
+	int	*index;		/* the cues in the output order */
+	size_t	*text;		/* the record in the arena, 'num' + 1 entries */
+	int	*stamp;		/* 4 offsets of the time stamps in the record */
+	unsigned char	*style;	/* 2 styles of the time stamps by mstofmt */
+	unsigned char	*dirty;	/* 1: the time stamps were changed */
+	int	num;		/* number of cues */
+	int	order;		/* number of cues in the output order */
+	int	max;
+	int	disorder;	/* number of cues starting before the previous */
+	int64_t	longest;	/* the longest duration of cues */
+
+	char	*arena;		/* the contents of the subtitle */
+	size_t	used;
+	size_t	size;		/* 0: the arena is borrowed */
+} CUETAB;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+CUETAB *cue_open(char *base);
+void cue_close(CUETAB *tab);
+long cue_text(CUETAB *tab, char *s, size_t len);
+int cue_add(CUETAB *tab, size_t rec, int64_t start, int64_t end,
+		int *stamp, int *style);
+void cue_linear(CUETAB *tab, int64_t offset, int64_t num, int64_t den);
+int cue_chop(CUETAB *tab, int from, int to);
+int cue_chop_time(CUETAB *tab, int64_t from, int64_t to);
+int cue_search(CUETAB *tab, int64_t ms);
+void cue_sort(CUETAB *tab);
+int cue_overlap(CUETAB *tab);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SUBSYNC_CUE_H_ */
+
@@ -0,0 +1,3118 @@
+/*  libsubsync.c -- the library to resync the subtitle's time stamps
+    Copyright (C) 2009-2025  "Andy Xuming" <xuming@users.sourceforge.net>
+
+    This file is part of Subsync, a utility to resync subtitle files
+
+    Subsync is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Subsync is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "utf.h"
+#include "scan.h"
+#include "align.h"
+#include "cue.h"
+#include "libsubsync.h"
+
+/* the in-memory streams are not available in MinGW */
+#if !defined(_WIN32)
+#define CFG_MEMSTREAM
+#endif
+
+/* the frame rates are exactly 30000/1001 for NTSC, 25 for PAL and
+ * 24000/1001 for Cinematic */
+static	struct	ScRate	{
+	char	*id;
+	time_t	num;
+	time_t	den;
+} srtbl[6] = {
+	{ "N-P",	1200, 1001 },	/* NTSC to PAL frame rate 29.97/25 */
+	{ "P-N",	1001, 1200 },	/* PAL to NTSC frame rate 25/29.97 */
+	{ "N-C",	5, 4 },		/* NTSC to Cinematic 29.97/23.976 */
+	{ "C-N",	4, 5 },		/* Cinematic to NTSC 23.976/29.97 */
+	{ "P-C",	1001, 960 },	/* PAL to Cinematic 25/23.976 */
+	{ "C-P",	960, 1001 },	/* Cinematic to PAL 23.976/25 */
+};
+
+/* the frame rates by the same identifiers. MicroDVD is Cinematic unless
+ * it's given by the option or the first line */
+static	struct	ScRate	fptbl[3] = {
+	{ "N",		30000, 1001 },	/* NTSC 29.97 */
+	{ "P",		25, 1 },	/* PAL 25 */
+	{ "C",		24000, 1001 },	/* Cinematic 23.976 */
+};
+
+/* the largest denominator approximating a real number scale */
+#define SUB_RATIO_MAX	1000000
+/* the time stamps and the numerator within them are scaled by the quick
+ * way, since their products are exact in double */
+#define SUB_RATIO_MS	((time_t)1 << 33)
+#define SUB_RATIO_NUM	((time_t)1 << 20)
+/* the end of the rule to the end of file */
+#define SUB_RULE_END	((time_t)1 << 62)
+/* the duration of the MicroDVD cue without the end frame, like {100}{} */
+#define SUB_MDVD_LAST	3000
+
+/* take the parameter of the option, which can't be another option */
+#define OPTARG(ctx,c,v)	{	\
+	--(c), ++(v); \
+	if (((c) == 0) || (**(v) == '-') || (**(v) == '+')) { \
+		ctx_report((ctx), "%s: missing parameter.", (v)[-1]); \
+		return -1; \
+	} \
+}
+
+/* The rule retimes the time stamps from 'from' to 'to' by its own offset
+ * and scale, like (ms + offset) * ratio[0] / ratio[1] */
+typedef	struct	_SUBRULE	{
+	time_t	from;
+	time_t	to;
+	time_t	offset;
+	time_t	ratio[2];	/* ratio[1] 0: no scale */
+	double	scale;
+} SUBRULE;
+
+/* the options and the running status of processing one subtitle file */
+struct	_SUBCTX	{
+	time_t	tm_offset;
+	double	tm_scale;	/* 0: no scale */
+	time_t	tm_ratio[2];	/* the exact scale of numerator / denominator */
+	time_t	tm_range[2];	/* the span, or the hull of all spans */
+	time_t	*tm_span;	/* sorted spans in pairs of (from, to) */
+	int	tm_spannum;	/* number of the spans if more than one */
+	int	tm_spanmax;	/* the allocated spans */
+	int	tm_chop[2];
+	time_t	tm_chopt[2];	/* chop the cues starting in the time */
+	int	tm_srtsn;	/* -1: not to orderize SRT sn  */
+	time_t	*tm_ref;	/* sorted cue times of the reference subtitle */
+	int	tm_refnum;
+	unsigned char	*tm_voice;	/* voice activity of the reference audio */
+	int	tm_voicenum;
+	time_t	*tm_map;	/* sorted anchors in pairs of (from, to) */
+	int	tm_mapnum;	/* number of the anchors */
+	int	tm_mapmax;	/* the allocated anchors */
+	int	tm_mapidx;	/* the segment of the last time stamp */
+	SUBRULE	*tm_rule;	/* sorted and disjoint rules, the earlier wins */
+	int	tm_rulenum;	/* number of the rules after resolving */
+	int	tm_rulemax;	/* the allocated rules */
+	int	tm_ruleidx;	/* the rule of the last time stamp */
+	time_t	tm_fps[2];	/* the frame rate of MicroDVD, 0: by the file */
+
+	char	*decode;
+	char	*encode;
+	int	same_code;	/* by default we output UTF-8 */
+	int	nomap;		/* 1: don't read the input by memory mapping */
+	int	nofile;		/* 1: refuse the options reading files */
+	int	nthread;	/* threads to retime one file by chunks */
+	int	invalid;	/* 0: keep 1: reject 2: repair the invalid UTF-8 */
+	int	table;		/* 1: retime by the cue table 2: and sort cues */
+	int	format;		/* -1: as it is, or convert to 0: SRT 2: WebVTT */
+	int	merge;		/* 2: combine the overlapped cues in merging */
+	void	(*report)(void *data, char *msg);	/* the diagnostics */
+	void	*report_data;
+
+	/* the kernel of subsync_tweak() selected by the options of each file */
+	time_t	(*tweak)(struct _SUBCTX *ctx, time_t ms);
+	int	srtsn;		/* the next SRT serial number */
+	int	subidx;		/* the subtitle counter for chopping */
+	int	magic;		/* -1: uncertain 0: SRT 1: SSA 2: WebVTT 
+				   3: MicroDVD */
+	int	convert;	/* 1: the file is converted to the 'format' */
+	int	block;		/* WebVTT: the line in the cue block from 1, or
+				   in other blocks from -1; 0: blank line.
+				   MicroDVD: -1 if the frame rate is first */
+	time_t	fps[2];		/* the frame rate of MicroDVD in the file */
+	int	chopped;	/* 1: in the cue chopped by time 2: after it */
+	char	hold[32];	/* the SRT serial number before the timing */
+	int	holdlen;
+	long	badoff;		/* the first invalid code in the input, or -1 */
+};
+
+/* a chunk of the memory mapped file retimed by a worker thread */
+typedef	struct	_SUBCHUNK	{
+	SUBCTX	ctx;
+	UTFB	*utf;		/* the slice of the memory mapping */
+	FILE	*fout;		/* the temporary output except the first chunk */
+	int	output;		/* 0: only counting the running status */
+	pthread_t	tid;
+	int	running;
+	size_t	from;
+	int	magic;		/* the running status in the beginning */
+	int	subidx;
+	int	srtsn;
+	int	block;
+} SUBCHUNK;
+
+/* an input of merging, which holds its next cue by the start time */
+typedef	struct	_SUBMERGE	{
+	SUBCTX	ctx;		/* the format and the running status of input */
+	UTFB	*utf;
+	FILE	*fin;
+	long	lines;		/* number of lines have been read */
+	time_t	ms[2];		/* the start and the end time of the cue */
+	char	*lf;		/* the line break of the cue */
+	int	vtt;		/* 1: the text may have inline time stamps */
+	char	*text;		/* the text lines of the cue */
+	size_t	len;
+	size_t	size;
+} SUBMERGE;
+
+/* the smallest chunk worth a thread */
+#define SUB_CHUNK_MIN	(1024 * 1024)
+/* how far to look for a cue boundary before splitting at any line */
+#define SUB_CUE_SCAN	(64 * 1024)
+
+static int retime_utf(SUBCTX *ctx, FILE *fin, FILE *fout, 
+		char *inbuf, size_t inlen);
+static int retime_map(SUBCTX *ctx, UTFB *utf, FILE *fout);
+static int retime_split(SUBCTX *ctx, UTFB *utf, FILE *fout);
+static size_t retime_cue(UTFB *utf, size_t pos);
+static int retime_table(SUBCTX *ctx, UTFB *utf, FILE *fin, FILE *fout,
+		int mode);
+static char *table_line(UTFB *utf, FILE *fin, int mode, size_t *len);
+static int table_parse(CUETAB *tab, char *s, size_t len, long *lead,
+		int *style);
+static int table_write(SUBCTX *ctx, CUETAB *tab, UTFB *utf, FILE *fout,
+		int style);
+static void table_retime(SUBCTX *ctx, CUETAB *tab);
+static int retime_chunks(SUBCHUNK *ck, int n, int output);
+static void *retime_chunk(void *arg);
+static int retime_line(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s, 
+		size_t len, int inplace);
+static char *retime_stamp(SUBCTX *ctx, UTFB *utf, FILE *fout, char **mark,
+		char *s, char *e, int inplace);
+static void retime_inline(SUBCTX *ctx, UTFB *utf, FILE *fout, char **mark,
+		char *s, char *e, int inplace);
+static time_t retime_read(char *s, char *e, int *n, int *style);
+static void retime_format(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		size_t len);
+static void vtt_block(SUBCTX *ctx, int cls, char *body);
+static int vtt_tag(char *s, char *e);
+static int chop_time(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		char *e, int cls, char *body);
+static int chop_inside(SUBCTX *ctx, time_t ms);
+static int retime_frames(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		char *e, int inplace);
+static char *mdvd_read(SUBCTX *ctx, char *s, char *e, time_t *ms);
+static int mdvd_write(SUBCTX *ctx, UTFB *utf, FILE *fout, time_t *ms,
+		char *s, char *e);
+static char *mdvd_style(char *s, char *e, int *style);
+static int mdvd_tags(char *buf, int style, int close);
+static time_t frame_to_ms(time_t frame, time_t *fps);
+static time_t ms_to_frame(time_t ms, time_t *fps);
+static int merge_read(SUBCTX *ctx, SUBMERGE *in);
+static int merge_frames(SUBMERGE *in, char *s, char *e);
+static int merge_text(SUBMERGE *in, char *s, size_t len);
+static void merge_write(SUBCTX *ctx, UTFB *utf, FILE *fout, SUBMERGE *cue,
+		int style);
+static void merge_heap(SUBMERGE *in, int *heap, int n, int i);
+static int merge_before(SUBMERGE *in, int a, int b);
+static void retime_linear(SUBCTX *ctx, double a, double b);
+static int retime_cues(FILE *fin, char *decode, time_t **cue, int span);
+static int cue_compare(const void *a, const void *b);
+static int map_anchor(SUBCTX *ctx, char *s);
+static int map_search(time_t *map, int n, time_t ms);
+static time_t map_time(SUBCTX *ctx, time_t ms);
+static int itofmt(char *buf, long val);
+static void tweak_select(SUBCTX *ctx);
+static int tweak_inside(SUBCTX *ctx, time_t ms);
+static time_t tweak_none(SUBCTX *ctx, time_t ms);
+static time_t tweak_offset(SUBCTX *ctx, time_t ms);
+static time_t tweak_scale(SUBCTX *ctx, time_t ms);
+static time_t tweak_linear(SUBCTX *ctx, time_t ms);
+static time_t tweak_span(SUBCTX *ctx, time_t ms);
+static time_t ratio_scale(time_t ms, time_t *ratio, double scale);
+static int ratio_reduce(time_t *ratio);
+static void ratio_approx(double x, time_t *ratio);
+static int rule_parse(SUBCTX *ctx, char *s);
+static SUBRULE *rule_find(SUBCTX *ctx, time_t ms);
+static int rule_compare(const void *a, const void *b);
+static void *ctx_dup(void *p, size_t size);
+static void ctx_report(SUBCTX *ctx, char *fmt, ...);
+static FILE *ctx_fopen(SUBCTX *ctx, char *fname);
+static int chop_filter(SUBCTX *ctx, char *s);
+static time_t timetoms(int hour, int min, int sec, int msec);
+static int arg_ratio(char *s, time_t *ratio);
+static int arg_fps(char *s, time_t *fps);
+static int is_number(char *s);
+static int copy_file(FILE *fin, FILE *fout);
+
+
+/* Allocate the context of the default options, which should be freed by
+ * subsync_free(). Return NULL if out of memory */
+SUBCTX *subsync_alloc(void)
+{
+	SUBCTX	*ctx;
+
+	scan_init();	/* the scanners are selected before any threads */
+	if ((ctx = calloc(1, sizeof(SUBCTX))) == NULL) {
+		return NULL;
+	}
+	ctx->tm_range[0] = ctx->tm_range[1] = -1;
+	ctx->tm_chop[0] = ctx->tm_chop[1] = -1;
+	ctx->tm_chopt[0] = ctx->tm_chopt[1] = -1;
+	ctx->tm_srtsn = -1;
+	ctx->format = -1;
+	ctx->magic = -1;
+	ctx->badoff = -1;
+	return ctx;
+}
+
+/* Duplicate the context with its own anchors, spans, rules and references,
+ * so either can be changed or freed alone. Return NULL if out of memory */
+SUBCTX *subsync_dup(SUBCTX *ctx)
+{
+	SUBCTX	*dup;
+
+	if ((dup = malloc(sizeof(SUBCTX))) == NULL) {
+		return NULL;
+	}
+	*dup = *ctx;
+	dup->tm_map = ctx_dup(ctx->tm_map, ctx->tm_mapnum * 2 * sizeof(time_t));
+	dup->tm_mapmax = dup->tm_map ? ctx->tm_mapnum : 0;
+	dup->tm_span = ctx_dup(ctx->tm_span, 
+			ctx->tm_spannum * 2 * sizeof(time_t));
+	dup->tm_spanmax = dup->tm_span ? ctx->tm_spannum : 0;
+	dup->tm_rule = ctx_dup(ctx->tm_rule, ctx->tm_rulenum * sizeof(SUBRULE));
+	dup->tm_rulemax = dup->tm_rule ? ctx->tm_rulenum : 0;
+	dup->tm_ref = ctx_dup(ctx->tm_ref, ctx->tm_refnum * sizeof(time_t));
+	dup->tm_voice = ctx_dup(ctx->tm_voice, ctx->tm_voicenum);
+	if ((!dup->tm_map && ctx->tm_map && ctx->tm_mapnum) ||
+			(!dup->tm_span && ctx->tm_span && ctx->tm_spannum) ||
+			(!dup->tm_rule && ctx->tm_rule && ctx->tm_rulenum) ||
+			(!dup->tm_ref && ctx->tm_ref) || 
+			(!dup->tm_voice && ctx->tm_voice)) {
+		subsync_free(dup);
+		return NULL;
+	}
+	return dup;
+}
+
+/* free the context with its anchors, spans, rules and references */
+void subsync_free(SUBCTX *ctx)
+{
+	if (ctx) {
+		free(ctx->tm_map);
+		free(ctx->tm_span);
+		free(ctx->tm_rule);
+		free(ctx->tm_ref);
+		free(ctx->tm_voice);
+		free(ctx);
+	}
+}
+
+/* Set the callback of the diagnostics, like the failures of the files and
+ * the result of fitting. The library keeps quiet if it is NULL */
+void subsync_report(SUBCTX *ctx, void (*report)(void *, char *), void *data)
+{
+	ctx->report = report;
+	ctx->report_data = data;
+}
+
+/* Parse the retiming option in 'argv', which is shared by the command line
+ * and the requests of the server mode. The parameters taken are skipped
+ * by '*argc' and '*argv'. Return 1 if the option is taken, 0 if not an 
+ * option of retiming, or -1 if its parameters are wrong */
+int subsync_option(SUBCTX *ctx, int *argc, char ***argv)
+{
+	time_t	from, to, ratio[2];
+	char	*opt = **argv;
+
+	if (!strcmp(opt, "-c") || !strcmp(opt, "--chop")) {
+		OPTARG(ctx, *argc, *argv);
+		if (sscanf(**argv, "%d : %d", ctx->tm_chop, ctx->tm_chop + 1) != 2) {
+			ctx->tm_chop[0] = ctx->tm_chop[1] = -1;
+		}
+	} else if (!strcmp(opt, "--chop-time")) {
+		OPTARG(ctx, *argc, *argv);
+		ctx->tm_chopt[0] = subsync_offset(**argv);
+		ctx->tm_chopt[1] = -1;
+		/* the second parameter is optional, must begin in number */
+		if ((*argc > 1) && isdigit((*argv)[1][0])) {
+			--*argc; ctx->tm_chopt[1] = subsync_offset(*++*argv);
+		}
+		/* only the cue table knows the time of a whole cue */
+		if (ctx->table == 0) {
+			ctx->table = 1;
+		}
+	} else if (!strcmp(opt, "-d") || !strcmp(opt, "--decoding")) {
+		OPTARG(ctx, *argc, *argv);
+		ctx->decode = **argv;
+	} else if (!strcmp(opt, "-e") || !strcmp(opt, "--encoding")) {
+		OPTARG(ctx, *argc, *argv);
+		ctx->encode = **argv;
+	} else if (!strcmp(opt, "--fit")) {
+		OPTARG(ctx, *argc, *argv);
+		if (subsync_fitting(ctx, **argv) < 0) {
+			return -1;
+		}
+	} else if (!strcmp(opt, "--fps")) {
+		OPTARG(ctx, *argc, *argv);
+		if (arg_fps(**argv, ctx->tm_fps) < 0) {
+			ctx_report(ctx, "%s: invalid frame rate", **argv);
+			return -1;
+		}
+	} else if (!strcmp(opt, "--invalid")) {
+		OPTARG(ctx, *argc, *argv);
+		if (!strcmp(**argv, "keep")) {
+			ctx->invalid = UTF_BAD_KEEP;
+		} else if (!strcmp(**argv, "reject")) {
+			ctx->invalid = UTF_BAD_REJECT;
+		} else if (!strcmp(**argv, "repair")) {
+			ctx->invalid = UTF_BAD_REPAIR;
+		} else {
+			ctx_report(ctx, "%s: unknown mode", **argv);
+			return -1;
+		}
+	} else if (!strncmp(opt, "--same-coding", 6)) {
+		ctx->same_code = 1;
+	} else if (!strcmp(opt, "-m") || !strcmp(opt, "--map")) {
+		OPTARG(ctx, *argc, *argv);
+		if (subsync_mapping(ctx, **argv) < 0) {
+			return -1;
+		}
+	} else if (!strcmp(opt, "-r") || !strcmp(opt, "--reorder")) {
+		if ((*argc > 1) && is_number((*argv)[1])) {
+			--*argc; ctx->tm_srtsn = (int)strtol(*++*argv, NULL, 0);
+		} else {
+			ctx->tm_srtsn = 1;	/* set as default */
+		}
+	} else if (!strcmp(opt, "--rule")) {
+		OPTARG(ctx, *argc, *argv);
+		if (subsync_rules(ctx, **argv) < 0) {
+			return -1;
+		}
+	} else if (!strcmp(opt, "--to")) {
+		OPTARG(ctx, *argc, *argv);
+		if (!strcmp(**argv, "srt")) {
+			ctx->format = 0;
+		} else if (!strcmp(**argv, "vtt")) {
+			ctx->format = 2;
+		} else {
+			ctx_report(ctx, "%s: unknown format", **argv);
+			return -1;
+		}
+	} else if (!strcmp(opt, "--table")) {
+		if (ctx->table == 0) {
+			ctx->table = 1;
+		}
+	} else if (!strcmp(opt, "--sort")) {
+		ctx->table = 2;
+	} else if (!strcmp(opt, "-s") || !strcmp(opt, "--span")) {
+		OPTARG(ctx, *argc, *argv);
+		from = subsync_offset(**argv);
+		to = -1;
+		/* the second parameter is optional, must begin in number */
+		if ((*argc > 1) && isdigit((*argv)[1][0])) {
+			--*argc; to = subsync_offset(*++*argv);
+		}
+		if (subsync_span(ctx, from, to) < 0) {
+			ctx_report(ctx, "%s: invalid span.", **argv);
+			return -1;
+		}
+	} else if (arg_ratio(opt, ratio) == 0) {
+		subsync_scale(ctx, ratio[0], ratio[1]);
+	} else if (subsync_offset(opt) != -1) {
+		ctx->tm_offset = subsync_offset(opt);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* is the context free of any option of retiming */
+int subsync_idle(SUBCTX *ctx)
+{
+	return (ctx->tm_offset == 0) && (ctx->tm_scale == 0) && 
+		(ctx->tm_srtsn < 0) && (ctx->tm_chop[0] < 0) && 
+		(ctx->tm_chop[1] < 0) && (ctx->tm_chopt[0] < 0) && 
+		(ctx->tm_range[0] < 0) && (ctx->tm_mapnum == 0) && 
+		(ctx->tm_rulenum == 0) && (ctx->format < 0) && !ctx->table;
+}
+
+/* the threads to retime one file by chunks */
+void subsync_threads(SUBCTX *ctx, int nthread)
+{
+	ctx->nthread = nthread;
+}
+
+/* 1: read the input line by line instead of memory mapping */
+void subsync_nomap(SUBCTX *ctx, int nomap)
+{
+	ctx->nomap = nomap;
+}
+
+/* 1: refuse the options reading files, like --fit, or --map and --rule
+ * by files, so only the inline anchors and rules are taken */
+void subsync_nofile(SUBCTX *ctx, int nofile)
+{
+	ctx->nofile = nofile;
+}
+
+void subsync_dump(SUBCTX *ctx, FILE *fout)
+{
+	fprintf(fout, "Time Stamp Offset:   %ld\n", (long)ctx->tm_offset);
+	fprintf(fout, "Time Stamp Scaling:  %f (%ld/%ld)\n", ctx->tm_scale,
+			(long)ctx->tm_ratio[0], (long)ctx->tm_ratio[1]);
+	fprintf(fout, "Time Stamp range:    from %ld to %ld\n", 
+			(long)ctx->tm_range[0], (long)ctx->tm_range[1]);
+	fprintf(fout, "Time Stamp spans:    %d\n", ctx->tm_spannum);
+	fprintf(fout, "Time Stamp anchors:  %d\n", ctx->tm_mapnum);
+	fprintf(fout, "Time Stamp rules:    %d\n", ctx->tm_rulenum);
+	fprintf(fout, "SRT serial Number:   from %d\n", ctx->tm_srtsn);
+	fprintf(fout, "Subtitle chopping:   from %d to %d\n", 
+			ctx->tm_chop[0], ctx->tm_chop[1]);
+	fprintf(fout, "Subtitle chop time:  from %ld to %ld\n", 
+			(long)ctx->tm_chopt[0], (long)ctx->tm_chopt[1]);
+	fprintf(fout, "Subtitle format:     %s\n", (ctx->format == 0) ? "SRT" :
+			(ctx->format == 2) ? "WebVTT" : "as it is");
+	fprintf(fout, "MicroDVD frame rate: %ld/%ld\n", (long)ctx->tm_fps[0], 
+			(long)ctx->tm_fps[1]);
+}
+
+int subsync_retime(SUBCTX *ctx, FILE *fin, FILE *fout)
+{
+	return retime_utf(ctx, fin, fout, NULL, 0);
+}
+
+/* Retime the subtitle in the memory buffer 'in'. The output is stored in
+ * a newly allocated buffer '*out', which should be freed by the caller */
+int subsync_buffer(SUBCTX *ctx, char *in, size_t inlen, 
+		char **out, size_t *outlen)
+{
+	FILE	*fin, *fout;
+	int	rc;
+
+	*out = NULL;
+	*outlen = 0;
+	if (!inlen) {
+		return (*out = calloc(1, 1)) ? 0 : -1;
+	}
+#ifdef	CFG_MEMSTREAM
+	if ((fin = fmemopen(in, inlen, "rb")) == NULL) {
+		return -1;
+	}
+	if ((fout = open_memstream(out, outlen)) == NULL) {
+		fclose(fin);
+		return -1;
+	}
+	rc = retime_utf(ctx, fin, fout, in, inlen);
+	fclose(fin);
+	fclose(fout);	/* the '*out' and '*outlen' are ready now */
+#else
+	long	size;
+
+	if ((fin = tmpfile()) == NULL) {
+		return -1;
+	}
+	if ((fout = tmpfile()) == NULL) {
+		fclose(fin);
+		return -1;
+	}
+	fwrite(in, 1, inlen, fin);
+	rewind(fin);
+	rc = retime_utf(ctx, fin, fout, NULL, 0);
+	size = ftell(fout);
+	rewind(fout);
+	if ((*out = malloc(size + 1)) == NULL) {
+		rc = -1;
+	} else {
+		*outlen = fread(*out, 1, size, fout);
+		(*out)[*outlen] = 0;
+	}
+	fclose(fin);
+	fclose(fout);
+#endif
+	return rc;
+}
+
+/* retime the subtitle from 'fin' to 'fout'. If 'inbuf' is given, 'fin' is 
+ * the memory stream on it so the UTF-8 contents can be read in place */
+static int retime_utf(SUBCTX *ctx, FILE *fin, FILE *fout, 
+		char *inbuf, size_t inlen)
+{
+	UTFB	*utf;
+	char	*s;
+	size_t	len;
+	int	n, rc, err = 0;
+
+	if ((utf = utf_open(fin, ctx->decode, ctx->encode)) == NULL) {
+		return -1;
+	}
+	if (!ctx->same_code && !ctx->encode) {
+		utf->na_enc[0] = 0;	/* force UTF-8 output */
+	}
+	utf->bad_mode = ctx->invalid;
+
+	/* reset the running status for each file */
+	ctx->srtsn  = ctx->tm_srtsn;
+	ctx->subidx = 0;
+	ctx->magic  = -1;
+	ctx->convert = 0;
+	ctx->block  = 0;
+	ctx->chopped = 0;
+	ctx->holdlen = 0;
+	ctx->badoff = -1;
+	tweak_select(ctx);
+
+	if (ctx->nomap) {
+		rc = -1;
+	} else if (inbuf) {
+		rc = utf_map_buffer(utf, fin, inbuf, inlen);
+	} else {
+		rc = utf_map(utf, fin);
+	}
+	if ((rc < 0) && !ctx->nomap && !utf_map_decode(utf, fin)) {
+		rc = 1;		/* other contents are decoded block by block */
+	}
+	/* the ill-formed mapping or first block is rejected before output */
+	if (!utf->bad_err) {
+		utf_write_bom(utf, fout);
+	}
+	/* the format is known by the first line in the mapping */
+	if ((rc >= 0) && !utf->bad_err) {
+		retime_format(ctx, utf, fout, utf->map + utf->mapidx,
+				utf->maplen - utf->mapidx);
+	}
+	if (utf->bad_err) {
+		rc = -1;
+	} else if (ctx->table && !ctx->convert && (ctx->magic != 3)) {
+		if ((err = retime_table(ctx, utf, fin, fout, rc)) < 0) {
+			ctx_report(ctx, "Not enough memory for the cue table.");
+		}
+	} else if (rc == 0) {
+		/* UTF-8 file is processed in place of the memory mapping */
+		if ((ctx->nthread < 2) || (retime_split(ctx, utf, fout) < 0)) {
+			retime_map(ctx, utf, fout);
+		}
+	} else if (rc == 1) {
+		do {
+			retime_map(ctx, utf, fout);
+		} while (!utf_map_decode(utf, fin));
+	} else {
+		for (n = 0; (s = utf_getline(utf, fin, &len)) != NULL; n++) {
+			if (n == 0) {
+				retime_format(ctx, utf, fout, s, len);
+			}
+			retime_line(ctx, utf, fout, s, len, 1);
+		}
+		utf_cache(utf, fout, NULL, 0);		/* flush the output */
+	}
+	if (ctx->holdlen && !utf->bad_err) {
+		/* the serial number in the end without the timing line */
+		retime_line(ctx, utf, fout, ctx->hold, ctx->holdlen, 1);
+		utf_cache(utf, fout, NULL, 0);
+	}
+	if (utf->bin_err && !utf->bad_err) {
+		ctx_report(ctx, "Binary file detected.");
+	}
+	if ((ctx->badoff = utf->bad_off) >= 0) {
+		ctx_report(ctx, "Invalid code at offset %ld%s.", utf->bad_off,
+				utf->bad_err ? ", rejected" : "");
+	}
+	utf_write(utf, fout, NULL, 0);	/* end the stateful encoding */
+	rc = (utf->bad_err || err) ? -1 : 0;
+	utf_close(utf);
+	return rc;
+}
+
+/* retime the lines in the memory mapping. If 'fout' is NULL, it only counts
+ * the running status without output, so the mapping must not be rewritten
+ * before the real pass */
+static int retime_map(SUBCTX *ctx, UTFB *utf, FILE *fout)
+{
+	char	buf[4096], *s, *p;
+	size_t	len;
+	int	inplace = utf->mapwrite && fout;
+
+	while ((s = utf_mapline(utf, &len)) != NULL) {
+		if (s[len-1] == 0xa) {
+			retime_line(ctx, utf, fout, s, len, inplace);
+		} else if (len < sizeof(buf)) {
+			/* the last line without line break must be 
+			 * terminated properly for the parsers */
+			memcpy(buf, s, len);
+			buf[len] = 0;
+			retime_line(ctx, utf, fout, buf, len, 1);
+		} else if ((p = malloc(len + 1)) != NULL) {
+			/* not strndup(), the decoded line may contain NUL */
+			memcpy(p, s, len);
+			p[len] = 0;
+			retime_line(ctx, utf, fout, p, len, 1);
+			free(p);
+		}
+	}
+	if (fout) {
+		utf_cache(utf, fout, NULL, 0);		/* flush the output */
+	}
+	return 0;
+}
+
+/* Retime by the cue table. The whole subtitle is parsed into the table,
+ * then the time stamps are worked out by the batch operations and the 
+ * records of the cues are written in the output order. The 'mode' is how
+ * the lines are read: 0 the memory mapping, 1 the decoded blocks, or -1
+ * line buffered */
+static int retime_table(SUBCTX *ctx, UTFB *utf, FILE *fin, FILE *fout,
+		int mode)
+{
+	CUETAB	*tab;
+	char	*s;
+	size_t	len;
+	long	lead = -1;
+	int	n, style = -1;
+
+	/* the UTF-8 mapping holds all contents so they are not copied */
+	if ((tab = cue_open(mode ? NULL : utf->map)) == NULL) {
+		return -1;
+	}
+	while ((s = table_line(utf, fin, mode, &len)) != NULL) {
+		if (table_parse(tab, s, len, &lead, &style) < 0) {
+			cue_close(tab);
+			return -1;
+		}
+	}
+	/* the chopping time is of the original time stamps */
+	cue_chop_time(tab, ctx->tm_chopt[0], ctx->tm_chopt[1]);
+	if ((ctx->tm_range[0] < 0) && (ctx->tm_mapnum == 0) && 
+			(ctx->tm_rulenum == 0)) {
+		cue_linear(tab, ctx->tm_offset, ctx->tm_ratio[0], 
+				ctx->tm_ratio[1]);
+	} else {
+		table_retime(ctx, tab);
+	}
+	cue_chop(tab, ctx->tm_chop[0], ctx->tm_chop[1]);
+	if (ctx->table > 1) {
+		cue_sort(tab);
+	}
+	/* the overlapped SRT cues are likely mistakes */
+	if ((style == 0) && ((n = cue_overlap(tab)) > 0)) {
+		ctx_report(ctx, "%d cues overlap the previous ones.", n);
+	}
+	table_write(ctx, tab, utf, fout, style);
+	cue_close(tab);
+	return 0;
+}
+
+static char *table_line(UTFB *utf, FILE *fin, int mode, size_t *len)
+{
+	char	*s;
+
+	if (mode < 0) {
+		return utf_getline(utf, fin, len);
+	}
+	while ((s = utf_mapline(utf, len)) == NULL) {
+		if ((mode == 0) || utf_map_decode(utf, fin)) {
+			return NULL;
+		}
+	}
+	return s;
+}
+
+/* Add the line to the table. A cue starts from the SRT serial number or
+ * the WebVTT cue identifier in 'lead' before the timing line, or the ASS
+ * dialogue line, and takes the following lines till the next cue */
+static int table_parse(CUETAB *tab, char *s, size_t len, long *lead,
+		int *style)
+{
+	char	buf[256], *p, *e;
+	time_t	start, end;
+	long	off;
+	int	st[4], sty[2], k, n, cls;
+
+	if ((off = cue_text(tab, s, len)) < 0) {
+		return -1;
+	}
+	/* the parsers need the line break or NUL in the end */
+	if ((len == 0) || (s[len-1] != 0xa)) {
+		if (len >= sizeof(buf)) {
+			return 0;	/* too long for a time stamp line */
+		}
+		memcpy(buf, s, len);
+		buf[len] = 0;
+		s = buf;
+	}
+	e = s + len;
+	switch (cls = scan_class(s, e, &p)) {
+	case SCAN_SERIAL:
+		*lead = off;
+		return 0;
+	case SCAN_DIALOGUE:
+		*lead = off;
+		if ((p = memchr(p, ',', e - p)) == NULL) {
+			return 0;
+		}
+		p++;
+		break;
+	case SCAN_TIMING:
+		if (*lead < 0) {
+			*lead = off;
+		}
+		break;
+	case SCAN_BLANK:
+		*lead = -2;	/* the next line may be the cue identifier */
+		return 0;
+	default:
+		*lead = (*lead == -2) ? off : -1;
+		return 0;
+	}
+	if ((start = retime_read(p, e, &k, sty)) == -1) {
+		*lead = -1;
+		return 0;
+	}
+	if (*style < 0) {
+		*style = sty[0];
+	}
+	st[0] = (int)(off - *lead + (p - s));
+	st[1] = st[0] + k;
+	/* SRT: skip everything before the second time stamp
+	 * ASS: the second time stamp is after the next ',' */
+	if (cls == SCAN_DIALOGUE) {
+		p = memchr(p + k, ',', e - p - k);
+		p = p ? p + 1 : e;
+	} else {
+		for (p += k; (p < e) && !isdigit(*p); p++);
+	}
+	if ((end = retime_read(p, e, &k, sty + 1)) == -1) {
+		st[2] = st[3] = st[1];
+		sty[1] = sty[0];
+		end = start;
+	} else {
+		st[2] = (int)(off - *lead + (p - s));
+		st[3] = st[2] + k;
+	}
+	n = cue_add(tab, *lead, start, end, st, sty);
+	*lead = -1;
+	return (n < 0) ? -1 : 0;
+}
+
+/* write the head and the records of the cues in the output order. The
+ * WebVTT cues may have the inline time stamps so they are always parsed */
+static int table_write(SUBCTX *ctx, CUETAB *tab, UTFB *utf, FILE *fout,
+		int style)
+{
+	char	tmp[64], *rec, *s, *p, *e;
+	int	i, k, n, *st, srtsn = ctx->tm_srtsn;
+
+	style = MAX(style, 0);
+	tab->text[tab->num] = tab->used;
+	utf_span(utf, fout, tab->arena, tab->num ? tab->text[0] : tab->used);
+	for (k = 0; k < tab->order; k++) {
+		i = tab->index[k];
+		/* the untouched cues in sequence are copied by one span */
+		if ((srtsn <= 0) && !tab->dirty[i] && (style < 5)) {
+			for (n = i + 1; (k < tab->order - 1) && 
+					(tab->index[k+1] == n) && 
+					!tab->dirty[n]; k++, n++);
+			utf_span(utf, fout, tab->arena + tab->text[i], 
+					tab->text[n] - tab->text[i]);
+			continue;
+		}
+		rec = s = tab->arena + tab->text[i];
+		st = tab->stamp + i * 4;
+		/* SRT serial numbers to be re-ordered */
+		if ((srtsn > 0) && (st[0] > 0) && 
+				(scan_class(rec, rec + st[0], &p) == SCAN_SERIAL)) {
+			utf_span(utf, fout, rec, p - rec);
+			utf_cache(utf, fout, tmp, itofmt(tmp, srtsn++));
+			for (s = p; isdigit(*s); s++);
+		}
+		utf_span(utf, fout, s, rec + st[0] - s);
+		if (tab->dirty[i]) {
+			n = subsync_mstofmt(tmp, tab->start[i], tab->style[i*2]);
+			utf_cache(utf, fout, tmp, n);
+			utf_span(utf, fout, rec + st[1], st[2] - st[1]);
+			if (st[3] > st[2]) {
+				n = subsync_mstofmt(tmp, tab->end[i], 
+						tab->style[i*2+1]);
+				utf_cache(utf, fout, tmp, n);
+			}
+		} else {
+			utf_span(utf, fout, rec + st[0], st[3] - st[0]);
+		}
+		s = rec + st[3];
+		e = rec + tab->text[i+1] - tab->text[i];
+		if (style >= 5) {
+			retime_inline(ctx, utf, fout, &s, s, e, 0);
+		}
+		utf_span(utf, fout, s, e - s);
+	}
+	utf_cache(utf, fout, NULL, 0);		/* flush the output */
+	return 0;
+}
+
+/* Retime the cues which may have time stamps in the spans. If the cues are
+ * in order, they are found by binary search, where the cue ending in the
+ * span starts no earlier than the longest duration before the span */
+static void table_retime(SUBCTX *ctx, CUETAB *tab)
+{
+	time_t	*span, ms, me;
+	int	i, k, n, lo, hi;
+
+	if (ctx->tm_spannum > 0) {
+		span = ctx->tm_span;
+		n = ctx->tm_spannum;
+	} else {
+		span = ctx->tm_range;
+		n = 1;
+	}
+	for (k = hi = 0; k < n; k++, span += 2) {
+		lo = hi;	/* never retime a cue twice */
+		hi = tab->num;
+		if (!tab->disorder && !ctx->tm_rulenum && (span[0] > -1)) {
+			lo = MAX(lo, cue_search(tab, span[0] - tab->longest));
+			if (span[1] > -1) {
+				hi = MAX(lo, cue_search(tab, span[1] + 1));
+			}
+		}
+		for (i = lo; i < hi; i++) {
+			ms = ctx->tweak(ctx, tab->start[i]);
+			me = ctx->tweak(ctx, tab->end[i]);
+			if ((ms != tab->start[i]) || (me != tab->end[i])) {
+				tab->start[i] = ms;
+				tab->end[i]   = me;
+				tab->dirty[i] = 1;
+			}
+		}
+	}
+}
+
+/* Split the memory mapping into chunks at the cue boundaries and retime
+ * them by threads. The chopping index and the SRT serial numbers in the
+ * beginning of each chunk are worked out by the counting passes first.
+ * Return -1 if the file is too small to be split */
+static int retime_split(SUBCTX *ctx, UTFB *utf, FILE *fout)
+{
+	SUBCHUNK	*ck;
+	SUBCTX	tmp;
+	size_t	bound, size, len, lower;
+	char	*s;
+	int	i, n, total, chop, idx;
+
+	size = utf->maplen - utf->mapidx;
+	if ((n = MIN((size_t)ctx->nthread, size / SUB_CHUNK_MIN)) < 2) {
+		return -1;
+	}
+	if (ctx->tm_chopt[0] >= 0) {
+		return -1;	/* the cues chopped by time can't be counted */
+	}
+
+	/* the chopping needs to know SRT or SSA before the second chunk */
+	chop = (ctx->tm_chop[0] >= 0) || (ctx->tm_chop[1] >= 0);
+	lower = utf->mapidx;
+	tmp = *ctx;
+	while (chop && (tmp.magic < 0)) {
+		if (((s = utf_mapline(utf, &len)) == NULL) || (s[len-1] != 0xa)) {
+			utf->mapidx = lower;
+			return -1;	/* not a subtitle file */
+		}
+		chop_filter(&tmp, s);
+	}
+	bound = utf->mapidx;
+	utf->mapidx = lower;
+
+	if ((ck = calloc(n, sizeof(SUBCHUNK))) == NULL) {
+		return -1;
+	}
+	total = n;
+	ck[0].from = lower;
+	for (i = 1; i < n; i++) {
+		bound = retime_cue(utf, MAX(bound, lower + size / n * i));
+		if (bound >= utf->maplen) {
+			break;
+		}
+		ck[i].from = bound;
+	}
+	n = i;
+	for (i = 0; i < n; i++) {
+		ck[i].ctx   = *ctx;
+		ck[i].magic = i ? tmp.magic : ctx->magic;
+		ck[i].block = i ? 0 : ctx->block;	/* starts by a block */
+		ck[i].srtsn = ctx->srtsn;
+		ck[i].utf   = utf_slice(utf, ck[i].from, 
+				(i < n - 1) ? ck[i+1].from : utf->maplen);
+		ck[i].fout  = i ? tmpfile() : fout;
+		if (!ck[i].utf || !ck[i].fout) {
+			break;
+		}
+	}
+	if (i < n) {
+		n = -1;		/* fall back to single thread */
+		goto split_end;
+	}
+
+	/* the prefix count of the chopping index */
+	if (chop) {
+		retime_chunks(ck, n, 0);
+		for (i = idx = 0; i < n; i++) {
+			ck[i].subidx = idx;
+			idx += ck[i].ctx.subidx;
+		}
+	}
+	/* the prefix count of the SRT serial numbers */
+	if (ctx->srtsn > 0) {
+		retime_chunks(ck, n, 0);
+		for (i = 0, idx = ctx->srtsn; i < n; i++) {
+			ck[i].srtsn = idx;
+			idx += ck[i].ctx.srtsn - ctx->srtsn;
+		}
+	}
+
+	retime_chunks(ck, n, 1);
+	for (i = 1; i < n; i++) {
+		rewind(ck[i].fout);
+		copy_file(ck[i].fout, fout);
+	}
+split_end:
+	for (i = 0; i < total; i++) {
+		if (ck[i].utf) {
+			utf_close(ck[i].utf);
+		}
+		if (i && ck[i].fout) {
+			fclose(ck[i].fout);
+		}
+	}
+	free(ck);
+	return n < 0 ? -1 : 0;
+}
+
+/* find the beginning of a cue at or after 'pos', which is the line after
+ * a blank line in SRT, or a "Dialogue:" line in SSA. If no cue nearby,
+ * it falls back to the beginning of the next line */
+static size_t retime_cue(UTFB *utf, size_t pos)
+{
+	char	*s, *e, *p, *lim, *body;
+
+	s = utf->map + pos;
+	e = utf->map + utf->maplen;
+	if (s[-1] != 0xa) {
+		if ((p = scan_eol(s, e)) == NULL) {
+			return utf->maplen;
+		}
+		s = p + 1;
+	}
+	pos = s - utf->map;
+	lim = (e - s > SUB_CUE_SCAN) ? s + SUB_CUE_SCAN : e;
+	for ( ; (s < lim) && ((p = scan_eol(s, e)) != NULL); s = p + 1) {
+		switch (scan_class(s, p + 1, &body)) {
+		case SCAN_BLANK:
+			return p + 1 - utf->map;
+		case SCAN_DIALOGUE:
+			return s - utf->map;
+		}
+	}
+	return pos;
+}
+
+/* run the chunks by threads; the first one is run by the caller itself.
+ * The running status is reset to the beginning of the chunk */
+static int retime_chunks(SUBCHUNK *ck, int n, int output)
+{
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		ck[i].ctx.magic  = ck[i].magic;
+		ck[i].ctx.subidx = ck[i].subidx;
+		ck[i].ctx.srtsn  = ck[i].srtsn;
+		ck[i].ctx.block  = ck[i].block;
+		ck[i].utf->mapidx = ck[i].from;
+		ck[i].output = output;
+	}
+	for (i = 1; i < n; i++) {
+		ck[i].running = !pthread_create(&ck[i].tid, NULL, 
+				retime_chunk, &ck[i]);
+		if (!ck[i].running) {
+			retime_chunk(&ck[i]);	/* do it by itself */
+		}
+	}
+	retime_chunk(&ck[0]);
+	for (i = 1; i < n; i++) {
+		if (ck[i].running) {
+			pthread_join(ck[i].tid, NULL);
+		}
+	}
+	return 0;
+}
+
+static void *retime_chunk(void *arg)
+{
+	SUBCHUNK	*ck = arg;
+
+	retime_map(&ck->ctx, ck->utf, ck->output ? ck->fout : NULL);
+	return NULL;
+}
+/* Process one line of subtitle. The line 's' is not necessarily terminated
+ * by '\0' but it always ends by line break or '\0', which would stop the 
+ * parsers. Only the time stamps are rewritten; other parts of the line are
+ * queued to the output by spans. If 'inplace' is set, the line is writable 
+ * so a time stamp can be overwritten directly when it's in the same width */
+static int retime_line(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s, 
+		size_t len, int inplace)
+{
+	char	*e = s + len, *p, *mark, tmp[64];
+	int	n, cls, last = ctx->block;
+	/* WebVTT to SRT: the cues are numbered by the timing lines */
+	int	serial = (ctx->convert && (ctx->magic == 2)) ? 
+			SCAN_TIMING : SCAN_SERIAL;
+
+	WARNX("retime_line: %.*s", (int)len, s);
+	if (ctx->magic == 3) {
+		return retime_frames(ctx, utf, fout, s, e, inplace);
+	}
+	cls = scan_class(s, e, &p);
+	if (ctx->magic == 2) {
+		vtt_block(ctx, cls, p);
+		if (ctx->block < 0) {
+			cls = SCAN_TEXT;	/* other blocks are left */
+		} else if ((cls == SCAN_SERIAL) && (ctx->block != 1)) {
+			cls = SCAN_TEXT;	/* only the cue identifier */
+		}
+	}
+	/* the cues chopped by time when the cue table is not available */
+	if ((ctx->tm_chopt[0] >= 0) && (s != ctx->hold) &&
+			chop_time(ctx, utf, fout, s, e, cls, p)) {
+		return 0;
+	}
+	if (chop_filter(ctx, s)) {
+		return 0;	/* skip the specified subtitles */
+	}
+	if (fout == NULL) {	/* counting the SRT serial numbers only */
+		if ((ctx->srtsn > 0) && (ctx->block >= 0) && (cls == serial)) {
+			ctx->srtsn++;
+		}
+		return 0;
+	}
+
+	/* 'mark' is the beginning of the contents not yet been queued */
+	mark = s;
+
+	/* WebVTT to SRT: only the cues are taken, without the identifiers
+	 * and the blank line after other blocks */
+	if (serial == SCAN_TIMING) {
+		if ((ctx->block < 0) || ((ctx->block == 0) && (last < 0))) {
+			return 0;
+		}
+		if ((ctx->block == 1) && (cls != SCAN_TIMING)) {
+			return 0;
+		}
+		if (cls == SCAN_TIMING) {
+			utf_cache(utf, fout, tmp, itofmt(tmp, ctx->srtsn++));
+			if ((len > 1) && (e[-2] == 0xd)) {
+				utf_cache(utf, fout, "\r\n", 2);
+			} else {
+				utf_cache(utf, fout, "\n", 1);
+			}
+		}
+	}
+
+	/* SRT: 00:02:17,440 --> 00:02:20,375
+	 * ASS: Dialogue: Marked=0,0:02:42.42,0:02:44.15,Wolf main,
+	 *           autre,0000,0000,0000,,Toujours rien. 
+	 * WebVTT: 00:02:17.440 --> 00:02:20.375 position:10% align:start */
+	switch (cls) {
+	case SCAN_DIALOGUE:	/* ASS/SSA */
+		/* the first timestamp is after the first ',' */
+		if ((p = memchr(p, ',', e - p)) != NULL) {
+			p = retime_stamp(ctx, utf, fout, &mark, p + 1, e, inplace);
+		}
+		/* the second timestamp is after the next ',' */
+		if (p && ((p = memchr(p, ',', e - p)) != NULL)) {
+			retime_stamp(ctx, utf, fout, &mark, p + 1, e, inplace);
+		}
+		break;
+	case SCAN_SERIAL:	/* SRT serial number */
+		if (ctx->srtsn > 0) {
+			/* SRT serial numbers to be re-ordered */
+			n = itofmt(tmp, ctx->srtsn++);
+			for (s = p; isdigit(*s); s++);
+			if (inplace && (s - p == n)) {
+				memcpy(p, tmp, n);
+			} else {
+				utf_span(utf, fout, mark, p - mark);
+				utf_cache(utf, fout, tmp, n);
+				mark = s;
+			}
+		}
+		break;
+	case SCAN_TIMING:	/* SRT timestamp */
+		p = retime_stamp(ctx, utf, fout, &mark, p, e, inplace);
+
+		/* skip everything before the second timestamp */
+		for ( ; (p < e) && !isdigit(*p); p++);
+		p = retime_stamp(ctx, utf, fout, &mark, p, e, inplace);
+
+		/* the cue settings of WebVTT are dropped in SRT */
+		if (serial == SCAN_TIMING) {
+			utf_span(utf, fout, mark, p - mark);
+			for (mark = e; (mark > p) && ((mark[-1] == 0xa) || 
+					(mark[-1] == 0xd)); mark--);
+		}
+		break;
+	case SCAN_TEXT:		/* the inline time stamps in WebVTT cue */
+		if ((ctx->magic == 2) && (ctx->block > 0)) {
+			retime_inline(ctx, utf, fout, &mark, p, e, inplace);
+		}
+		break;
+	} 
+	/* output rest of things */
+	utf_span(utf, fout, mark, e - mark);
+	return 0;
+}
+
+/* read the time stamp from 's' and replace it by the tweaked time stamp.
+ * Return the position after the time stamp */
+static char *retime_stamp(SUBCTX *ctx, UTFB *utf, FILE *fout, char **mark,
+		char *s, char *e, int inplace)
+{
+	char	tmp[64];
+	time_t	ms;
+	int	n, len, style;
+
+	if ((ms = retime_read(s, e, &n, &style)) == -1) {
+		return s;	/* not a time stamp; leave it as it is */
+	}
+	if (ctx->convert) {
+		style = (ctx->format == 2) ? 5 : 0;
+	}
+	len = subsync_mstofmt(tmp, ctx->tweak(ctx, ms), style);
+	if (inplace && (len == n)) {
+		memcpy(s, tmp, len);	/* same width; overwrite it in place */
+		return s + n;
+	}
+	/* queue the contents before the time stamp and the new time stamp */
+	utf_span(utf, fout, *mark, s - *mark);
+	utf_cache(utf, fout, tmp, len);
+	*mark = s + n;
+	return s + n;
+}
+
+/* read the time stamp in 's'. Return -1 if it's not a time stamp */
+static time_t retime_read(char *s, char *e, int *n, int *style)
+{
+	time_t	ms;
+	int	tm[4];
+
+	/* try the common patterns first, then the flexible ones */
+	if ((*n = scan_stamp(s, e, tm, style)) > 0) {
+		return timetoms(tm[0], tm[1], tm[2], 
+				(*style == 1) ? tm[3] * 10 : tm[3]);
+	}
+	if (((ms = subsync_strtoms(s, n, style)) == -1) || (*n == 0)) {
+		return -1;
+	}
+	return ms;
+}
+
+/* Retime the inline time stamps of WebVTT like <00:00:01.000> in the cue
+ * text, or remove them when it is converted to SRT, along with the tags
+ * SRT doesn't know, like <c.yellow> and <v Bob> */
+static void retime_inline(SUBCTX *ctx, UTFB *utf, FILE *fout, char **mark,
+		char *s, char *e, int inplace)
+{
+	char	*p;
+	int	n, style;
+
+	while ((s = memchr(s, '<', e - s)) != NULL) {
+		s++;
+		if ((p = memchr(s, '>', e - s)) == NULL) {
+			break;
+		}
+		if (isdigit(*s) && (retime_read(s, p, &n, &style) != -1) &&
+				(style >= 5) && (s + n == p)) {
+			if (ctx->convert) {
+				utf_span(utf, fout, *mark, s - 1 - *mark);
+				*mark = s + n + 1;
+			} else {
+				retime_stamp(ctx, utf, fout, mark, s, e, inplace);
+			}
+			s += n + 1;
+		} else if (ctx->convert && ((n = vtt_tag(s, p)) >= 0) &&
+				(s + n != p)) {
+			/* keep the name of <i>, <b> and <u> only */
+			utf_span(utf, fout, *mark, s - 1 - *mark + (n ? n + 1 : 0));
+			if (n > 0) {
+				utf_cache(utf, fout, ">", 1);
+			}
+			*mark = p + 1;
+			/* the ruby text is dropped with its tags */
+			if ((n == 0) && !memcmp(s, "rt", 2)) {
+				for (s = p; (s = memchr(s, '<', e - s)) != NULL; s++) {
+					if ((e - s >= 5) && !memcmp(s, "</rt>", 5)) {
+						p = s + 4;
+						*mark = p + 1;
+						break;
+					}
+				}
+			}
+			s = p + 1;
+		}
+	}
+}
+
+/* Find the format of the file by the first line 's', and work out the
+ * conversion if it is different to the 'format' option */
+static void retime_format(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		size_t len)
+{
+	char	buf[32], *p;
+	time_t	fps[2];
+	int	n, crlf;
+
+	if ((len >= 6) && !memcmp(s, "WEBVTT", 6)) {
+		ctx->magic = 2;
+	} else if ((len >= 13) && !memcmp(s, "[Script Info]", 13)) {
+		ctx->magic = 1;
+	} else if ((len >= 2) && (*s == '{') && isdigit(s[1])) {
+		ctx->magic = 3;
+		/* the option goes before the frame rate in "{1}{1}23.976" */
+		ctx->fps[0] = ctx->tm_fps[1] ? ctx->tm_fps[0] : fptbl[2].num;
+		ctx->fps[1] = ctx->tm_fps[1] ? ctx->tm_fps[1] : fptbl[2].den;
+		if ((len > 6) && !memcmp(s, "{1}{1}", 6)) {
+			for (p = s + 6, n = 0; (n < (int) sizeof(buf) - 1) && 
+					(p + n < s + len) && 
+					((unsigned char) p[n] > ' '); n++) {
+				buf[n] = p[n];
+			}
+			buf[n] = 0;
+			if (arg_fps(buf, fps) == 0) {
+				ctx->block = -1;	/* not a cue */
+				if (!ctx->tm_fps[1]) {
+					ctx->fps[0] = fps[0];
+					ctx->fps[1] = fps[1];
+				}
+			}
+		}
+	}
+	if (ctx->format < 0) {
+		return;
+	}
+	if (ctx->magic == 1) {
+		ctx_report(ctx, "ASS/SSA can not be converted.");
+		return;
+	}
+	if ((ctx->format == 2) && (ctx->magic != 2)) {
+		/* to WebVTT: the signature goes before the cues */
+		crlf = (s = memchr(s, 0xa, len)) && (s[-1] == 0xd);
+		utf_cache(utf, fout, crlf ? "WEBVTT\r\n\r\n" : "WEBVTT\n\n", 
+				crlf ? 10 : 8);
+		utf_cache(utf, fout, NULL, 0);
+		ctx->convert = 1;
+	} else if ((ctx->format == 0) && (ctx->magic >= 2)) {
+		ctx->convert = 1;	/* WebVTT or MicroDVD to SRT */
+		if (ctx->srtsn <= 0) {
+			ctx->srtsn = 1;
+		}
+	}
+}
+
+/* the WebVTT tag between '<' and '>' in 'e', like "c.yellow" or "/v". 
+ * Return the length of the SRT tag it is written as, like "b" of "b.loud"
+ * or "/i", 0 if SRT has no such tag, or -1 if it's not a WebVTT tag */
+static int vtt_tag(char *s, char *e)
+{
+	static	const	char	*tags[] = { 
+		"i", "b", "u", "c", "v", "lang", "ruby", "rt", NULL 
+	};
+	int	i, n, close = (*s == '/');
+
+	for (n = close; (s + n < e) && isalpha(s[n]); n++);
+	if ((s + n < e) && (s[n] != '.') && (s[n] != ' ') && (s[n] != '\t')) {
+		return -1;
+	}
+	for (i = 0; tags[i]; i++) {
+		if ((n - close == strlen(tags[i])) && 
+				!memcmp(s + close, tags[i], n - close)) {
+			return (i < 3) ? n : 0;
+		}
+	}
+	return -1;
+}
+
+/* WebVTT is made of the blocks separated by the blank lines. The blocks
+ * other than the cues are the header, the comments, the styles and the
+ * regions, which are counted in minus */
+static void vtt_block(SUBCTX *ctx, int cls, char *body)
+{
+	static	const	char	*other[] = { 
+		"WEBVTT", "NOTE", "STYLE", "REGION", NULL 
+	};
+	int	i, n;
+
+	if (cls == SCAN_BLANK) {
+		ctx->block = 0;
+	} else if (ctx->block) {
+		ctx->block += (ctx->block > 0) ? 1 : -1;
+	} else {
+		ctx->block = 1;
+		for (i = 0; other[i]; i++) {
+			n = strlen(other[i]);
+			if (!strncmp(body, other[i], n) && 
+					((unsigned char) body[n] <= 0x20)) {
+				ctx->block = -1;
+				break;
+			}
+		}
+	}
+}
+
+/* Chop the cues starting in the time while retiming line by line, like
+ * the conversion which the cue table can't do. The cue is known by its
+ * timing line, so the SRT serial number before it is held till then and
+ * the lines after it are chopped till the blank line. The chopped cues
+ * are still counted for chop_filter(). Return 1 if the line is taken */
+static int chop_time(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		char *e, int cls, char *body)
+{
+	int	n, style, chop;
+
+	/* the blank lines go with the chopped cue too */
+	if (ctx->chopped) {
+		if (cls == SCAN_BLANK) {
+			ctx->chopped = 2;
+			return 1;
+		}
+		if (ctx->chopped == 1) {
+			return 1;
+		}
+		ctx->chopped = 0;	/* the next cue */
+	}
+	chop = (cls == SCAN_TIMING) &&
+		chop_inside(ctx, retime_read(body, e, &n, &style));
+	if (ctx->holdlen) {
+		n = ctx->holdlen;
+		ctx->holdlen = 0;
+		if (chop) {
+			chop_filter(ctx, ctx->hold);
+		} else {
+			retime_line(ctx, utf, fout, ctx->hold, n, 1);
+		}
+	}
+	if (chop) {
+		chop_filter(ctx, s);
+		ctx->chopped = 1;
+		return 1;
+	}
+	if ((cls == SCAN_SERIAL) && (ctx->magic != 2) &&
+			(e - s < (int) sizeof(ctx->hold))) {
+		memcpy(ctx->hold, s, e - s);
+		ctx->hold[e-s] = 0;
+		ctx->holdlen = (int)(e - s);
+		return 1;
+	}
+	return 0;
+}
+
+/* if the original time is in the chopping time, same as cue_chop_time() */
+static int chop_inside(SUBCTX *ctx, time_t ms)
+{
+	if ((ctx->tm_chopt[0] < 0) || (ms < ctx->tm_chopt[0])) {
+		return 0;
+	}
+	return (ctx->tm_chopt[1] < 0) || (ms <= ctx->tm_chopt[1]);
+}
+
+/* Retime the line of MicroDVD like "{1025}{1090}Hello|World". The frames
+ * are retimed in milliseconds by the frame rate and written back in frames,
+ * or written as the cue of SRT or WebVTT when it is converted */
+static int retime_frames(SUBCTX *ctx, UTFB *utf, FILE *fout, char *s,
+		char *e, int inplace)
+{
+	char	tmp[64], *p;
+	time_t	ms[2];
+	int	n;
+
+	if (ctx->block < 0) {	/* the frame rate in the first line */
+		ctx->block = 0;
+		if (fout && !ctx->convert) {
+			utf_span(utf, fout, s, e - s);
+		}
+		return 0;
+	}
+	if (chop_filter(ctx, s)) {
+		return 0;	/* skip the specified subtitles */
+	}
+	if (((p = mdvd_read(ctx, s, e, ms)) != NULL) && chop_inside(ctx, ms[0])) {
+		return 0;	/* chopped by the original time */
+	}
+	if (fout == NULL) {	/* counting the SRT serial numbers only */
+		if (p && ctx->convert && (ctx->srtsn > 0)) {
+			ctx->srtsn++;
+		}
+		return 0;
+	}
+	if (p == NULL) {	/* not a cue; dropped in the conversion */
+		if (!ctx->convert) {
+			utf_span(utf, fout, s, e - s);
+		}
+		return 0;
+	}
+	ms[0] = ctx->tweak(ctx, ms[0]);
+	ms[1] = ctx->tweak(ctx, ms[1]);
+	if (ctx->convert) {
+		return mdvd_write(ctx, utf, fout, ms, p, e);
+	}
+
+	n = 0;
+	tmp[n++] = '{';
+	n += itofmt(tmp + n, ms_to_frame(ms[0], ctx->fps));
+	tmp[n++] = '}';
+	tmp[n++] = '{';
+	if (p[-2] != '{') {	/* the end frame may be empty */
+		n += itofmt(tmp + n, ms_to_frame(ms[1], ctx->fps));
+	}
+	tmp[n++] = '}';
+	if (inplace && (n == p - s)) {
+		memcpy(s, tmp, n);	/* same width; overwrite it in place */
+		utf_span(utf, fout, s, e - s);
+	} else {
+		utf_cache(utf, fout, tmp, n);
+		utf_span(utf, fout, p, e - p);
+	}
+	return 0;
+}
+
+/* read the start and the end frames in milliseconds. Return the text after
+ * the frames, or NULL if it's not a cue. The empty end frame lasts for
+ * SUB_MDVD_LAST from the start */
+static char *mdvd_read(SUBCTX *ctx, char *s, char *e, time_t *ms)
+{
+	char	*p;
+	int	i;
+
+	for (i = 0; i < 2; i++) {
+		if ((e - s < 2) || (*s != '{')) {
+			return NULL;
+		}
+		ms[i] = i ? ms[0] + SUB_MDVD_LAST : -1;
+		if (isdigit(s[1])) {
+			ms[i] = frame_to_ms(strtol(s + 1, &p, 10), ctx->fps);
+		} else {
+			p = s + 1;
+		}
+		if ((*p != '}') || ((i == 0) && (ms[0] < 0))) {
+			return NULL;
+		}
+		s = p + 1;
+	}
+	return s;
+}
+
+/* Write the cue of SRT or WebVTT. The '|' breaks the lines, and the style
+ * codes like {y:i} are taken as the tags, or dropped if they are not */
+static int mdvd_write(SUBCTX *ctx, UTFB *utf, FILE *fout, time_t *ms,
+		char *s, char *e)
+{
+	char	tmp[64], *eol, *lf, *p;
+	int	n, lflen, style[2] = { 0, 0 };
+
+	/* the line break of the cue goes to every line */
+	for (eol = e; (eol > s) && ((eol[-1] == 0xa) || (eol[-1] == 0xd)); 
+			eol--);
+	if ((lflen = (int)(e - eol)) == 0) {
+		lf = "\n";	/* the last line without line break */
+		lflen = 1;
+	} else {
+		lf = eol;
+	}
+	if (ctx->srtsn > 0) {
+		utf_cache(utf, fout, tmp, itofmt(tmp, ctx->srtsn++));
+		utf_cache(utf, fout, lf, lflen);
+	}
+	n = subsync_mstofmt(tmp, ms[0], (ctx->format == 2) ? 5 : 0);
+	memcpy(tmp + n, " --> ", 5);
+	n += 5;
+	n += subsync_mstofmt(tmp + n, ms[1], (ctx->format == 2) ? 5 : 0);
+	utf_cache(utf, fout, tmp, n);
+	utf_cache(utf, fout, lf, lflen);
+
+	/* the lower case style codes apply to the line only */
+	for ( ; s < eol; s = p + 1) {
+		s = mdvd_style(s, eol, style);
+		if ((p = memchr(s, '|', eol - s)) == NULL) {
+			p = eol;
+		}
+		n = mdvd_tags(tmp, style[0] | style[1], 0);
+		utf_cache(utf, fout, tmp, n);
+		utf_span(utf, fout, s, p - s);
+		n = mdvd_tags(tmp, style[0] | style[1], 1);
+		utf_cache(utf, fout, tmp, n);
+		utf_cache(utf, fout, lf, lflen);
+		style[0] = 0;
+	}
+	utf_cache(utf, fout, lf, lflen);
+	return 0;
+}
+
+/* Read the style codes in the beginning of the line like {y:i} or {Y:b,i},
+ * where the lower case is in style[0] and the upper case in style[1] by
+ * the bits of italic, bold and underline. Return the text after them */
+static char *mdvd_style(char *s, char *e, int *style)
+{
+	char	*p, *q;
+
+	while ((e - s > 3) && (*s == '{') && (s[2] == ':') &&
+			((p = memchr(s, '}', e - s)) != NULL)) {
+		if ((s[1] == 'y') || (s[1] == 'Y')) {
+			for (q = s + 3; q < p; q++) {
+				style[s[1] == 'Y'] |= (*q == 'i') ? 1 : 
+					(*q == 'b') ? 2 : (*q == 'u') ? 4 : 0;
+			}
+		}
+		s = p + 1;	/* other codes like colors are dropped */
+	}
+	return s;
+}
+
+/* write the tags of the style to 'buf'. Return the length */
+static int mdvd_tags(char *buf, int style, int close)
+{
+	static	char	*tags[2][3] = {
+		{ "<i>", "<b>", "<u>" }, { "</i>", "</b>", "</u>" }
+	};
+	int	i, k, n = 0;
+
+	/* the closing tags in the reverse order */
+	for (i = 0; i < 3; i++) {
+		k = close ? 2 - i : i;
+		if (style & (1 << k)) {
+			memcpy(buf + n, tags[close][k], 3 + close);
+			n += 3 + close;
+		}
+	}
+	return n;
+}
+
+/* the frame to milliseconds by the frame rate fps[0] / fps[1], rounded to
+ * the nearest so the frames always come back by ms_to_frame() */
+static time_t frame_to_ms(time_t frame, time_t *fps)
+{
+	time_t	n = frame * 1000 * fps[1];
+
+	return (n + ((n < 0) ? -fps[0] : fps[0]) / 2) / fps[0];
+}
+
+static time_t ms_to_frame(time_t ms, time_t *fps)
+{
+	time_t	n = ms * fps[0], d = 1000 * fps[1];
+
+	return (n + ((n < 0) ? -d : d) / 2) / d;
+}
+
+/* Merge the subtitles in 'fin' by the start time of the cues to 'fout' as
+ * SRT, or WebVTT by the option or the first input. Each input must be in
+ * order already, so only its next cue is held and picked by the heap, and
+ * the memory is up to the number of inputs instead of their sizes. The 
+ * cues are always renumbered, and combined if they overlap the previous
+ * one when 'combine' */
+int subsync_merge(SUBCTX *ctx, FILE **fin, int num, FILE *fout, int combine)
+{
+	SUBMERGE	*in, out, *cue;
+	int	*heap, i, n, held = 0, style = 0, rc = 0;
+
+	if ((in = calloc(num, sizeof(SUBMERGE))) == NULL) {
+		return -1;
+	}
+	if ((heap = malloc(num * sizeof(int))) == NULL) {
+		free(in);
+		return -1;
+	}
+	memset(&out, 0, sizeof(out));
+	ctx->srtsn  = (ctx->tm_srtsn > 0) ? ctx->tm_srtsn : 1;
+	ctx->subidx = 0;
+	ctx->magic  = -1;
+	ctx->block  = 0;
+	ctx->badoff = -1;
+	ctx->merge  = combine ? 2 : 1;
+	tweak_select(ctx);
+
+	for (i = n = 0; i < num; i++) {
+		in[i].ctx = *ctx;
+		in[i].ctx.format = -1;	/* only to know the format */
+		in[i].fin = fin[i];
+		if ((in[i].utf = utf_open(fin[i], ctx->decode, 
+						ctx->encode)) == NULL) {
+			rc = -1;
+			break;
+		}
+		in[i].utf->bad_mode = ctx->invalid;
+		if ((rc = merge_read(ctx, in + i)) < 0) {
+			break;
+		}
+		if (rc > 0) {
+			heap[n++] = i;
+		}
+	}
+	if (rc < 0) {
+		n = 0;		/* nothing would be output */
+	} else if ((ctx->format == 2) || 
+			((ctx->format < 0) && (in[0].ctx.magic == 2))) {
+		style = 5;
+		ctx->convert = 0;	/* the inline time stamps are retimed */
+	} else {
+		style = 0;
+		ctx->convert = 1;	/* the inline time stamps are removed */
+	}
+	for (i = n / 2 - 1; i >= 0; i--) {
+		merge_heap(in, heap, n, i);
+	}
+
+	/* the output goes by the coding of the first input */
+	if (n > 0) {
+		if (!ctx->same_code && !ctx->encode) {
+			in[0].utf->na_enc[0] = 0;	/* force UTF-8 output */
+		}
+		utf_write_bom(in[0].utf, fout);
+		if (style == 5) {
+			cue = in + heap[0];
+			utf_cache(in[0].utf, fout, "WEBVTT", 6);
+			utf_cache(in[0].utf, fout, cue->lf, strlen(cue->lf));
+			utf_cache(in[0].utf, fout, cue->lf, strlen(cue->lf));
+		}
+	}
+	while (n > 0) {
+		cue = in + heap[0];
+		if (held && (ctx->merge > 1) && (cue->ms[0] < out.ms[1])) {
+			out.ms[1] = MAX(out.ms[1], cue->ms[1]);
+			out.vtt |= cue->vtt;
+		} else {
+			if (held) {
+				merge_write(ctx, in[0].utf, fout, &out, style);
+			}
+			out.ms[0] = cue->ms[0];
+			out.ms[1] = cue->ms[1];
+			out.lf  = cue->lf;
+			out.vtt = cue->vtt;
+			out.len = 0;
+			held = 1;
+		}
+		if (merge_text(&out, cue->text, cue->len) < 0) {
+			rc = -1;
+			break;
+		}
+		/* the input goes down the heap by its next cue, or out */
+		if ((rc = merge_read(ctx, cue)) < 0) {
+			break;
+		} else if (rc == 0) {
+			heap[0] = heap[--n];
+		}
+		merge_heap(in, heap, n, 0);
+	}
+	if (held) {
+		merge_write(ctx, in[0].utf, fout, &out, style);
+	}
+	if (in[0].utf) {
+		utf_cache(in[0].utf, fout, NULL, 0);	/* flush the output */
+		utf_write(in[0].utf, fout, NULL, 0);
+	}
+	for (i = 0; i < num; i++) {
+		if (in[i].utf) {
+			utf_close(in[i].utf);
+		}
+		free(in[i].text);
+	}
+	free(out.text);
+	free(heap);
+	free(in);
+	return (rc < 0) ? -1 : 0;
+}
+
+/* Read the next cue of the input and tweak its time. The lines out of the
+ * cues, like the WebVTT comments and the cue identifiers, are skipped. 
+ * Return 1 if a cue is read, 0 in the end of input, or -1 if failed */
+static int merge_read(SUBCTX *ctx, SUBMERGE *in)
+{
+	char	*s, *e, *p;
+	size_t	len;
+	int	k, n, cls, cue = 0;
+
+	in->len = 0;
+	while ((s = utf_getline(in->utf, in->fin, &len)) != NULL) {
+		e = s + len;
+		if (in->lines++ == 0) {
+			retime_format(&in->ctx, NULL, NULL, s, len);
+		}
+		if (in->ctx.magic == 1) {
+			ctx_report(&in->ctx, "ASS/SSA can not be merged.");
+			return -1;
+		}
+		if (in->ctx.magic == 3) {	/* MicroDVD: one cue a line */
+			if (in->ctx.block < 0) {
+				in->ctx.block = 0;	/* the frame rate */
+			} else if ((p = mdvd_read(&in->ctx, s, e, in->ms))) {
+				in->lf = ((len > 1) && (e[-1] == 0xa) && 
+						(e[-2] == 0xd)) ? "\r\n" : "\n";
+				if (merge_frames(in, p, e) < 0) {
+					return -1;
+				}
+				cue = 1;
+				break;
+			}
+			continue;
+		}
+		cls = scan_class(s, e, &p);
+		if (in->ctx.magic == 2) {
+			vtt_block(&in->ctx, cls, p);
+			if (in->ctx.block < 0) {
+				continue;	/* other blocks are skipped */
+			}
+		}
+		if (cue) {	/* the text lines till the blank line */
+			if (cls == SCAN_BLANK) {
+				break;
+			}
+			if (merge_text(in, s, len) < 0) {
+				return -1;
+			}
+			if ((e[-1] != 0xa) && (merge_text(in, in->lf, 
+						strlen(in->lf)) < 0)) {
+				return -1;
+			}
+			continue;
+		}
+		if ((cls != SCAN_TIMING) ||
+				((in->ms[0] = retime_read(p, e, &k, &n)) == -1)) {
+			continue;
+		}
+		for (p += k; (p < e) && !isdigit(*p); p++);
+		in->ms[1] = retime_read(p, e, &k, &n);
+		in->lf = ((len > 1) && (e[-1] == 0xa) && (e[-2] == 0xd)) ? 
+			"\r\n" : "\n";
+		in->vtt = (in->ctx.magic == 2);
+		cue = 1;
+	}
+	if (!cue) {
+		return 0;
+	}
+	in->ms[0] = ctx->tweak(ctx, in->ms[0]);
+	in->ms[1] = (in->ms[1] < 0) ? in->ms[0] : ctx->tweak(ctx, in->ms[1]);
+	return 1;
+}
+
+/* the text of MicroDVD to the lines and the tags, same as mdvd_write() */
+static int merge_frames(SUBMERGE *in, char *s, char *e)
+{
+	char	tmp[32], *eol, *p;
+	int	n, rc = 0, style[2] = { 0, 0 };
+
+	for (eol = e; (eol > s) && ((eol[-1] == 0xa) || (eol[-1] == 0xd)); 
+			eol--);
+	for ( ; s < eol; s = p + 1) {
+		s = mdvd_style(s, eol, style);
+		if ((p = memchr(s, '|', eol - s)) == NULL) {
+			p = eol;
+		}
+		n = mdvd_tags(tmp, style[0] | style[1], 0);
+		rc |= merge_text(in, tmp, n);
+		rc |= merge_text(in, s, p - s);
+		n = mdvd_tags(tmp, style[0] | style[1], 1);
+		rc |= merge_text(in, tmp, n);
+		rc |= merge_text(in, in->lf, strlen(in->lf));
+		style[0] = 0;
+	}
+	return rc;
+}
+
+/* append the contents to the text of the cue */
+static int merge_text(SUBMERGE *in, char *s, size_t len)
+{
+	char	*p;
+	size_t	n;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (in->len + len > in->size) {
+		for (n = in->size ? in->size : 256; n < in->len + len; n *= 2);
+		if ((p = realloc(in->text, n)) == NULL) {
+			return -1;
+		}
+		in->text = p;
+		in->size = n;
+	}
+	memcpy(in->text + in->len, s, len);
+	in->len += len;
+	return 0;
+}
+
+static void merge_write(SUBCTX *ctx, UTFB *utf, FILE *fout, SUBMERGE *cue,
+		int style)
+{
+	char	tmp[64], *mark = cue->text, *e = cue->text + cue->len;
+	int	n;
+
+	if (style == 0) {
+		utf_cache(utf, fout, tmp, itofmt(tmp, ctx->srtsn++));
+		utf_cache(utf, fout, cue->lf, strlen(cue->lf));
+	}
+	n = subsync_mstofmt(tmp, cue->ms[0], style);
+	memcpy(tmp + n, " --> ", 5);
+	n += 5;
+	n += subsync_mstofmt(tmp + n, cue->ms[1], style);
+	utf_cache(utf, fout, tmp, n);
+	utf_cache(utf, fout, cue->lf, strlen(cue->lf));
+	if (cue->vtt) {
+		retime_inline(ctx, utf, fout, &mark, mark, e, 0);
+	}
+	utf_span(utf, fout, mark, e - mark);
+	utf_cache(utf, fout, cue->lf, strlen(cue->lf));
+}
+
+/* sift the input down the heap by the start time of their cues */
+static void merge_heap(SUBMERGE *in, int *heap, int n, int i)
+{
+	int	k, tmp;
+
+	while ((k = i * 2 + 1) < n) {
+		if ((k + 1 < n) && merge_before(in, heap[k+1], heap[k])) {
+			k++;
+		}
+		if (!merge_before(in, heap[k], heap[i])) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[k];
+		heap[k] = tmp;
+		i = k;
+	}
+}
+
+/* the earlier input goes first in the ties so the merging is stable */
+static int merge_before(SUBMERGE *in, int a, int b)
+{
+	if (in[a].ms[0] != in[b].ms[0]) {
+		return in[a].ms[0] < in[b].ms[0];
+	}
+	return a < b;
+}
+
+/* Load the cue times of the reference subtitle, which every file would
+ * be aligned to by subsync_align(). Return the number of cues */
+int subsync_reference(SUBCTX *ctx, FILE *fref)
+{
+	if (ctx->tm_ref) {
+		free(ctx->tm_ref);
+	}
+	ctx->tm_refnum = retime_cues(fref, NULL, &ctx->tm_ref, 0);
+	if (ctx->tm_refnum < 2) {
+		free(ctx->tm_ref);
+		ctx->tm_ref = NULL;
+		return -1;
+	}
+	return ctx->tm_refnum;
+}
+
+/* Load the voice activity of the reference audio in the PCM WAV file,
+ * which every file would be aligned to by subsync_align(). 
+ * Return the number of the voice frames */
+int subsync_audio(SUBCTX *ctx, FILE *fwav)
+{
+	if (ctx->tm_voice) {
+		free(ctx->tm_voice);
+		ctx->tm_voice = NULL;
+	}
+	ctx->tm_voicenum = align_wave(fwav, &ctx->tm_voice);
+	return ctx->tm_voicenum;
+}
+
+/* Estimate the offset and the scale by aligning the cues of 'fin' to the
+ * reference subtitle or audio. The candidate scales are the predefined
+ * frame rate ratios. The 'fin' is rewound for retiming. 
+ * Return the number of aligned cues */
+int subsync_align(SUBCTX *ctx, FILE *fin)
+{
+	double	scale[sizeof(srtbl)/sizeof(struct ScRate) + 1], a, b;
+	time_t	*cue;
+	int	i, n, rc;
+
+	if (!ctx->tm_ref && !ctx->tm_voice) {
+		return -1;
+	}
+	/* the voice needs the span of each cue */
+	if ((n = retime_cues(fin, ctx->decode, &cue, !ctx->tm_ref)) < 0) {
+		return -1;
+	}
+	scale[0] = 1.0;
+	for (i = 0; i < sizeof(srtbl)/sizeof(struct ScRate); i++) {
+		scale[i+1] = (double)srtbl[i].num / (double)srtbl[i].den;
+	}
+	if (ctx->tm_ref) {
+		rc = align_cues(ctx->tm_ref, ctx->tm_refnum, cue, n, 
+				scale, i + 1, &a, &b);
+	} else {
+		rc = align_voice(ctx->tm_voice, ctx->tm_voicenum, cue, n,
+				scale, i + 1, &a, &b);
+	}
+	free(cue);
+	if (fseek(fin, 0, SEEK_SET) < 0) {
+		return -1;
+	}
+	/* too few paired cues; the subtitles may not be the same film */
+	if ((rc < 2) || (rc * 4 < MAX(n, ctx->tm_ref ? ctx->tm_refnum : 0))) {
+		ctx_report(ctx, "Failed to align to the reference.");
+		return -1;
+	}
+	retime_linear(ctx, a, b);
+	ctx_report(ctx, "Aligned %d of %d cues: offset %+ld ms, scale %.6f",
+			rc, n, (long) ctx->tm_offset, a);
+	return rc;
+}
+
+/* Fit the offset and the scale by the file of the time stamp pairs, which
+ * are the expected and the actual time stamps per line, like:
+ *   01:44:30,290  01:44:31,660
+ * Return the number of the pairs fitted, or -1 if failed */
+int subsync_fitting(SUBCTX *ctx, char *fname)
+{
+	FILE	*fp;
+	time_t	*x = NULL, *y = NULL, *p;
+	double	a, b, rms;
+	char	buf[256], *s;
+	int	i, k, n = 0, max = 0, rc = -1;
+
+	if ((fp = ctx_fopen(ctx, fname)) == NULL) {
+		return -1;
+	}
+	for (i = 1; fgets(buf, sizeof(buf), fp); i++) {
+		for (s = buf; isspace(*s); s++);
+		if ((*s == 0) || (*s == '#')) {
+			continue;	/* blank lines and comments */
+		}
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			if ((p = realloc(x, max * 2 * sizeof(time_t))) == NULL) {
+				goto fit_end;
+			}
+			x = p;
+			y = x + max;
+			memmove(y, x + max / 2, n * sizeof(time_t));
+		}
+		if (((y[n] = subsync_strtoms(s, &k, NULL)) < 0) || (k == 0) ||
+				((x[n] = subsync_strtoms(s + k, &k, NULL)) < 0) || 
+				(k == 0)) {
+			ctx_report(ctx, "%s:%d: invalid time stamps.", fname, i);
+			goto fit_end;
+		}
+		n++;
+	}
+	if ((rc = align_pairs(x, y, n, &a, &b, &rms)) < 2) {
+		ctx_report(ctx, "%s: too few time stamp pairs.", fname);
+		rc = -1;
+		goto fit_end;
+	}
+	retime_linear(ctx, a, b);
+	ctx_report(ctx, "Fitted %d of %d pairs: offset %+ld ms, scale %.6f, "
+			"residual %.1f ms", rc, n, (long) ctx->tm_offset, a, rms);
+fit_end:
+	fclose(fp);
+	free(x);
+	return rc;
+}
+
+/* set the fitting of y = a * x + b, where subsync_tweak() is 
+ * (ms + offset) * scale */
+static void retime_linear(SUBCTX *ctx, double a, double b)
+{
+	time_t	ratio[2];
+
+	ratio_approx(a, ratio);
+	subsync_scale(ctx, ratio[0], ratio[1]);
+	ctx->tm_offset = (time_t)(b / a + ((b < 0) ? -0.5 : 0.5));
+}
+
+/* Read the start time of each cue into the sorted '*cue', or the start
+ * and the end time in pairs if 'span'. 
+ * Return the number of cues, or -1 if failed */
+static int retime_cues(FILE *fin, char *decode, time_t **cue, int span)
+{
+	UTFB	*utf;
+	time_t	ms, end, *p;
+	char	*s, *e;
+	size_t	len;
+	int	n = 0, max = 1024, k, style, rc;
+
+	span = span ? 2 : 1;
+	if ((*cue = malloc(max * span * sizeof(time_t))) == NULL) {
+		return -1;
+	}
+	if ((utf = utf_open(fin, decode, NULL)) == NULL) {
+		free(*cue);
+		return -1;
+	}
+	if ((rc = utf_map(utf, fin)) < 0) {
+		rc = utf_map_decode(utf, fin);
+	}
+	while (rc == 0) {
+		while ((s = utf_mapline(utf, &len)) != NULL) {
+			e = s + len;
+			if (*(e - 1) != 0xa) {
+				break;	/* the time stamp must end by EOL */
+			}
+			switch (scan_class(s, e, &s)) {
+			case SCAN_DIALOGUE:
+				s = memchr(s, ',', e - s);
+				s = s ? s + 1 : e;
+				break;
+			case SCAN_TIMING:
+				break;
+			default:
+				continue;
+			}
+			if ((ms = retime_read(s, e, &k, &style)) == -1) {
+				continue;
+			}
+			if ((n == max) && ((p = realloc(*cue, 
+					max * 2 * span * sizeof(time_t))) != NULL)) {
+				*cue = p;
+				max *= 2;
+			}
+			if (n == max) {
+				continue;
+			}
+			(*cue)[n * span] = ms;
+			if (span > 1) {
+				/* the end time is the next time stamp */
+				for (s += k; (s < e) && !isdigit(*s); s++);
+				end = retime_read(s, e, &k, &style);
+				(*cue)[n * span + 1] = MAX(end, ms);
+			}
+			n++;
+		}
+		rc = utf->mapheap ? utf_map_decode(utf, fin) : -1;
+	}
+	utf_close(utf);
+	/* ASS/SSA may not be sorted by time */
+	qsort(*cue, n, span * sizeof(time_t), cue_compare);
+	return n;
+}
+
+static int cue_compare(const void *a, const void *b)
+{
+	time_t	x = *(const time_t *) a, y = *(const time_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* The time stamp is worked out by (ms + offset) * num / den, truncated
+ * toward zero like the real number scale. The product is split by the
+ * quotient and the remainder of 'den' so it never overflows */
+#define RATIO(ms,r)	((ms) / (r)[1] * (r)[0] + (ms) % (r)[1] * (r)[0] / (r)[1])
+
+/* the general kernel checks all options. The rules go first, and the 
+ * time stamps out of any rule are retimed by other options */
+time_t subsync_tweak(SUBCTX *ctx, time_t ms)
+{
+	SUBRULE	*p;
+
+	if ((ctx->tm_rulenum > 0) && ((p = rule_find(ctx, ms)) != NULL)) {
+		ms += p->offset;
+		return p->ratio[1] ? ratio_scale(ms, p->ratio, p->scale) : ms;
+	}
+	if (!tweak_inside(ctx, ms)) {
+		return ms;
+	}
+	if (ctx->tm_mapnum > 0) {
+		ms = map_time(ctx, ms);
+	}
+	if (ctx->tm_offset) {
+		ms += ctx->tm_offset;
+	}
+	if (ctx->tm_ratio[1]) {
+		ms = ratio_scale(ms, ctx->tm_ratio, ctx->tm_scale);
+	}
+	return ms;
+}
+
+/* Select the kernel of subsync_tweak() once by the options, so the time stamps
+ * are not checked against every option */
+static void tweak_select(SUBCTX *ctx)
+{
+	/* the scale may be set directly by the library caller */
+	if ((ctx->tm_scale != 0.0) && (ctx->tm_ratio[1] == 0)) {
+		retime_linear(ctx, ctx->tm_scale, 
+				(double)ctx->tm_offset * ctx->tm_scale);
+	}
+	if ((ctx->tm_mapnum > 0) || (ctx->tm_rulenum > 0)) {
+		ctx->tweak = subsync_tweak;
+	} else if (ctx->tm_range[0] > -1) {
+		ctx->tweak = tweak_span;
+	} else if (ctx->tm_ratio[1] == 0) {
+		ctx->tweak = ctx->tm_offset ? tweak_offset : tweak_none;
+	} else {
+		ctx->tweak = ctx->tm_offset ? tweak_linear : tweak_scale;
+	}
+}
+
+/* is the time stamp inside the range and the spans */
+static int tweak_inside(SUBCTX *ctx, time_t ms)
+{
+	int	i;
+
+	if (ctx->tm_range[0] < 0) {
+		return 1;
+	}
+	if (ms < ctx->tm_range[0]) {
+		return 0;
+	}
+	if ((ctx->tm_range[1] > -1) && (ms > ctx->tm_range[1])) {
+		return 0;
+	}
+	/* in the hull but may be between the spans */
+	if (ctx->tm_spannum > 0) {
+		i = map_search(ctx->tm_span, ctx->tm_spannum, ms);
+		if ((i < 0) || ((ctx->tm_span[i*2+1] > -1) && 
+				(ms > ctx->tm_span[i*2+1]))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static time_t tweak_none(SUBCTX *ctx, time_t ms)
+{
+	return ms;
+}
+
+static time_t tweak_offset(SUBCTX *ctx, time_t ms)
+{
+	return ms + ctx->tm_offset;
+}
+
+static time_t tweak_scale(SUBCTX *ctx, time_t ms)
+{
+	return ratio_scale(ms, ctx->tm_ratio, ctx->tm_scale);
+}
+
+static time_t tweak_linear(SUBCTX *ctx, time_t ms)
+{
+	return ratio_scale(ms + ctx->tm_offset, ctx->tm_ratio, ctx->tm_scale);
+}
+
+static time_t tweak_span(SUBCTX *ctx, time_t ms)
+{
+	if (!tweak_inside(ctx, ms)) {
+		return ms;
+	}
+	ms += ctx->tm_offset;
+	return ctx->tm_ratio[1] ? 
+		ratio_scale(ms, ctx->tm_ratio, ctx->tm_scale) : ms;
+}
+
+/* The quotient is estimated by the real number scale, which is off by 1
+ * at most, then corrected by the remainder, so no integer division in 
+ * the common range */
+static time_t ratio_scale(time_t ms, time_t *ratio, double scale)
+{
+	time_t	q, r, num = ratio[0], den = ratio[1];
+
+	if ((ms < 0) || (ms >= SUB_RATIO_MS) || (num >= SUB_RATIO_NUM)) {
+		return RATIO(ms, ratio);
+	}
+	q = (time_t)(ms * scale);
+	r = ms * num - q * den;
+	return q + (r >= den) - (r < 0);
+}
+
+/* Set the scale by the ratio of 'num' / 'den', which is reduced first. 
+ * The ratio 1 means no scale */
+void subsync_scale(SUBCTX *ctx, time_t num, time_t den)
+{
+	ctx->tm_ratio[0] = num;
+	ctx->tm_ratio[1] = den;
+	if (ratio_reduce(ctx->tm_ratio) < 0) {
+		ctx->tm_scale = 0.0;
+	} else {
+		ctx->tm_scale = (double)num / (double)den;
+	}
+}
+
+/* reduce the ratio by the greatest common divisor. The ratio 1 or invalid
+ * is set to 0/0 and returns -1 */
+static int ratio_reduce(time_t *ratio)
+{
+	time_t	a = ratio[0], b = ratio[1], t;
+
+	if ((a <= 0) || (b <= 0) || (a == b)) {
+		ratio[0] = ratio[1] = 0;
+		return -1;
+	}
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	ratio[0] /= a;
+	ratio[1] /= a;
+	return 0;
+}
+
+/* Add the rule which retimes the time stamps from 'from' to 'to' by the
+ * 'offset' and the 'ratio' (NULL for no scale), where 'to' -1 means to 
+ * the end. The earlier rules win the overlapped time, so only the gaps 
+ * between them are added, which keeps the rules sorted and disjoint.
+ * Return the number of rules, or -1 if failed */
+int subsync_rule(SUBCTX *ctx, time_t from, time_t to, time_t offset,
+		time_t *ratio)
+{
+	SUBRULE	*p, rule;
+	time_t	cur;
+	int	i, n, max;
+
+	if ((from < 0) || ((to > -1) && (to < from))) {
+		return -1;
+	}
+	memset(&rule, 0, sizeof(rule));
+	rule.offset = offset;
+	if (ratio) {
+		rule.ratio[0] = ratio[0];
+		rule.ratio[1] = ratio[1];
+		if (ratio_reduce(rule.ratio) == 0) {
+			rule.scale = (double)ratio[0] / (double)ratio[1];
+		}
+	}
+	to = (to < 0) ? SUB_RULE_END : to;
+
+	/* the new rule may fill every gap */
+	if (ctx->tm_rulenum * 2 + 1 > ctx->tm_rulemax) {
+		max = MAX(16, (ctx->tm_rulenum * 2 + 1) * 2);
+		if ((p = realloc(ctx->tm_rule, max * sizeof(SUBRULE))) == NULL) {
+			return -1;
+		}
+		ctx->tm_rule = p;
+		ctx->tm_rulemax = max;
+	}
+	p = ctx->tm_rule;
+	n = ctx->tm_rulenum;
+	for (i = 0, cur = from; (i < ctx->tm_rulenum) && (cur <= to); i++) {
+		if (p[i].to < cur) {
+			continue;
+		}
+		if (p[i].from > to) {
+			break;
+		}
+		if (p[i].from > cur) {
+			p[n] = rule;
+			p[n].from = cur;
+			p[n++].to = p[i].from - 1;
+		}
+		cur = p[i].to + 1;
+	}
+	if (cur <= to) {
+		p[n] = rule;
+		p[n].from = cur;
+		p[n++].to = to;
+	}
+	qsort(p, n, sizeof(SUBRULE), rule_compare);
+	ctx->tm_rulenum = n;
+	ctx->tm_ruleidx = 0;
+	return n;
+}
+
+/* Read the rule "FROM TO OFFSET [SCALE]", or the file which lists one 
+ * rule per line. Return the number of rules, or -1 if failed */
+int subsync_rules(SUBCTX *ctx, char *s)
+{
+	FILE	*fp;
+	char	buf[256], *p;
+	int	n;
+
+	if (strpbrk(s, " \t")) {
+		if (rule_parse(ctx, s) < 0) {
+			ctx_report(ctx, "%s: invalid rule.", s);
+			return -1;
+		}
+		return ctx->tm_rulenum;
+	}
+	if ((fp = ctx_fopen(ctx, s)) == NULL) {
+		return -1;
+	}
+	for (n = 1; fgets(buf, sizeof(buf), fp); n++) {
+		for (p = buf; isspace(*p); p++);
+		if ((*p == 0) || (*p == '#')) {
+			continue;	/* blank lines and comments */
+		}
+		if (rule_parse(ctx, p) < 0) {
+			ctx_report(ctx, "%s:%d: invalid rule.", s, n);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return ctx->tm_rulenum;
+}
+
+/* the rule is FROM TO OFFSET [SCALE], where TO can be '-' for the end */
+static int rule_parse(SUBCTX *ctx, char *s)
+{
+	char	from[64], to[64], off[64], scale[64];
+	time_t	ratio[2], ms, end = -1;
+	int	n;
+
+	n = sscanf(s, "%63s %63s %63s %63s", from, to, off, scale);
+	if (n < 3) {
+		return -1;
+	}
+	if (((ms = subsync_offset(off)) == -1) && strcmp(off, "-1")) {
+		return -1;
+	}
+	if (strcmp(to, "-") && ((end = subsync_offset(to)) < 0)) {
+		return -1;
+	}
+	if ((n > 3) && (arg_ratio(scale, ratio) < 0)) {
+		return -1;
+	}
+	return subsync_rule(ctx, subsync_offset(from), end, ms, 
+			(n > 3) ? ratio : NULL);
+}
+
+/* find the rule of the time stamp, or NULL if none */
+static SUBRULE *rule_find(SUBCTX *ctx, time_t ms)
+{
+	SUBRULE	*p = ctx->tm_rule;
+	int	lo, hi, mid;
+
+	/* the time stamps are mostly in order so try the last rule first */
+	mid = ctx->tm_ruleidx;
+	if ((ms >= p[mid].from) && (ms <= p[mid].to)) {
+		return p + mid;
+	}
+	for (lo = 0, hi = ctx->tm_rulenum; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (p[mid].from <= ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((--lo < 0) || (ms > p[lo].to)) {
+		return NULL;
+	}
+	ctx->tm_ruleidx = lo;
+	return p + lo;
+}
+
+static int rule_compare(const void *a, const void *b)
+{
+	time_t	x = ((const SUBRULE *) a)->from, y = ((const SUBRULE *) b)->from;
+
+	return (x > y) - (x < y);
+}
+
+/* format the diagnostic message to the callback of the context */
+static void ctx_report(SUBCTX *ctx, char *fmt, ...)
+{
+	va_list	ap;
+	char	msg[512];
+
+	if (ctx->report == NULL) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	ctx->report(ctx->report_data, msg);
+}
+
+/* open the file of the option unless the files are refused */
+static FILE *ctx_fopen(SUBCTX *ctx, char *fname)
+{
+	FILE	*fp;
+
+	if (ctx->nofile) {
+		ctx_report(ctx, "%s: files are not allowed.", fname);
+		return NULL;
+	}
+	if ((fp = fopen(fname, "r")) == NULL) {
+		ctx_report(ctx, "%s: %s", fname, strerror(errno));
+	}
+	return fp;
+}
+
+/* duplicate the array of 'size' bytes, or NULL if empty or out of memory */
+static void *ctx_dup(void *p, size_t size)
+{
+	void	*q;
+
+	if ((p == NULL) || (size == 0) || ((q = malloc(size)) == NULL)) {
+		return NULL;
+	}
+	return memcpy(q, p, size);
+}
+
+/* the best rational approximation of 'x' by the continued fraction, whose
+ * denominator is no more than SUB_RATIO_MAX. The ratio is 0/1 if failed */
+static void ratio_approx(double x, time_t *ratio)
+{
+	time_t	h0 = 0, h1 = 1, k0 = 1, k1 = 0, a, t;
+	double	f = x;
+
+	ratio[0] = 0;
+	ratio[1] = 1;
+	if ((x <= 0.0) || (x > SUB_RATIO_MAX)) {
+		return;
+	}
+	while (1) {
+		a = (time_t) f;
+		if (a * k1 + k0 > SUB_RATIO_MAX) {
+			break;
+		}
+		t = h1; h1 = a * h1 + h0; h0 = t;
+		t = k1; k1 = a * k1 + k0; k0 = t;
+		ratio[0] = h1;
+		ratio[1] = k1;
+		if ((f - a < 1e-9) || (fabs(x - (double)h1 / k1) < x * 1e-15)) {
+			break;	/* close enough */
+		}
+		f = 1.0 / (f - a);
+	}
+}
+
+/* Add the anchor which maps the time stamp 'from' to 'to'. The anchors
+ * are sorted by 'from' and the same 'from' replaces the older one.
+ * Return the number of anchors, or -1 if failed */
+int subsync_anchor(SUBCTX *ctx, time_t from, time_t to)
+{
+	time_t	*p;
+	int	i, max;
+
+	if ((from < 0) || (to < 0)) {
+		return -1;
+	}
+	if (ctx->tm_mapnum >= ctx->tm_mapmax) {
+		max = MAX(16, ctx->tm_mapnum * 2);
+		if ((p = realloc(ctx->tm_map, max * 2 * sizeof(time_t))) == NULL) {
+			return -1;
+		}
+		ctx->tm_map = p;
+		ctx->tm_mapmax = max;
+	}
+	i = map_search(ctx->tm_map, ctx->tm_mapnum, from);
+	p = ctx->tm_map + i * 2;
+	if ((i < 0) || (p[0] != from)) {
+		i++;
+		p = ctx->tm_map + i * 2;
+		memmove(p + 2, p, (ctx->tm_mapnum - i) * 2 * sizeof(time_t));
+		ctx->tm_mapnum++;
+	}
+	p[0] = from;
+	p[1] = to;
+	ctx->tm_mapidx = 0;
+	return ctx->tm_mapnum;
+}
+
+/* Add the span of the time stamps to be retimed, where 'to' -1 means to 
+ * the end. The single span is kept in 'tm_range'. More spans are sorted 
+ * and merged in 'tm_span', and 'tm_range' becomes the hull of them.
+ * Return the number of spans, or -1 if failed */
+int subsync_span(SUBCTX *ctx, time_t from, time_t to)
+{
+	time_t	*p;
+	int	i, k, n, max;
+
+	if ((from < 0) || ((to > -1) && (to < from))) {
+		return -1;
+	}
+	if (ctx->tm_range[0] < 0) {
+		ctx->tm_range[0] = from;
+		ctx->tm_range[1] = to;
+		return 1;
+	}
+	if (ctx->tm_spannum + 2 > ctx->tm_spanmax) {
+		max = MAX(16, ctx->tm_spannum * 2);
+		if ((p = realloc(ctx->tm_span, max * 2 * sizeof(time_t))) == NULL) {
+			return -1;
+		}
+		ctx->tm_span = p;
+		ctx->tm_spanmax = max;
+	}
+	p = ctx->tm_span;
+	if (ctx->tm_spannum == 0) {
+		p[0] = ctx->tm_range[0];
+		p[1] = ctx->tm_range[1];
+		ctx->tm_spannum = 1;
+	}
+	/* insert by 'from' then merge the overlapped and adjacent spans */
+	for (i = ctx->tm_spannum; (i > 0) && (p[i*2-2] > from); i--) {
+		p[i*2]   = p[i*2-2];
+		p[i*2+1] = p[i*2-1];
+	}
+	p[i*2]   = from;
+	p[i*2+1] = to;
+	n = ctx->tm_spannum + 1;
+	for (i = k = 0; i < n; i++) {
+		if ((k > 0) && ((p[k*2-1] < 0) || (p[i*2] <= p[k*2-1] + 1))) {
+			if ((p[k*2-1] > -1) && 
+					((p[i*2+1] < 0) || (p[i*2+1] > p[k*2-1]))) {
+				p[k*2-1] = p[i*2+1];
+			}
+		} else {
+			p[k*2]   = p[i*2];
+			p[k*2+1] = p[i*2+1];
+			k++;
+		}
+	}
+	ctx->tm_spannum = k;
+	ctx->tm_range[0] = p[0];
+	ctx->tm_range[1] = p[k*2-1];
+	return k;
+}
+
+/* Read the anchor in the form of FROM=TO, or the file which lists one
+ * anchor per line. Return the number of anchors, or -1 if failed */
+int subsync_mapping(SUBCTX *ctx, char *s)
+{
+	FILE	*fp;
+	char	buf[256], *p;
+	int	n;
+
+	if (strchr(s, '=')) {
+		if (map_anchor(ctx, s) < 0) {
+			ctx_report(ctx, "%s: invalid anchor.", s);
+			return -1;
+		}
+		return ctx->tm_mapnum;
+	}
+	if ((fp = ctx_fopen(ctx, s)) == NULL) {
+		return -1;
+	}
+	for (n = 1; fgets(buf, sizeof(buf), fp); n++) {
+		for (p = buf; isspace(*p); p++);
+		if ((*p == 0) || (*p == '#')) {
+			continue;	/* blank lines and comments */
+		}
+		if (map_anchor(ctx, p) < 0) {
+			ctx_report(ctx, "%s:%d: invalid anchor.", s, n);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return ctx->tm_mapnum;
+}
+
+/* the anchor is FROM=TO or FROM TO, each of which is a time stamp */
+static int map_anchor(SUBCTX *ctx, char *s)
+{
+	char	from[64], to[64];
+
+	if (sscanf(s, " %63[^= \t\r\n]%*[= \t]%63s", from, to) != 2) {
+		return -1;
+	}
+	return subsync_anchor(ctx, subsync_offset(from), subsync_offset(to));
+}
+
+/* return the last anchor not later than 'ms', or -1 if none */
+static int map_search(time_t *map, int n, time_t ms)
+{
+	int	lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (map[mid * 2] <= ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+/* interpolate the time stamp between the anchors around it. Beyond both
+ * ends it's only shifted by the nearest anchor */
+static time_t map_time(SUBCTX *ctx, time_t ms)
+{
+	time_t	*p, num, den;
+	int	i = ctx->tm_mapidx, n = ctx->tm_mapnum;
+
+	/* the time stamps are mostly in order so try the last segment first */
+	p = ctx->tm_map + i * 2;
+	if ((i >= n) || (ms < p[0]) || ((i < n - 1) && (ms >= p[2]))) {
+		i = map_search(ctx->tm_map, n, ms);
+		ctx->tm_mapidx = MAX(i, 0);
+		p = ctx->tm_map + MAX(i, 0) * 2;
+	}
+	if ((i < 0) || (i == n - 1)) {
+		return ms + p[1] - p[0];
+	}
+	num = (ms - p[0]) * (p[3] - p[1]);
+	den = p[2] - p[0];
+	if (num < 0) {
+		return p[1] - (den / 2 - num) / den;
+	}
+	return p[1] + (num + den / 2) / den;
+}
+
+static int chop_filter(SUBCTX *ctx, char *s)
+{
+	if ((ctx->tm_chop[0] < 0) && (ctx->tm_chop[1] < 0)) {
+		return 0;	/* disabled */
+	}
+
+	switch (ctx->magic) {
+	case 0:			/* subrip */
+		if (is_number(s)) {
+			ctx->subidx++;
+		}
+		//printf("SRT %d\n", ctx->subidx);
+		if ((ctx->tm_chop[0] > 0) && (ctx->subidx < ctx->tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((ctx->tm_chop[1] > 0) && (ctx->subidx > ctx->tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	case 1:			/* ASS/SSA */
+		if (strncmp(s, "Dialogue:", 9)) {
+			break;;
+		}
+		ctx->subidx++;
+		//printf("ASS %d\n", ctx->subidx);
+		if ((ctx->tm_chop[0] > 0) && (ctx->subidx < ctx->tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((ctx->tm_chop[1] > 0) && (ctx->subidx > ctx->tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	case 2:			/* WebVTT; the block was found by retime_line() */
+		if (ctx->block == 1) {
+			ctx->subidx++;
+		}
+		if (ctx->subidx == 0) {
+			break;	/* the header before the cues */
+		}
+		if ((ctx->tm_chop[0] > 0) && (ctx->subidx < ctx->tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((ctx->tm_chop[1] > 0) && (ctx->subidx > ctx->tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	case 3:			/* MicroDVD: a cue in each line */
+		if (*s == '{') {
+			ctx->subidx++;
+		}
+		if (ctx->subidx == 0) {
+			break;	/* nothing before the cues */
+		}
+		if ((ctx->tm_chop[0] > 0) && (ctx->subidx < ctx->tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((ctx->tm_chop[1] > 0) && (ctx->subidx > ctx->tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	default:
+		if (ctx->magic > 0) {
+			break;	/* something wrong */
+		}
+		if (is_number(s)) {
+			ctx->magic = 0;
+			ctx->subidx++;
+		} else if (subsync_strtoms(s, NULL, NULL) != -1) {       /* SRT timestamp */
+			ctx->magic = 0;
+			ctx->subidx++;
+		} else if (!strncmp(s, "[Events]", 8)) {
+			ctx->magic = 1;
+			break;
+		} else if (!strncmp(s, "[Script Info]", 13)) {
+			ctx->magic = 1;
+			break;
+		} else if (!strncmp(s, "Dialogue:", 9)) {
+			ctx->magic = 1;
+			ctx->subidx++;
+		} else {
+			break;
+		}
+		if ((ctx->tm_chop[0] > 0) && (ctx->subidx < ctx->tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((ctx->tm_chop[1] > 0) && (ctx->subidx > ctx->tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	}
+	return 0;	/* no skip */
+}
+
+/* "%d : %d : %d , %d%n",    SRT
+ * "%d : %d : %d . %d%n",    ASS/SSA
+ * "%d : %d : %d : %d%n",
+ * "%d . %d . %d . %d%n",
+ * "%d - %d - %d - %d%n",
+ */
+#define ISTMSEP(n)	(((n) == ':') || ((n) == '-') || ((n) == '.') || ((n) == ','))
+/* only skip the blanks so the parser never runs across the line break */
+#define ISTMBLANK(n)	(((n) == ' ') || ((n) == '\t'))
+
+time_t subsync_strtoms(char *s, int *len, int *style)
+{
+	time_t	rc;
+	char	*sign, *lastpc, *begin = s, *p;
+	int	i, cs, tm[4], digits = 0;
+
+	tm[0] = tm[1] = tm[2] = tm[3] = 0;
+	if (len) {
+		*len = 0;	/* no number has been read */
+	}
+	while (ISTMBLANK(*s)) s++;		/* skip the front whitespace */
+	sign = lastpc = s;
+	if ((*s == '+') || (*s == '-')) {	/* if the sign exists */
+		s++;
+	}
+	for (i = 0; i < 4; i++, s++) {
+		while (ISTMBLANK(*s)) s++;
+		if (ISTMSEP(*s)) {
+			tm[i] = digits = 0;
+		} else if (isdigit(*s)) {
+			tm[i] = (int) strtol(p = s, &s, 10);
+			digits = (int)(s - p);
+		} else {
+			break;
+		}
+		if (len) {
+			*len = (int)(s - begin);
+		}
+		while (ISTMBLANK(*s)) s++;	/* skip the space between number and puncture */
+		if (!ISTMSEP(*s)) {
+			i++;
+			break;
+		} else if (i < 3) {
+			lastpc = s;
+		}
+	}
+
+	//printf("%s:  %d-%d-%d-%d (%d)(%c)\n", sign, tm[0], tm[1], tm[2], tm[3], i, *lastpc);
+	/* the fraction after '.' is centisecond like ASS/SSA, unless it's 
+	 * in 3 digits like WebVTT */
+	cs = (*lastpc == '.') && (digits != 3);
+	switch (i) {
+	case 0:		/* No number, like "abc" */
+		rc = -1;
+		break;
+	case 1:		/* one number with bad ending like "12-B" */
+		rc = tm[0];	/* one number been defined as millisecond */
+		break;
+	case 2:		/* could be 2:3 or 2.3 */
+		if (*lastpc == ':') {	/* Min : Sec */
+			rc = timetoms(0, tm[0], tm[1], 0);
+		} else {
+			rc = timetoms(0, 0, tm[0], cs ? tm[1] * 10 : tm[1]);
+		}
+		break;
+	case 3:		/* could be 1:2:3 or 1:2.3 */
+		if (*lastpc == ':') {	/* Hour : Min : Sec */
+			rc = timetoms(tm[0], tm[1], tm[2], 0);
+		} else {
+			rc = timetoms(0, tm[0], tm[1], cs ? tm[2] * 10 : tm[2]);
+		}
+		break;
+	case 4:		/* assumed being Hour : Min : Sec [?] Msec */
+		rc = timetoms(tm[0], tm[1], tm[2], cs ? tm[3] * 10 : tm[3]);
+		break;
+	}
+
+	if (style) {
+		*style = (*lastpc != '.') ? 0 : cs ? 1 : (i == 4) ? 5 : 6;
+	}
+
+	if ((*sign == '-') && (rc != -1)) {
+		rc =  - rc;
+	}
+	return rc;
+}
+
+/* the time stamp styles; see subsync_strtoms() */
+static	struct	TmFmt	{
+	int	hour;		/* minimum digits of the hour */
+	char	sep[3];		/* separators between the fields */
+	int	frac;		/* digits of the fraction of a second */
+} tmfmt[7] = {
+	{ 2, { ':', ':', ',' }, 3 },	/* SRT: 00:00:00,000 */
+	{ 1, { ':', ':', '.' }, 2 },	/* ASS: 0:00:00.00 */
+	{ 2, { ':', ':', ':' }, 3 },	/* 00:00:00:000 */
+	{ 2, { '.', '.', '.' }, 3 },	/* 00.00.00.000 */
+	{ 2, { '-', '-', '-' }, 3 },	/* 00-00-00-000 */
+	{ 2, { ':', ':', '.' }, 3 },	/* WebVTT: 00:00:00.000 */
+	{ 0, { ':', ':', '.' }, 3 },	/* WebVTT: 00:00.000 if no hour */
+};
+
+static	const	char	digit_pairs[] = 
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+#define PUT2DIGITS(p,n)	{ memcpy((p), digit_pairs + (n) * 2, 2); (p) += 2; }
+
+/* format the milliseconds into the time stamp in 'buf' without '\0'.
+ * Return the length of the time stamp */
+int subsync_mstofmt(char *buf, time_t ms, int style)
+{
+	struct	TmFmt	*fmt;
+	char	*p = buf;
+	long	hh;
+	int	mm, ss;
+
+	fmt = &tmfmt[((style > 0) && (style < 7)) ? style : 0];
+	if (ms < 0) {
+		ms = -ms;
+		*p++ = '-';
+	}
+
+	hh = (long)(ms / 3600000L);
+	ms %= 3600000L;
+	mm = (int)(ms / 60000);
+	ms %= 60000;
+	ss = (int)(ms / 1000);
+	ms %= 1000;
+
+	if (hh || fmt->hour) {		/* the hour may be omitted */
+		if ((hh < 10) && (fmt->hour == 1)) {
+			*p++ = (char)('0' + hh);
+		} else if (hh < 100) {
+			PUT2DIGITS(p, hh);
+		} else {
+			p += itofmt(p, hh);
+		}
+		*p++ = fmt->sep[0];
+	}
+	PUT2DIGITS(p, mm);
+	*p++ = fmt->sep[1];
+	PUT2DIGITS(p, ss);
+	*p++ = fmt->sep[2];
+	if (fmt->frac == 2) {
+		PUT2DIGITS(p, ms / 10);
+	} else {
+		*p++ = (char)('0' + ms / 100);
+		PUT2DIGITS(p, ms % 100);
+	}
+	return (int)(p - buf);
+}
+
+/* the 'buf' must be large enough for the time stamp, like 32 bytes */
+char *subsync_mstostr(time_t ms, int style, char *buf)
+{
+	buf[subsync_mstofmt(buf, ms, style)] = 0;
+	return buf;
+}
+
+/* format the decimal integer in 'buf' without '\0'. Return the length */
+static int itofmt(char *buf, long val)
+{
+	char	tmp[24], *p = tmp + sizeof(tmp);
+	unsigned long	n;
+	int	len;
+
+	n = (val < 0) ? -(unsigned long)val : (unsigned long)val;
+	do {
+		*--p = (char)('0' + n % 10);
+		n /= 10;
+	} while (n);
+	if (val < 0) {
+		*--p = '-';
+	}
+	len = (int)(tmp + sizeof(tmp) - p);
+	memcpy(buf, p, len);
+	return len;
+}
+
+
+static time_t timetoms(int hour, int min, int sec, int msec)
+{
+	time_t	ms;
+
+	if (hour < 0) {
+		return -1;
+	}
+
+	ms = hour * 3600 * 1000;
+
+	/* if hour not given, min is reasonable larger than 60 */
+	if ((min < 0) || ((hour > 0) && (min > 59))) {
+		return -1;
+	} else {
+		ms += min * 60 * 1000;
+	}
+
+	/* if hour and min not given, sec is reasonable larger than 60 */
+	if ((sec < 0) || (((hour > 0) || (min > 0)) && (sec > 59))) {
+		return -1;
+	} else {
+		ms += sec * 1000;
+	}
+
+	if (msec < 0) {
+		return -1;
+	}
+	return ms + msec;
+}
+
+
+/* valid parameters:
+ * [+-]N-P, [+-]P-N, [+-]N-C, [+-]C-N, [+-]P-C, [+-]C-P, [+-]0.1234
+ * [+-]01:44:30,290/01:44:31,660
+ * Note that all leading '+' and '-' are ignored because ratio is a scalar.
+ * The scale is in the exact ratio of the numerator and the denominator.
+ * Return 0 if succeed, or -1 if not a scale */
+static int arg_ratio(char *s, time_t *ratio)
+{
+	int	i;
+
+	/* skip the leading '+' or '-' */
+	if ((*s == '+') || (*s == '-')) {
+		s++;
+	}
+	/* search the identity table first for something like "N-P" */
+	for (i = 0; i < sizeof(srtbl)/sizeof(struct ScRate); i++) {
+		if (!strcmp(s, srtbl[i].id)) {
+			ratio[0] = srtbl[i].num;
+			ratio[1] = srtbl[i].den;
+			return 0;
+		}
+	}
+	/* or calculate the scale ratio by the form of 
+	 *  01:44:30,290/01:44:31,660 */
+	if (strchr(s, '/')) {
+		time_t	mf, mt;
+
+		if ((mf = subsync_strtoms(s, NULL, NULL)) <= 0) {
+			return -1;
+		}
+		s = strchr(s, '/');
+		if ((mt = subsync_strtoms(++s, NULL, NULL)) <= 0) {
+			return -1;
+		}
+		ratio[0] = mf;
+		ratio[1] = mt;
+		return 0;
+	}
+	/* or it's just a simple real number: 1.2345E12 */
+	if (!strchr(s, ':') && strchr(s, '.')) {
+		char	*endp;
+
+		ratio_approx(strtod(s, &endp), ratio);
+		if ((*endp == 0) && (ratio[0] > 0)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* the frame rate by the identifiers like "C", by the fraction like
+ * "24000/1001", or by the real number like 23.976, where the rates near
+ * 1000/1001 of an integer are taken as the NTSC rates exactly. 
+ * Return 0 if succeed, or -1 if not a frame rate */
+static int arg_fps(char *s, time_t *fps)
+{
+	char	*endp;
+	double	x;
+	time_t	n;
+	int	i;
+
+	for (i = 0; i < sizeof(fptbl)/sizeof(struct ScRate); i++) {
+		if (!strcmp(s, fptbl[i].id)) {
+			fps[0] = fptbl[i].num;
+			fps[1] = fptbl[i].den;
+			return 0;
+		}
+	}
+	if (!isdigit(*s)) {
+		return -1;
+	}
+	n = strtol(s, &endp, 10);
+	if (*endp == '/') {
+		fps[0] = n;
+		fps[1] = strtol(endp + 1, &endp, 10);
+		return ((*endp == 0) && (fps[0] > 0) && (fps[1] > 0)) ? 0 : -1;
+	}
+	x = strtod(s, &endp);
+	if ((*endp != 0) || (x <= 0.0) || (x > 1000.0)) {
+		return -1;
+	}
+	n = (time_t)(x * 1.001 + 0.5);
+	if ((fabs(x - n) > 0.005) && (fabs(x * 1.001 - n) < 0.005)) {
+		fps[0] = n * 1000;
+		fps[1] = 1001;
+	} else {
+		ratio_approx(x, fps);
+	}
+	return 0;
+}
+
+/* valid parameters:
+ * [+-]01:44:30,290, [+-]134600, [+-]01:44:31,660-01:44:30,290
+ * Note that all leading '+' and '-' are required for vectoring
+ */
+time_t subsync_offset(char *s)
+{
+	char	*endp;
+	time_t	ms;
+
+	/* ignore the form of 01:44:30,290/01:44:31,660 because it's for scaling */
+	if (strchr(s, '/')) {
+		return -1;
+	}
+	/* seperate the form -01:44:31,660-01:44:30,290 from -01:44:31,660 */
+	if (strchr(s+1, '-')) {
+		s++;	/* ignore the switch charactor '+' or '-' */
+		if ((ms = subsync_strtoms(s, NULL, NULL)) == -1) {
+			return -1;
+		}
+		s = strchr(s, '-');
+		if (subsync_strtoms(++s, NULL, NULL) == -1) {
+			return -1;
+		}
+		ms -= subsync_strtoms(s, NULL, NULL);
+		return ms;
+	}
+	/* process the form of [+-]01:44:31,660 */
+	if ((ms = subsync_strtoms(s, NULL, NULL)) != -1) {
+		return ms;
+	}
+	/* or it's simply a number by milliseconds [+-]134600 */
+	ms = strtol(s, &endp, 0);
+	if (*endp == 0) {
+		return ms;
+	}
+	return -1;
+}
+
+static int is_number(char *s)
+{
+	if (!isdigit(*s)) {
+		return 0;
+	}
+	while (isdigit(*s)) s++;
+	return (*s > 0x20) ? 0 : 1;
+}
+
+static int copy_file(FILE *fin, FILE *fout)
+{
+	char	buf[65536];
+	size_t	n;
+
+	while ((n = fread(buf, 1, sizeof(buf), fin)) > 0) {
+		if (fwrite(buf, 1, n, fout) != n) {
+			return -1;
+		}
+	}
+	return 0;
+}
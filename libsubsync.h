@@ -0,0 +1,69 @@
+/*  libsubsync.h -- the library interface to resync the subtitles
+    Copyright (C) 2009-2025  "Andy Xuming" <xuming@users.sourceforge.net>
+
+    This file is part of Subsync, a utility to resync subtitle files
+
+    Subsync is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Subsync is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSUBSYNC_H_
+#define _LIBSUBSYNC_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The options and the running status of processing the subtitles. Each
+ * thread must have its own context so they never race */
+typedef	struct	_SUBCTX	SUBCTX;
+
+SUBCTX *subsync_alloc(void);
+SUBCTX *subsync_dup(SUBCTX *ctx);
+void subsync_free(SUBCTX *ctx);
+void subsync_report(SUBCTX *ctx, void (*report)(void *, char *), void *data);
+int subsync_option(SUBCTX *ctx, int *argc, char ***argv);
+int subsync_idle(SUBCTX *ctx);
+void subsync_threads(SUBCTX *ctx, int nthread);
+void subsync_nomap(SUBCTX *ctx, int nomap);
+void subsync_nofile(SUBCTX *ctx, int nofile);
+void subsync_dump(SUBCTX *ctx, FILE *fout);
+int subsync_retime(SUBCTX *ctx, FILE *fin, FILE *fout);
+int subsync_buffer(SUBCTX *ctx, char *in, size_t inlen, 
+		char **out, size_t *outlen);
+int subsync_merge(SUBCTX *ctx, FILE **fin, int num, FILE *fout, int combine);
+int subsync_reference(SUBCTX *ctx, FILE *fref);
+int subsync_audio(SUBCTX *ctx, FILE *fwav);
+int subsync_align(SUBCTX *ctx, FILE *fin);
+int subsync_fitting(SUBCTX *ctx, char *fname);
+int subsync_anchor(SUBCTX *ctx, time_t from, time_t to);
+int subsync_mapping(SUBCTX *ctx, char *s);
+int subsync_span(SUBCTX *ctx, time_t from, time_t to);
+void subsync_scale(SUBCTX *ctx, time_t num, time_t den);
+int subsync_rule(SUBCTX *ctx, time_t from, time_t to, time_t offset,
+		time_t *ratio);
+int subsync_rules(SUBCTX *ctx, char *s);
+time_t subsync_tweak(SUBCTX *ctx, time_t ms);
+time_t subsync_strtoms(char *s, int *len, int *style);
+int subsync_mstofmt(char *buf, time_t ms, int style);
+char *subsync_mstostr(time_t ms, int style, char *buf);
+time_t subsync_offset(char *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _LIBSUBSYNC_H_ */
@@ -0,0 +1,658 @@
+
+/*  scan.c -- classify the subtitle lines and read the time stamps
+    Copyright (C) 2009-2025  "Andy Xuming" <xuming@users.sourceforge.net>
+
+    This file is part of Subsync, a utility to resync subtitle files
+
+    Subsync is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Subsync is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+/* The SIMD scanners are selected in runtime by the CPU features. 
+ * Other platforms would fall back to the scalar scanners */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CFG_SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef	char	*(*scanfn_t)(char *, char *);
+typedef	int	(*stampfn_t)(char *, char *, int *, int *);
+typedef	size_t	(*widefn_t)(char *, char *, size_t, int);
+typedef	char	*(*utf8fn_t)(char *, char *, size_t *);
+
+static char *scan_eol_init(char *s, char *e);
+static char *scan_arrow_init(char *s, char *e);
+static int scan_stamp_init(char *s, char *e, int *tm, int *style);
+static size_t scan_narrow16_init(char *d, char *s, size_t n, int be);
+static size_t scan_widen16_init(char *d, char *s, size_t n, int be);
+static char *scan_utf8_init(char *s, char *e, size_t *ctrl);
+static char *scan_eol_c(char *s, char *e);
+static char *scan_arrow_c(char *s, char *e);
+static int scan_stamp_c(char *s, char *e, int *tm, int *style);
+static size_t scan_narrow16_c(char *d, char *s, size_t n, int be);
+static size_t scan_widen16_c(char *d, char *s, size_t n, int be);
+static char *scan_utf8_c(char *s, char *e, size_t *ctrl);
+static int scan_stamp_match(char *s, int dmask, int *tm, int *style);
+static int scan_dialogue(char *s, char *e);
+static void scan_select(void);
+
+static	scanfn_t	scan_eol_fn = scan_eol_init;
+static	scanfn_t	scan_arrow_fn = scan_arrow_init;
+static	stampfn_t	scan_stamp_fn = scan_stamp_init;
+static	widefn_t	scan_narrow16_fn = scan_narrow16_init;
+static	widefn_t	scan_widen16_fn = scan_widen16_init;
+static	utf8fn_t	scan_utf8_fn = scan_utf8_init;
+static	const char	*scan_isa_name = "c";
+static	pthread_once_t	scan_once = PTHREAD_ONCE_INIT;
+
+/* digits in 2, 3 and 4 positions of a stamp like "00:02:17,440" */
+#define SCAN_2DIGITS(p)		(((p)[0] - '0') * 10 + (p)[1] - '0')
+#define SCAN_3DIGITS(p)		(SCAN_2DIGITS(p) * 10 + (p)[2] - '0')
+
+
+/* search the line break in [s, e). Return NULL if not found */
+char *scan_eol(char *s, char *e)
+{
+	return scan_eol_fn(s, e);
+}
+
+/* search the SRT arrow "-->" in [s, e). Return NULL if not found */
+char *scan_arrow(char *s, char *e)
+{
+	return scan_arrow_fn(s, e);
+}
+
+/* read the time stamp in the fixed patterns:
+ *   SRT: "00:02:17,440"; ASS/SSA: "0:02:42.42" or "00:02:42.42"
+ *   WebVTT: "00:02:17.440" or "02:17.440"
+ * The fields are stored in tm[4] as hour, minute, second and millisecond,
+ * or centisecond if the style is 1 (ASS/SSA), same to subsync_strtoms().
+ * Return the length of the time stamp, or 0 if it's not in the patterns,
+ * in which case the caller should try the flexible subsync_strtoms() */
+int scan_stamp(char *s, char *e, int *tm, int *style)
+{
+	return scan_stamp_fn(s, e, tm, style);
+}
+
+/* Classify the subtitle line in [s, e). The 'body' returns the position 
+ * after the leading whitespaces */
+int scan_class(char *s, char *e, char **body)
+{
+	char	*p;
+	int	tm[4], style;
+
+	for (p = s; (p < e) && isspace((unsigned char) *p); p++);
+	*body = p;
+	if (p == e) {
+		return SCAN_BLANK;
+	}
+	if (isdigit((unsigned char) *p)) {
+		for (s = p; (s < e) && isdigit((unsigned char) *s); s++);
+		if ((s == e) || ((unsigned char) *s <= 0x20)) {
+			return SCAN_SERIAL;
+		}
+		if (scan_arrow(s, e) || scan_stamp(p, e, tm, &style)) {
+			return SCAN_TIMING;
+		}
+		return SCAN_TEXT;
+	}
+	if (scan_dialogue(p, e)) {
+		return SCAN_DIALOGUE;
+	}
+	return SCAN_TEXT;
+}
+
+/* copy the leading ASCII characters of 'n' UTF-16 units in 's' to 'd' 
+ * as bytes. Return the number of units copied */
+size_t scan_narrow16(char *d, char *s, size_t n, int be)
+{
+	return scan_narrow16_fn(d, s, n, be);
+}
+
+/* copy the leading ASCII characters of 'n' bytes in 's' to 'd' as UTF-16 
+ * units. Return the number of characters copied */
+size_t scan_widen16(char *d, char *s, size_t n, int be)
+{
+	return scan_widen16_fn(d, s, n, be);
+}
+
+/* validate the UTF-8 contents in [s, e) and add the number of the control
+ * codes to 'ctrl'. Return the first byte of the ill-formed or incomplete 
+ * character, or 'e' if all well-formed */
+char *scan_utf8(char *s, char *e, size_t *ctrl)
+{
+	return scan_utf8_fn(s, e, ctrl);
+}
+
+/* select the scanners by the CPU features only once. It should be called
+ * before any threads, otherwise it's called by the first scanning */
+void scan_init(void)
+{
+	pthread_once(&scan_once, scan_select);
+}
+
+const char *scan_isa(void)
+{
+	scan_init();
+	return scan_isa_name;
+}
+
+
+static char *scan_eol_init(char *s, char *e)
+{
+	scan_init();
+	return scan_eol_fn(s, e);
+}
+
+static char *scan_arrow_init(char *s, char *e)
+{
+	scan_init();
+	return scan_arrow_fn(s, e);
+}
+
+static int scan_stamp_init(char *s, char *e, int *tm, int *style)
+{
+	scan_init();
+	return scan_stamp_fn(s, e, tm, style);
+}
+
+static size_t scan_narrow16_init(char *d, char *s, size_t n, int be)
+{
+	scan_init();
+	return scan_narrow16_fn(d, s, n, be);
+}
+
+static size_t scan_widen16_init(char *d, char *s, size_t n, int be)
+{
+	scan_init();
+	return scan_widen16_fn(d, s, n, be);
+}
+
+static char *scan_utf8_init(char *s, char *e, size_t *ctrl)
+{
+	scan_init();
+	return scan_utf8_fn(s, e, ctrl);
+}
+
+static char *scan_eol_c(char *s, char *e)
+{
+	for ( ; s < e; s++) {
+		if (*s == 0xa) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static char *scan_arrow_c(char *s, char *e)
+{
+	for ( ; e - s >= 3; s++) {
+		if ((s[0] == '-') && (s[1] == '-') && (s[2] == '>')) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static size_t scan_narrow16_c(char *d, char *s, size_t n, int be)
+{
+	unsigned char	*p = (unsigned char *) s;
+	size_t	i;
+
+	for (i = 0; i < n; i++, p += 2) {
+		if (p[!be] || (p[be] & 0x80)) {
+			break;
+		}
+		d[i] = p[be];
+	}
+	return i;
+}
+
+static size_t scan_widen16_c(char *d, char *s, size_t n, int be)
+{
+	size_t	i;
+
+	for (i = 0; (i < n) && !(s[i] & 0x80); i++) {
+		d[be] = s[i];
+		d[!be] = 0;
+		d += 2;
+	}
+	return i;
+}
+
+static char *scan_utf8_c(char *s, char *e, size_t *ctrl)
+{
+	unsigned char	*p = (unsigned char *) s;
+	unsigned char	*end = (unsigned char *) e;
+	size_t	n = 0;
+	int	c, len;
+
+	while (p < end) {
+		if ((c = *p) < 0x80) {
+			n += SCAN_CTRL(c);
+			p++;
+			continue;
+		}
+		if (c < 0xc2) {
+			break;		/* continuation or overlong */
+		} else if (c < 0xe0) {
+			len = 2;
+		} else if (c < 0xf0) {
+			len = 3;
+		} else if (c < 0xf5) {
+			len = 4;
+		} else {
+			break;
+		}
+		if ((end - p < len) || ((p[1] & 0xc0) != 0x80)) {
+			break;
+		}
+		if (((c == 0xe0) && (p[1] < 0xa0)) || 	/* overlong */
+				((c == 0xed) && (p[1] > 0x9f)) ||	/* surrogates */
+				((c == 0xf0) && (p[1] < 0x90)) ||	/* overlong */
+				((c == 0xf4) && (p[1] > 0x8f))) {	/* > U+10FFFF */
+			break;
+		}
+		if ((len > 2) && ((p[2] & 0xc0) != 0x80)) {
+			break;
+		}
+		if ((len > 3) && ((p[3] & 0xc0) != 0x80)) {
+			break;
+		}
+		p += len;
+	}
+	*ctrl += n;
+	return (char *) p;
+}
+
+static int scan_stamp_c(char *s, char *e, int *tm, int *style)
+{
+	char	buf[16];
+	int	i, n, dmask;
+
+	if ((n = (int)(e - s)) < (int) sizeof(buf)) {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, s, n);
+		s = buf;
+	}
+	for (i = dmask = 0; i < 13; i++) {
+		if (isdigit((unsigned char) s[i])) {
+			dmask |= 1 << i;
+		}
+	}
+	return scan_stamp_match(s, dmask, tm, style);
+}
+
+/* match the digit mask and the separators of the patterns */
+static int scan_stamp_match(char *s, int dmask, int *tm, int *style)
+{
+	if (((dmask & 0x1fff) == 0x0edb) && (s[2] == ':') && 
+			(s[5] == ':') && (s[8] == ',')) {
+		tm[0] = SCAN_2DIGITS(s);	/* 00:02:17,440 */
+		tm[1] = SCAN_2DIGITS(s + 3);
+		tm[2] = SCAN_2DIGITS(s + 6);
+		tm[3] = SCAN_3DIGITS(s + 9);
+		*style = 0;
+		return 12;
+	}
+	if (((dmask & 0x1fff) == 0x0edb) && (s[2] == ':') && 
+			(s[5] == ':') && (s[8] == '.')) {
+		tm[0] = SCAN_2DIGITS(s);	/* 00:02:17.440 */
+		tm[1] = SCAN_2DIGITS(s + 3);
+		tm[2] = SCAN_2DIGITS(s + 6);
+		tm[3] = SCAN_3DIGITS(s + 9);
+		*style = 5;
+		return 12;
+	}
+	if (((dmask & 0x3ff) == 0x1db) && (s[2] == ':') && (s[5] == '.')) {
+		tm[0] = 0;			/* 02:17.440 */
+		tm[1] = SCAN_2DIGITS(s);
+		tm[2] = SCAN_2DIGITS(s + 3);
+		tm[3] = SCAN_3DIGITS(s + 6);
+		*style = 6;
+		return 9;
+	}
+	if (((dmask & 0x7ff) == 0x36d) && (s[1] == ':') && 
+			(s[4] == ':') && (s[7] == '.')) {
+		tm[0] = s[0] - '0';		/* 0:02:42.42 */
+		tm[1] = SCAN_2DIGITS(s + 2);
+		tm[2] = SCAN_2DIGITS(s + 5);
+		tm[3] = SCAN_2DIGITS(s + 8);
+		*style = 1;
+		return 10;
+	}
+	if (((dmask & 0xfff) == 0x6db) && (s[2] == ':') && 
+			(s[5] == ':') && (s[8] == '.')) {
+		tm[0] = SCAN_2DIGITS(s);	/* 00:02:42.42 */
+		tm[1] = SCAN_2DIGITS(s + 3);
+		tm[2] = SCAN_2DIGITS(s + 6);
+		tm[3] = SCAN_2DIGITS(s + 9);
+		*style = 1;
+		return 11;
+	}
+	return 0;
+}
+
+static int scan_dialogue(char *s, char *e)
+{
+	if (e - s <= 9) {
+		return 0;
+	}
+	return !strncasecmp(s, "Dialogue:", 9);
+}
+
+#ifdef	CFG_SCAN_X86
+__attribute__((target("sse2")))
+static char *scan_eol_sse2(char *s, char *e)
+{
+	__m128i	lf = _mm_set1_epi8(0xa);
+	int	mask;
+
+	for ( ; e - s >= 16; s += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((__m128i *) s), lf));
+		if (mask) {
+			return s + __builtin_ctz(mask);
+		}
+	}
+	return scan_eol_c(s, e);
+}
+
+__attribute__((target("avx2")))
+static char *scan_eol_avx2(char *s, char *e)
+{
+	__m256i	lf = _mm256_set1_epi8(0xa);
+	int	mask;
+
+	for ( ; e - s >= 32; s += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((__m256i *) s), lf));
+		if (mask) {
+			return s + __builtin_ctz(mask);
+		}
+	}
+	return scan_eol_c(s, e);
+}
+
+__attribute__((target("sse2")))
+static char *scan_arrow_sse2(char *s, char *e)
+{
+	__m128i	dash = _mm_set1_epi8('-');
+	__m128i	gt = _mm_set1_epi8('>');
+	__m128i	a, b, c;
+	int	mask;
+
+	for ( ; e - s >= 18; s += 16) {
+		a = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) s), dash);
+		b = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (s + 1)), dash);
+		c = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (s + 2)), gt);
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+		if (mask) {
+			return s + __builtin_ctz(mask);
+		}
+	}
+	return scan_arrow_c(s, e);
+}
+
+__attribute__((target("avx2")))
+static char *scan_arrow_avx2(char *s, char *e)
+{
+	__m256i	dash = _mm256_set1_epi8('-');
+	__m256i	gt = _mm256_set1_epi8('>');
+	__m256i	a, b, c;
+	int	mask;
+
+	for ( ; e - s >= 34; s += 32) {
+		a = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) s), dash);
+		b = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (s + 1)), dash);
+		c = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (s + 2)), gt);
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+		if (mask) {
+			return s + __builtin_ctz(mask);
+		}
+	}
+	return scan_arrow_sse2(s, e);
+}
+
+/* validate all digits of the time stamp by one comparison */
+__attribute__((target("sse2")))
+static int scan_stamp_sse2(char *s, char *e, int *tm, int *style)
+{
+	__m128i	v, d;
+	char	buf[16];
+	int	n;
+
+	if ((n = (int)(e - s)) < (int) sizeof(buf)) {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, s, n);
+		s = buf;
+	}
+	v = _mm_loadu_si128((__m128i *) s);
+	d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	return scan_stamp_match(s, _mm_movemask_epi8(d), tm, style);
+}
+
+/* 16 units in two vectors are checked and packed in one go */
+__attribute__((target("sse2")))
+static size_t scan_narrow16_sse2(char *d, char *s, size_t n, int be)
+{
+	__m128i	hibits = _mm_set1_epi16((short) 0xff80);
+	__m128i	a, b;
+	size_t	i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128((__m128i *) (s + i * 2));
+		b = _mm_loadu_si128((__m128i *) (s + i * 2 + 16));
+		if (be) {
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(
+				_mm_or_si128(a, b), hibits), 
+				_mm_setzero_si128())) != 0xffff) {
+			break;
+		}
+		_mm_storeu_si128((__m128i *) (d + i), _mm_packus_epi16(a, b));
+	}
+	return i + scan_narrow16_c(d + i, s + i * 2, n - i, be);
+}
+
+__attribute__((target("sse2")))
+static size_t scan_widen16_sse2(char *d, char *s, size_t n, int be)
+{
+	__m128i	zero = _mm_setzero_si128();
+	__m128i	v;
+	size_t	i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((__m128i *) (s + i));
+		if (_mm_movemask_epi8(v)) {
+			break;
+		}
+		if (be) {
+			_mm_storeu_si128((__m128i *) (d + i * 2), 
+					_mm_unpacklo_epi8(zero, v));
+			_mm_storeu_si128((__m128i *) (d + i * 2 + 16), 
+					_mm_unpackhi_epi8(zero, v));
+		} else {
+			_mm_storeu_si128((__m128i *) (d + i * 2), 
+					_mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i *) (d + i * 2 + 16), 
+					_mm_unpackhi_epi8(v, zero));
+		}
+	}
+	return i + scan_widen16_c(d + i * 2, s + i, n - i, be);
+}
+
+/* The UTF-8 validation by looking up the error classes of each pair of the
+ * nibbles, after "Validating UTF-8 in less than one instruction per byte" 
+ * by John Keiser and Daniel Lemire. The block with any error is handed to 
+ * the scalar validator to find the exact position */
+#define U8_TOO_SHORT	(1 << 0)
+#define U8_TOO_LONG	(1 << 1)
+#define U8_OVERLONG_3	(1 << 2)
+#define U8_TOO_LARGE	(1 << 3)
+#define U8_SURROGATE	(1 << 4)
+#define U8_OVERLONG_2	(1 << 5)
+#define U8_TOO_LARGE_1000	(1 << 6)
+#define U8_OVERLONG_4	(1 << 6)
+#define U8_TWO_CONTS	(1 << 7)
+#define U8_CARRY	(U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static char *scan_utf8_ssse3(char *s, char *e, size_t *ctrl)
+{
+	const __m128i	byte1_high = _mm_setr_epi8(
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		U8_TOO_SHORT,
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+	const __m128i	byte1_low = _mm_setr_epi8(
+		U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+		U8_CARRY | U8_OVERLONG_2,
+		U8_CARRY,
+		U8_CARRY,
+		U8_CARRY | U8_TOO_LARGE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+	const __m128i	byte2_high = _mm_setr_epi8(
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | 
+			U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | 
+			U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | 
+			U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | 
+			U8_TOO_LARGE,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+	/* the lead bytes in the end which need more bytes in the next block */
+	const __m128i	incomplete_max = _mm_setr_epi8(-1, -1, -1, -1, 
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, 
+			(char) 0xef, (char) 0xdf, (char) 0xbf);
+	const __m128i	nibble = _mm_set1_epi8(0x0f);
+	const __m128i	zero = _mm_setzero_si128();
+	__m128i	v, prev, incomplete, prev1, err, cc;
+	char	*start = s;
+	size_t	n = 0;
+	int	i;
+
+	prev = incomplete = zero;
+	for ( ; e - s >= 16; s += 16) {
+		v = _mm_loadu_si128((__m128i *) s);
+		if (_mm_movemask_epi8(v) == 0) {	/* ASCII only */
+			err = incomplete;
+		} else {
+			prev1 = _mm_alignr_epi8(v, prev, 15);
+			err = _mm_and_si128(_mm_and_si128(
+				_mm_shuffle_epi8(byte1_high, _mm_and_si128(
+					_mm_srli_epi16(prev1, 4), nibble)),
+				_mm_shuffle_epi8(byte1_low, 
+					_mm_and_si128(prev1, nibble))),
+				_mm_shuffle_epi8(byte2_high, _mm_and_si128(
+					_mm_srli_epi16(v, 4), nibble)));
+			/* the 3rd and 4th bytes must be continuations */
+			cc = _mm_or_si128(
+				_mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), 
+					_mm_set1_epi8(0xe0 - 0x80)),
+				_mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), 
+					_mm_set1_epi8((char)(0xf0 - 0x80))));
+			err = _mm_xor_si128(err, _mm_and_si128(cc, 
+					_mm_set1_epi8((char) 0x80)));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xffff) {
+			break;
+		}
+		incomplete = _mm_subs_epu8(v, incomplete_max);
+
+		/* control codes: 0-31 but not 9-13, or 0x7f */
+		cc = _mm_sub_epi8(v, _mm_set1_epi8(9));
+		cc = _mm_andnot_si128(
+			_mm_cmpeq_epi8(_mm_min_epu8(cc, _mm_set1_epi8(4)), cc),
+			_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+		cc = _mm_or_si128(cc, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+		n += __builtin_popcount(_mm_movemask_epi8(cc));
+		prev = v;
+	}
+	*ctrl += n;
+
+	/* the rest goes to the scalar validator from the lead byte of the 
+	 * character which runs across the block boundary */
+	for (i = 1; (i <= 3) && (s - i >= start); i++) {
+		if ((s[-i] & 0xc0) != 0x80) {
+			if ((unsigned char) s[-i] >= 0xc0) {
+				s -= i;
+			}
+			break;
+		}
+	}
+	return scan_utf8_c(s, e, ctrl);
+}
+#endif	/* CFG_SCAN_X86 */
+
+static void scan_select(void)
+{
+#ifdef	CFG_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_eol_fn   = scan_eol_avx2;
+		scan_arrow_fn = scan_arrow_avx2;
+		scan_stamp_fn = scan_stamp_sse2;
+		scan_narrow16_fn = scan_narrow16_sse2;
+		scan_widen16_fn  = scan_widen16_sse2;
+		scan_utf8_fn  = scan_utf8_ssse3;
+		scan_isa_name = "avx2";
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		scan_eol_fn   = scan_eol_sse2;
+		scan_arrow_fn = scan_arrow_sse2;
+		scan_stamp_fn = scan_stamp_sse2;
+		scan_narrow16_fn = scan_narrow16_sse2;
+		scan_widen16_fn  = scan_widen16_sse2;
+		scan_utf8_fn  = __builtin_cpu_supports("ssse3") ? 
+				scan_utf8_ssse3 : scan_utf8_c;
+		scan_isa_name = "sse2";
+		return;
+	}
+#endif
+	scan_eol_fn   = scan_eol_c;
+	scan_arrow_fn = scan_arrow_c;
+	scan_stamp_fn = scan_stamp_c;
+	scan_narrow16_fn = scan_narrow16_c;
+	scan_widen16_fn  = scan_widen16_c;
+	scan_utf8_fn  = scan_utf8_c;
+	scan_isa_name = "c";
+}
+
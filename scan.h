@@ -0,0 +1,36 @@
+#ifndef _SUBSYNC_SCAN_H_
+#define _SUBSYNC_SCAN_H_
+
+/* classes of the subtitle lines by scan_class() */
+#define SCAN_TEXT	0	/* anything else */
+#define SCAN_BLANK	1	/* whitespaces only */
+#define SCAN_SERIAL	2	/* SRT serial number */
+#define SCAN_TIMING	3	/* SRT time stamps: 00:02:17,440 --> ... */
+#define SCAN_DIALOGUE	4	/* ASS/SSA: Dialogue: 0,0:02:42.42,... */
+
+/* control codes except the whitespaces, like '\t', '\r' and '\n'. The NUL
+ * is counted too, like the padding of the binary files */
+#define SCAN_CTRL(c)	(((c) < 9) || (((c) > 13) && ((c) < 32)) || ((c) == 127))
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char *scan_eol(char *s, char *e);
+char *scan_arrow(char *s, char *e);
+int scan_class(char *s, char *e, char **body);
+int scan_stamp(char *s, char *e, int *tm, int *style);
+size_t scan_narrow16(char *d, char *s, size_t n, int be);
+size_t scan_widen16(char *d, char *s, size_t n, int be);
+char *scan_utf8(char *s, char *e, size_t *ctrl);
+void scan_init(void);
+const char *scan_isa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SUBSYNC_SCAN_H_ */
+
@@ -24,43 +24,58 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 
-#include "utf.h"
-
-struct	ScRate	{
-	char	*id;
-	double	fact;
-} srtbl[6] = {
-	{ "N-P",	1.1988 },	/* NTSC to PAL frame rate 29.97/25 */
-	{ "P-N",	0.83417 },	/* PAL to NTSC frame rate 25/29.97 */
-	{ "N-C",	1.25 },	/* NTSC to Cinematic frame rate 29.97/23.976 */
-	{ "C-N",	0.8 },	/* Cinematic to NTSC frame rate 23.976/29.97 */
-	{ "P-C",	1.04271 }, /* PAL to Cinematic frame rate 25/23.976 */
-	{ "C-P",	0.95904 },  /* Cinematic to PAL frame rate 23.976/25 */
-};
+/* the server mode by unix domain socket is not available in MinGW */
+#if !defined(_WIN32)
+#define CFG_UNIX_SOCKET
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
+#include "utf.h"
+#include "scan.h"
+#include "libsubsync.h"
 
 char	*subsync_help = "\
 usage: subsync [OPTION] [sutitle_file]\n\
 OPTION:\n\
   -c, --chop N:M         chop the specified number of subtitles (from 1)\n\
+      --chop-time TIME [TIME] chop the subtitles starting in the time\n\
+      --combine          merge the files and combine the overlapped cues\n\
   -d, --decoding DECODE  specifies the decoding (iconv name)\n\
   -e, --encoding ENCODE  specifies the encoding (iconv name)\n\
+      --fit FILE         fit the offset and scale by the time stamp pairs\n\
+      --fps RATE         the frame rate of MicroDVD, like 25, 23.976 or N\n\
+  -j, --jobs N           retime by N threads in parallel\n\
+  -m, --map ANCHOR|FILE  map the time stamps by the anchors FROM=TO\n\
+      --merge            merge the files by the start time of the cues\n\
+      --invalid MODE     handles the invalid UTF-8: keep, reject or repair\n\
       --same-coding      specifies the encoding following decoding\n\
   -o                     overwrite the original file (no backup file)\n\
       --overwrite        overwrite the original file (has backup file)\n\
   -r, --reorder [NUM]    reorder the serial number (SRT only)\n\
+      --rule RULE|FILE   retime by the rules \"FROM TO OFFSET [SCALE]\"\n\
+      --ref FILE         align the time stamps to the reference subtitle\n\
+      --audio FILE       align the time stamps to the voice in the WAV file\n\
   -s, --span TIME [TIME] specifies the span of the time stamps for processing\n\
+      --serve [SOCKET]   serve the requests from the socket or stdin\n\
+      --sort             sort the cues by the start time\n\
+      --table            retime by the parsed cue table\n\
+      --to FORMAT        convert the subtitle to FORMAT: srt or vtt\n\
   -w, --write FILENAME   write to the specified file\n\
       -/+OFFSET          specifies the offset of the time stamps\n\
       -SCALE             specifies the scale ratio of the time stamps\n\
       --help, --version\n\
       --help-example\n\
 TIME:\n\
-  Two time stamp formats are recognizable:\n\
+  Three time stamp formats are recognizable:\n\
   SRT format HH:MM:SS,mmm, for example, 0:0:10,199\n\
   ASS format HH:MM:SS.mm, for example, 1:0:12.66\n\
+  WebVTT format HH:MM:SS.mmm, for example, 1:0:12.660\n\
   Note that all 4 time sections are required. Can be filled 0 like 0:0:12,000\n\
 OFFSET:\n\
   Time stamp offset; the prefix '+' or '-' defines delay or bring forward.\n\
@@ -72,7 +87,8 @@ SCALE:\n\
   Time stamp scaling ratio; tweak the time stamp from different frame rates,\n\
   for example, between  PAL(25), NTSC(29.97) and Cinematic(23.976).\n\
   It can be defined by real number: 1.1988; or by predefined identifiers:\n\
-  N-P(1.1988), P-N(0.83417), N-C(1.25), C-N(0.8), P-C(1.04271), C-P(0.95904)\n\
+  N-P(1200/1001), P-N(1001/1200), N-C(5/4), C-N(4/5), P-C(1001/960),\n\
+  C-P(960/1001)\n\
   or by time stamp dividing, the expect time stamp divided by the actual\n\
   time stamp, for example: -01:44:30,290/01:44:31,660\n\
 ";
@@ -83,6 +99,10 @@ Debug Options:\n\
       --help-divide     calculate the scale ratio of time stamps\n\
       --help-strtoms    test reading the time stamps\n\
       --help-debug      display the internal arguments\n\
+      --help-bench FILE [COUNT]\n\
+                        benchmark the file scaled up by COUNT times\n\
+      --help-client SOCKET FILE [OPTION]...\n\
+                        send FILE to the server and print the reply\n\
       --help-example    display the example\n\
       --mock-bom        detect BOM of the file\n\
       --mock-encoding   dump the supported BOM list\n\
@@ -119,37 +139,63 @@ This program comes with ABSOLUTELY NO WARRANTY.\n\
 This is free software, and you are welcome to redistribute it under certain\n\
 conditions. For details see see `LICENSE'.\n";
 
-time_t	tm_offset = 0;
-double	tm_scale = 0.0;
-time_t	tm_range[2] = { -1, -1 };
-int	tm_chop[2] = { -1, -1 };
-int	tm_srtsn = -1;		/* -1: not to orderize SRT sn  */
-int	tm_overwrite = 0;	/* 1: overwrite  2: overwrite and backup */
-
-char	*g_decode = NULL;
-char	*g_encode = NULL;
-int	g_same_code = 0;	/* by default we output UTF-8 */
-
-static int retiming(FILE *fin, FILE *fout);
-static time_t tweaktime(time_t ms);
-static int chop_filter(char *s, int *magic);
-static time_t strtoms(char *s, int *len, int *style);
-static char *mstostr(time_t ms, int style);
-static time_t timetoms(int hour, int min, int sec, int msec);
-static double arg_scale(char *s);
-static time_t arg_offset(char *s);
-static int is_number(char *s);
+/* the files in the batch processing by the worker threads */
+typedef	struct	_SUBJOB	{
+	char	*fname;
+	FILE	*fout;		/* the temporary output in appending mode */
+	int	done;
+} SUBJOB;
+
+typedef	struct	_SUBPOOL	{
+	SUBCTX	*ctx;		/* the options shared by all workers */
+	SUBJOB	*job;
+	int	total;
+	int	next;		/* the next job to pick up */
+	int	append;		/* 1: output to the temporary files */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+} SUBPOOL;
+
+static	int	tm_overwrite = 0;	/* 1: overwrite  2: overwrite and backup */
+static	int	tm_align = 0;		/* 1: align each file to the reference */
+
+static int retime_run(SUBCTX *ctx, char **argv, int argc, char *outname,
+		int nthread);
+static int retime_file(SUBCTX *ctx, char *fname, FILE *fout);
+static int retime_write(SUBCTX *ctx, char *fname, FILE *fin, FILE *fout);
+static int retime_ref(SUBCTX *ctx, char *refname, int audio);
+static FILE *retime_stdin(SUBCTX *ctx);
+static int retime_batch(SUBCTX *ctx, char **flist, int fnum, char *outname,
+		int nthread);
+static void *retime_worker(void *arg);
+static int merge_files(SUBCTX *ctx, char **flist, int fnum, char *outname,
+		int combine);
+static int serve(SUBCTX *ctx, char *sockname);
+static int serve_session(SUBCTX *ctx, FILE *fin, FILE *fout);
+static int serve_request(SUBCTX *ctx, char *opts, size_t optlen, 
+		char *body, size_t len, FILE *fout);
+static int serve_reply(FILE *fout, int status, char *s, size_t len);
 static FILE *safe_open(char *pathname, char *mode, char **nominee);
 static int safe_swapname(const char *fixname, char *dyname);
-static int help_tools(int argc, char **argv);
+static void report_stderr(void *data, char *msg);
+static void report_keep(void *data, char *msg);
+static int help_tools(SUBCTX *ctx, int argc, char **argv);
 static void test_str_to_ms(void);
+static int test_bench(SUBCTX *ctx, char *fname, int count);
+static int test_client(char *sockname, char *fname, int argc, char **argv);
+static int copy_file(FILE *fin, FILE *fout);
 
 
 int main(int argc, char **argv)
 {
-	FILE	*fin = NULL, *fout = NULL;
-	char	*dyname, *outname = NULL;
+	SUBCTX	*ctx;
+	char	*outname = NULL, *sockname = NULL, *refname = NULL;
+	int	rc, nthread = 1, audio = 0, merge = 0;
 
+	if ((ctx = subsync_alloc()) == NULL) {
+		return -1;
+	}
+	subsync_report(ctx, report_stderr, NULL);
 	while (--argc && ((**++argv == '-') || (**argv == '+'))) {
 		if (!strcmp(*argv, "-V") || !strcmp(*argv, "--version")) {
 			printf(subsync_version, VERSION);
@@ -158,517 +204,550 @@ int main(int argc, char **argv)
 			puts(subsync_help);
 			return 0;
 		} else if (!strncmp(*argv, "--help-", 7)) {
-			return help_tools(argc, argv);
+			return help_tools(ctx, argc, argv);
 		} else if (!strcmp(*argv, "-o")) {
 			tm_overwrite = 1;	/* no backup */
 		} else if (!strcmp(*argv, "--overwrite")) {
 			tm_overwrite = 2;	/* has backup */
-		} else if (!strcmp(*argv, "-c") || !strcmp(*argv, "--chop")) {
+		} else if (!strcmp(*argv, "-j") || !strcmp(*argv, "--jobs")) {
 			MOREARG(argc, argv);
-			if (sscanf(*argv, "%d : %d", tm_chop, tm_chop + 1) != 2) {
-				tm_chop[0] = tm_chop[1] = -1;
+			if ((nthread = (int)strtol(*argv, NULL, 0)) < 1) {
+				nthread = 1;
 			}
-		} else if (!strcmp(*argv, "-d") || !strcmp(*argv, "--decoding")) {
-			MOREARG(argc, argv);
-			g_decode = *argv;
-		} else if (!strcmp(*argv, "-e") || !strcmp(*argv, "--encoding")) {
-			MOREARG(argc, argv);
-			g_encode = *argv;
-		} else if (!strncmp(*argv, "--same-coding", 6)) {
-			g_same_code = 1;
-		} else if (!strcmp(*argv, "-r") || !strcmp(*argv, "--reorder")) {
-			if ((argc > 0) && is_number(argv[1])) {
-				--argc;	tm_srtsn = (int)strtol(*++argv, NULL, 0);
+		} else if (!strcmp(*argv, "--serve")) {
+			/* the socket is optional; default is stdin/stdout */
+			if ((argc > 1) && (*argv[1] != '-') && (*argv[1] != '+')) {
+				--argc;	sockname = *++argv;
 			} else {
-				tm_srtsn = 1;	/* set as default */
-			}
-		} else if (!strcmp(*argv, "-s") || !strcmp(*argv, "--span")) {
-			MOREARG(argc, argv);
-			tm_range[0] = arg_offset(*argv);
-			/* the second parameter is optional, must begin in number */
-			if ((argc > 0) && isdigit(argv[1][0])) {
-				--argc; tm_range[1] = arg_offset(*++argv);
+				sockname = "";
 			}
 		} else if (!strcmp(*argv, "-w") || !strcmp(*argv, "--write")) {
 			MOREARG(argc, argv);
 			outname = *argv;
+		} else if (!strcmp(*argv, "--merge")) {
+			if (merge == 0) {
+				merge = 1;
+			}
+		} else if (!strcmp(*argv, "--combine")) {
+			merge = 2;
+		} else if (!strcmp(*argv, "--ref")) {
+			MOREARG(argc, argv);
+			refname = *argv;
+			audio = 0;
+		} else if (!strcmp(*argv, "--audio")) {
+			MOREARG(argc, argv);
+			refname = *argv;
+			audio = 1;
 		} else if (!strcmp(*argv, "--")) {
 			break;
-		} else if (arg_scale(*argv) != 0) {
-			tm_scale = arg_scale(*argv);
-		} else if (arg_offset(*argv) != -1) {
-			tm_offset = arg_offset(*argv);
-		} else {
+		} else if ((rc = subsync_option(ctx, &argc, &argv)) < 0) {
+			return -1;
+		} else if (rc == 0) {
 			fprintf(stderr, "%s: unknown parameter.\n", *argv);
 			return -1;
 		}
 	}
-	if ((tm_offset == 0) && (tm_scale == 0) && (tm_srtsn < 0) && 
-			(tm_chop[0] < 0) && (tm_chop[1] < 0)) {
+	/* a single file is split into chunks for the threads */
+	subsync_threads(ctx, nthread);
+	if (sockname) {
+		/* the clients can't read the files of the server */
+		subsync_nofile(ctx, 1);
+		rc = serve(ctx, sockname);
+		subsync_free(ctx);
+		return rc;
+	}
+	if (refname && (retime_ref(ctx, refname, audio) < 0)) {
+		return -1;
+	}
+	tm_align = (refname != NULL);
+	if (subsync_idle(ctx) && !merge && !refname) {
 		puts(subsync_help);
 		return 0;
 	}
+	if (merge) {
+		rc = merge_files(ctx, argv, argc, outname, merge == 2);
+	} else {
+		rc = retime_run(ctx, argv, argc, outname, nthread);
+	}
+	subsync_free(ctx);
+	return rc;
+}
+
+/* retime the files in the argument list, or stdin if the list is empty */
+static int retime_run(SUBCTX *ctx, char **argv, int argc, char *outname,
+		int nthread)
+{
+	FILE	*fin, *fout;
+
 
 	/* input from stdin */
 	if ((argc == 0) || !strcmp(*argv, "--")) {
+		if ((fin = retime_stdin(ctx)) == NULL) {
+			return -1;
+		}
 		if (outname == NULL) {
-			retiming(stdin, stdout);
+			subsync_retime(ctx, fin, stdout);
 		} else if ((fout = safe_open(outname, "w", NULL)) == NULL) {
 			perror(outname);
 		} else {
-			retiming(stdin, fout);
+			subsync_retime(ctx, fin, fout);
 			fclose(fout);
 		}
 		return 0;
 	}
 
 	/* input from the argument list */
+	if ((nthread > 1) && (argc > 1)) {
+		return retime_batch(ctx, argv, argc, outname, nthread);
+	}
 	for ( ; argc; argc--, argv++) {
-		if ((fin = safe_open(*argv, "rb", NULL)) == NULL) {
-			perror(*argv);
-			continue;
-		}
-		if (tm_overwrite == 0) {		/* appending mode */
-			if (outname == NULL) {
-				retiming(fin, stdout);
-			} else if ((fout = safe_open(outname, "a", NULL)) == NULL) {
-				perror(outname);
-			} else {
-				retiming(fin, fout);
-				fclose(fout);
-			}
-		} else if ((fout = safe_open(*argv, "w", &dyname)) == NULL) {
+		if (tm_overwrite || (outname == NULL)) {
+			retime_file(ctx, *argv, stdout);
+		} else if (access(*argv, R_OK)) {
 			perror(*argv);
+		} else if ((fout = safe_open(outname, "a", NULL)) == NULL) {
+			perror(outname);
 		} else {
-			retiming(fin, fout);
-			fclose(fin);
+			retime_file(ctx, *argv, fout);
 			fclose(fout);
-
-			/* swap the file names so the original file become the backup */
-			if (!safe_swapname(*argv, dyname) && (tm_overwrite == 1)) { 
-				unlink(dyname);		/* no backup */
-			}
-			free(dyname);
-			continue;	/* fin is already closed */
 		}
-		fclose(fin);
 	}
 	return 0;
 }
 
-static int retiming(FILE *fin, FILE *fout)
+/* retime the subtitle file to 'fout' in the appending mode, 
+ * or to itself in the overwrite mode */
+static int retime_file(SUBCTX *ctx, char *fname, FILE *fout)
 {
-	UTFB	*utf;
-	char	buf[4096], *s, *p, tmp[64];
-	time_t	ms;
-	int	n, style, srtsn;
-	int	magic = -1;		/* -1: uncertain 0: SRT 1: SSA */
+	SUBCTX	*job;
+	FILE	*fin;
+	int	rc;
 
-	if ((utf = utf_open(fin, g_decode, g_encode)) == NULL) {
+	if ((fin = safe_open(fname, "rb", NULL)) == NULL) {
+		perror(fname);
 		return -1;
 	}
-	if (!g_same_code && !g_encode) {
-		utf->na_enc[0] = 0;	/* force UTF-8 output */
+	if (!tm_align) {
+		rc = retime_write(ctx, fname, fin, fout);
+	} else if ((job = subsync_dup(ctx)) == NULL) {
+		rc = -1;
+	} else {
+		/* each file has its own offset and scale to the reference */
+		if ((rc = subsync_align(job, fin)) < 0) {
+			fprintf(stderr, "%s: not aligned.\n", fname);
+		} else {
+			rc = retime_write(job, fname, fin, fout);
+		}
+		subsync_free(job);
 	}
-	utf_write_bom(utf, fout);
+	fclose(fin);
+	return rc;
+}
 
-	srtsn = tm_srtsn;
-	while (utf_gets(utf, fin, buf, sizeof(buf)-1)) {
-		WARNX("utf_gets: %s\n", buf);
-		if (chop_filter(buf, &magic)) {
-			continue;	/* skip the specified subtitles */
-		}
-
-		/* skip and output the whitespaces */
-		for (s = buf; isspace(*s); s++) utf_cache(utf, fout, s, 1);
-		
-		/* SRT: 00:02:17,440 --> 00:02:20,375
-		 * ASS: Dialogue: Marked=0,0:02:42.42,0:02:44.15,Wolf main,
-		 *           autre,0000,0000,0000,,Toujours rien. */
-		if (!strncasecmp(s, "Dialogue:", 9)) {	/* ASS/SSA timestamp */
-			/* output everything before the first timestamp */
-			while (*s != ',') utf_cache(utf, fout, s++, 1);
-			/* output the ',' also */
-			utf_cache(utf, fout, s++, 1);
-			/* read and skip the first timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			p = mstostr(tweaktime(ms), style);
-			utf_cache(utf, fout, p, strlen(p));
-			/* output everything before the second timestamp */
-			while (*s != ',') utf_cache(utf, fout, s++, 1);
-			/* output the ',' also */
-			utf_cache(utf, fout, s++, 1);
-			/* read and skip the second timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			p = mstostr(tweaktime(ms), style);
-			utf_cache(utf, fout, p, strlen(p));
-		} else if (is_number(s)) {	/* SRT serial number */
-			if (srtsn > 0) {
-				/* SRT serial numbers to be re-ordered */
-				sprintf(tmp, "%d", srtsn++);
-				utf_cache(utf, fout, tmp, strlen(tmp));
-				while (isdigit(*s)) s++;
-			}
-		} else if ((ms = strtoms(s, &n, &style)) != -1) {	/* SRT timestamp */
-			/* skip the first timestamp */
-			s += n;
-			/* output the tweaked timestamp */
-			p = mstostr(tweaktime(ms), style);
-			utf_cache(utf, fout, p, strlen(p));
-
-			/* output everything before the second timestamp */
-			while (*s && !isdigit(*s)) utf_cache(utf, fout, s++, 1);
-			/* read and skip the second timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			p = mstostr(tweaktime(ms), style);
-			utf_cache(utf, fout, p, strlen(p));
-		} 
-		/* output rest of things */
-		utf_cache(utf, fout, s, strlen(s));
-		utf_cache(utf, fout, NULL, 0);
+static int retime_write(SUBCTX *ctx, char *fname, FILE *fin, FILE *fout)
+{
+	char	*dyname;
+
+	if (tm_overwrite == 0) {		/* appending mode */
+		subsync_retime(ctx, fin, fout);
+		return 0;
+	}
+	if ((fout = safe_open(fname, "w", &dyname)) == NULL) {
+		perror(fname);
+		return -1;
 	}
-	if (utf->bin_err) {
-		fprintf(stderr, "Binary file detected.\n");
+	if (subsync_retime(ctx, fin, fout) < 0) {
+		fclose(fout);
+		unlink(dyname);		/* rejected: keep the original file */
+		free(dyname);
+		return -1;
 	}
-	utf_close(utf);
+	fclose(fout);
+
+	/* swap the file names so the original file become the backup */
+	if (!safe_swapname(fname, dyname) && (tm_overwrite == 1)) { 
+		unlink(dyname);		/* no backup */
+	}
+	free(dyname);
 	return 0;
 }
 
-static time_t tweaktime(time_t ms)
+/* load the cue times of the reference subtitle, or the voice activity
+ * of the reference audio */
+static int retime_ref(SUBCTX *ctx, char *refname, int audio)
 {
-	if (tm_range[0] > -1) {	/* check the time stamp range */
-		if (ms < tm_range[0]) {
-			return ms;
-		}
-		if ((tm_range[1] > -1) && (ms > tm_range[1])) {
-			return ms;
-		}
-	}
-	if (tm_offset) {
-		ms += tm_offset;
+	FILE	*fp;
+	int	rc;
+
+	if ((fp = safe_open(refname, "rb", NULL)) == NULL) {
+		perror(refname);
+		return -1;
 	}
-	if (tm_scale != 0.0) {
-		ms *= tm_scale;
+	if (audio) {
+		if ((rc = subsync_audio(ctx, fp)) < 0) {
+			fprintf(stderr, "%s: not a PCM WAV file.\n", refname);
+		}
+	} else if ((rc = subsync_reference(ctx, fp)) < 0) {
+		fprintf(stderr, "%s: no time stamps.\n", refname);
 	}
-	return ms;
+	fclose(fp);
+	return rc;
 }
 
-static int chop_filter(char *s, int *magic)
+/* The stdin can't be rewound after aligning to the reference, so it is 
+ * saved to a temporary file first */
+static FILE *retime_stdin(SUBCTX *ctx)
 {
-	static	int	subidx;
-
-	if ((tm_chop[0] < 0) && (tm_chop[1] < 0)) {
-		return 0;	/* disabled */
-	}
-
-	switch (*magic) {
-	case 0:			/* subrip */
-		if (is_number(s)) {
-			subidx++;
-		}
-		//printf("SRT %d\n", subidx);
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
-		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
-		}
-		return 1;
-	case 1:			/* ASS/SSA */
-		if (strncmp(s, "Dialogue:", 9)) {
-			break;;
-		}
-		subidx++;
-		//printf("ASS %d\n", subidx);
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
-		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
-		}
-		return 1;
-	default:
-		if (*magic > 0) {
-			break;	/* something wrong */
-		}
-		if (is_number(s)) {
-			*magic = 0;
-			subidx++;
-		} else if (strtoms(s, NULL, NULL) != -1) {       /* SRT timestamp */
-			*magic = 0;
-			subidx++;
-		} else if (!strncmp(s, "[Events]", 8)) {
-			*magic = 1;
-			break;
-		} else if (!strncmp(s, "[Script Info]", 13)) {
-			*magic = 1;
-			break;
-		} else if (!strncmp(s, "Dialogue:", 9)) {
-			*magic = 1;
-			subidx++;
-		} else {
-			break;
-		}
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
-		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
-		}
-		return 1;
+	FILE	*fp;
+
+	if (!tm_align) {
+		return stdin;
+	}
+	if ((fp = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return NULL;
+	}
+	copy_file(stdin, fp);
+	rewind(fp);
+	if (subsync_align(ctx, fp) < 0) {
+		fprintf(stderr, "stdin: not aligned.\n");
+		fclose(fp);
+		return NULL;
 	}
-	return 0;	/* no skip */
+	return fp;
 }
 
-/* "%d : %d : %d , %d%n",    SRT
- * "%d : %d : %d . %d%n",    ASS/SSA
- * "%d : %d : %d : %d%n",
- * "%d . %d . %d . %d%n",
- * "%d - %d - %d - %d%n",
- */
-#define ISTMSEP(n)	(((n) == ':') || ((n) == '-') || ((n) == '.') || ((n) == ','))
-
-static time_t strtoms(char *s, int *len, int *style)
+/* retime the files by a pool of worker threads. In the appending mode,
+ * each file is retimed into a temporary file and then copied to the 
+ * output by the file order of the command line */
+static int retime_batch(SUBCTX *ctx, char **flist, int fnum, char *outname,
+		int nthread)
 {
-	time_t	rc;
-	char	*sign, *lastpc, *begin = s;
-	int	i, tm[4];
-
-	tm[0] = tm[1] = tm[2] = tm[3] = 0;
-	while (isspace(*s)) s++;		/* skip the front whitespace */
-	sign = lastpc = s;
-	if ((*s == '+') || (*s == '-')) {	/* if the sign exists */
-		s++;
-	}
-	for (i = 0; i < 4; i++, s++) {
-		while (isspace(*s)) s++;
-		if (ISTMSEP(*s)) {
-			tm[i] = 0;
-		} else if (isdigit(*s)) {
-			tm[i] = (int) strtol(s, &s, 10);
-		} else {
-			break;
-		}
-		if (len) {
-			*len = (int)(s - begin);
-		}
-		while (isspace(*s)) s++;	/* skip the space between number and puncture */
-		if (!ISTMSEP(*s)) {
-			i++;
+	SUBPOOL		pool;
+	pthread_t	*tid;
+	FILE		*fout;
+	int		i;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ctx    = ctx;
+	pool.total  = fnum;
+	pool.append = (tm_overwrite == 0);
+	if ((pool.job = calloc(fnum, sizeof(SUBJOB))) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < fnum; i++) {
+		pool.job[i].fname = flist[i];
+	}
+	if (nthread > fnum) {
+		nthread = fnum;
+	}
+	if ((tid = calloc(nthread, sizeof(pthread_t))) == NULL) {
+		free(pool.job);
+		return -1;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	for (i = 0; i < nthread; i++) {
+		if (pthread_create(&tid[i], NULL, retime_worker, &pool)) {
 			break;
-		} else if (i < 3) {
-			lastpc = s;
 		}
 	}
+	if ((nthread = i) == 0) {
+		retime_worker(&pool);	/* no thread; do it by itself */
+	}
 
-	//printf("%s:  %d-%d-%d-%d (%d)(%c)\n", sign, tm[0], tm[1], tm[2], tm[3], i, *lastpc);
-	switch (i) {
-	case 0:		/* No number, like "abc" */
-		rc = -1;
-		break;
-	case 1:		/* one number with bad ending like "12-B" */
-		rc = tm[0];	/* one number been defined as millisecond */
-		break;
-	case 2:		/* could be 2:3 or 2.3 */
-		if (*lastpc == ':') {	/* Min : Sec */
-			rc = timetoms(0, tm[0], tm[1], 0);
-		} else {
-			rc = timetoms(0, 0, tm[0], 
-					(*lastpc == '.') ? tm[1] * 10 : tm[1]);
+	for (i = 0; pool.append && (i < fnum); i++) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.job[i].done) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
 		}
-		break;
-	case 3:		/* could be 1:2:3 or 1:2.3 */
-		if (*lastpc == ':') {	/* Hour : Min : Sec */
-			rc = timetoms(tm[0], tm[1], tm[2], 0);
+		pthread_mutex_unlock(&pool.lock);
+
+		if (pool.job[i].fout == NULL) {
+			continue;
+		}
+		rewind(pool.job[i].fout);
+		if (outname == NULL) {
+			copy_file(pool.job[i].fout, stdout);
+		} else if ((fout = safe_open(outname, "a", NULL)) == NULL) {
+			perror(outname);
 		} else {
-			rc = timetoms(0, tm[0], tm[1],
-					(*lastpc == '.') ? tm[2] * 10 : tm[2]);
+			copy_file(pool.job[i].fout, fout);
+			fclose(fout);
 		}
-		break;
-	case 4:		/* assumed being Hour : Min : Sec [?] Msec */
-		rc = timetoms(tm[0], tm[1], tm[2],
-				(*lastpc == '.') ? tm[3] * 10 : tm[3]);
-		break;
-	}
-
-	if (style) {
-		*style = (*lastpc == '.') ? 1 : 0;
+		fclose(pool.job[i].fout);
 	}
 
-	if (*sign == '-') {
-		rc =  - rc;
+	for (i = 0; i < nthread; i++) {
+		pthread_join(tid[i], NULL);
 	}
-	return rc;
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(tid);
+	free(pool.job);
+	return 0;
 }
 
-static char *mstostr(time_t ms, int style)
+static void *retime_worker(void *arg)
 {
-	static	char	stmp[32];
-	char	*buf = stmp;
-	int	hh, mm, ss;
-
-	if (ms < 0) {
-		ms = -ms;
-		*buf++ = '-';
-	}
-
-	hh = (int)(ms / 3600000L);
-	ms %= 3600000L;
-	mm = (int)(ms / 60000);
-	ms %= 60000;
-	ss = (int)(ms / 1000);
-	ms %= 1000;
-
-	switch (style) {
-	case 1:		/* ASS */
-		sprintf(buf, "%d:%02d:%02d.%02ld", hh, mm, ss, (long)(ms / 10));
-		break;
-	case 2:
-		sprintf(buf, "%02d:%02d:%02d:%03ld", hh, mm, ss, (long)ms);
-		break;
-	case 3:
-		sprintf(buf, "%02d.%02d.%02d.%03ld", hh, mm, ss, (long)ms);
-		break;
-	case 4:
-		sprintf(buf, "%02d-%02d-%02d-%03ld", hh, mm, ss, (long)ms);
-		break;
-	case 0:		/* SRT */
-	default:
-		sprintf(buf, "%02d:%02d:%02d,%03ld", hh, mm, ss, (long)ms);
-		break;
-	}
-	return stmp;
-}
+	SUBPOOL	*pool = arg;
+	SUBJOB	*job;
+	SUBCTX	*ctx;
 
+	/* each worker has its own running status */
+	if ((ctx = subsync_dup(pool->ctx)) != NULL) {
+		subsync_threads(ctx, 1);	/* the threads are used up by files */
+	}
+	for ( ; ; ) {
+		pthread_mutex_lock(&pool->lock);
+		job = (pool->next < pool->total) ? &pool->job[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (job == NULL) {
+			break;
+		}
 
-static time_t timetoms(int hour, int min, int sec, int msec)
-{
-	time_t	ms;
+		if (ctx == NULL) {
+			fprintf(stderr, "%s: out of memory.\n", job->fname);
+		} else if (!pool->append) {
+			retime_file(ctx, job->fname, NULL);
+		} else if (access(job->fname, R_OK)) {
+			perror(job->fname);
+		} else if ((job->fout = tmpfile()) == NULL) {
+			perror("tmpfile");
+		} else {
+			retime_file(ctx, job->fname, job->fout);
+		}
 
-	if (hour < 0) {
-		return -1;
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
 	}
+	subsync_free(ctx);
+	return NULL;
+}
 
-	ms = hour * 3600 * 1000;
+/* merge the subtitle files into one by the start time of the cues */
+static int merge_files(SUBCTX *ctx, char **flist, int fnum, char *outname,
+		int combine)
+{
+	FILE	**fin, *fout = stdout;
+	int	i, rc = -1;
 
-	/* if hour not given, min is reasonable larger than 60 */
-	if ((min < 0) || ((hour > 0) && (min > 59))) {
+	if ((fnum == 0) || !strcmp(*flist, "--")) {
+		fprintf(stderr, "No files to merge.\n");
 		return -1;
-	} else {
-		ms += min * 60 * 1000;
 	}
-
-	/* if hour and min not given, sec is reasonable larger than 60 */
-	if ((sec < 0) || (((hour > 0) || (min > 0)) && (sec > 59))) {
+	if ((fin = calloc(fnum, sizeof(FILE *))) == NULL) {
 		return -1;
+	}
+	for (i = 0; i < fnum; i++) {
+		if ((fin[i] = safe_open(flist[i], "rb", NULL)) == NULL) {
+			perror(flist[i]);
+			break;
+		}
+	}
+	if (i < fnum) {
+		;	/* missing input */
+	} else if (outname && ((fout = safe_open(outname, "w", NULL)) == NULL)) {
+		perror(outname);
 	} else {
-		ms += sec * 1000;
+		rc = subsync_merge(ctx, fin, fnum, fout, combine);
+		if (fout != stdout) {
+			fclose(fout);
+		}
 	}
-
-	if (msec < 0) {
-		return -1;
+	while (i--) {
+		fclose(fin[i]);
 	}
-	return ms + msec;
+	free(fin);
+	return rc;
 }
 
-
-/* valid parameters:
- * [+-]N-P, [+-]P-N, [+-]N-C, [+-]C-N, [+-]P-C, [+-]C-P, [+-]0.1234
- * [+-]01:44:30,290/01:44:31,660
- * Note that all leading '+' and '-' are ignored because ratio is a scalar.
+/* The server mode takes the requests from the unix domain socket, or from
+ * stdin if the socket is not specified. The request is a header line of
+ * the length of the subtitle and the length of the options, followed by
+ * the options, each of which ends by NUL like the argv, and then the
+ * contents of the subtitle:
+ *   "<length> <optlen>\n<option>\0...<subtitle>"
+ * The options in the command line of the server are the default options.
+ * The reply is a header line of the status and the length of the output,
+ * followed by the output, or the error message if the status is not 0:
+ *   "<status> <length>\n<output>"
  */
-static double arg_scale(char *s)
+static int serve(SUBCTX *ctx, char *sockname)
 {
-	int	i;
-	double	tmp;
+#ifdef	CFG_UNIX_SOCKET
+	struct	sockaddr_un	addr;
+	struct	stat	sb;
+	FILE	*fin, *fout;
+	int	sock, conn;
+#endif
 
-	/* skip the leading '+' or '-' */
-	if ((*s == '+') || (*s == '-')) {
-		s++;
+	if (*sockname == 0) {
+		return serve_session(ctx, stdin, stdout);
 	}
-	/* search the identity table first for something like "N-P" */
-	for (i = 0; i < sizeof(srtbl)/sizeof(struct ScRate); i++) {
-		if (!strcmp(s, srtbl[i].id)) {
-			return srtbl[i].fact;
-		}
+#ifdef	CFG_UNIX_SOCKET
+	if (strlen(sockname) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket name too long.\n", sockname);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockname);
+
+	/* remove the socket left by the last server */
+	if (!stat(sockname, &sb) && S_ISSOCK(sb.st_mode)) {
+		unlink(sockname);
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) ||
+			listen(sock, 8)) {
+		perror(sockname);
+		close(sock);
+		return -1;
 	}
-	/* or calculate the scale ratio by the form of 
-	 *  01:44:30,290/01:44:31,660 */
-	if (strchr(s, '/')) {
-		time_t	mf, mt;
+	signal(SIGPIPE, SIG_IGN);	/* the client may quit anytime */
 
-		if ((mf = strtoms(s, NULL, NULL)) == -1) {
-			return 0.0;
+	for ( ; ; ) {
+		if ((conn = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+		fin = fdopen(conn, "r");
+		fout = fdopen(dup(conn), "w");
+		if (fin && fout) {
+			serve_session(ctx, fin, fout);
 		}
-		s = strchr(s, '/');
-		if ((mt = strtoms(++s, NULL, NULL)) == -1) {
-			return 0.0;
+		if (fin) {
+			fclose(fin);
+		} else {
+			close(conn);
+		}
+		if (fout) {
+			fclose(fout);
 		}
-		return (double)mf / (double)mt;
 	}
-	/* or it's just a simple real number: 1.2345E12 */
-	if (!strchr(s, ':') && strchr(s, '.')) {
-		char	*endp;
+	close(sock);
+	unlink(sockname);
+	return 0;
+#else
+	fprintf(stderr, "%s: unix domain socket not supported.\n", sockname);
+	return -1;
+#endif
+}
 
-		tmp = strtod(s, &endp);
-		if (*endp == 0) {
-			return tmp;
+/* serve the requests from 'fin' until end of file */
+static int serve_session(SUBCTX *ctx, FILE *fin, FILE *fout)
+{
+	char	line[256], *body, *p;
+	size_t	len, optlen;
+	unsigned long	hit, miss;
+	int	count = 0;
+
+	while (fgets(line, sizeof(line), fin)) {
+		/* only the numbers, so the options in the header are refused */
+		p = line;
+		len = optlen = 0;
+		if (isdigit(*p)) {
+			len = (size_t)strtoul(p, &p, 10);
 		}
+		if ((*p == ' ') && isdigit(p[1])) {
+			optlen = (size_t)strtoul(p + 1, &p, 10);
+		}
+		if ((p == line) || strcmp(p, "\n")) {
+			serve_reply(fout, -1, "bad request", 11);
+			break;	/* can't tell where the next request is */
+		}
+		if ((body = malloc(optlen + len + 1)) == NULL) {
+			serve_reply(fout, -1, "out of memory", 13);
+			break;
+		}
+		if (fread(body, 1, optlen + len, fin) != optlen + len) {
+			free(body);
+			break;
+		}
+		serve_request(ctx, body, optlen, body + optlen, len, fout);
+		free(body);
+		fflush(fout);
+		count++;
 	}
-	return 0.0;
+	utf_iconv_stat(&hit, &miss);
+	fprintf(stderr, "Session: %d requests; iconv cache: %lu hits, %lu misses\n",
+			count, hit, miss);
+	return 0;
 }
 
-/* valid parameters:
- * [+-]01:44:30,290, [+-]134600, [+-]01:44:31,660-01:44:30,290
- * Note that all leading '+' and '-' are required for vectoring
- */
-static time_t arg_offset(char *s)
+/* retime the subtitle by the options in 'opts', which are NUL terminated
+ * arguments in 'optlen' bytes */
+static int serve_request(SUBCTX *ctx, char *opts, size_t optlen, 
+		char *body, size_t len, FILE *fout)
 {
-	char	*endp;
-	time_t	ms;
+	SUBCTX	*job;
+	char	**argv, **av, *out, msg[256];
+	size_t	i, outlen;
+	int	argc, ac, rc;
 
-	/* ignore the form of 01:44:30,290/01:44:31,660 because it's for scaling */
-	if (strchr(s, '/')) {
-		return -1;
+	if (optlen && opts[optlen-1]) {
+		return serve_reply(fout, -1, "bad options", 11);
 	}
-	/* seperate the form -01:44:31,660-01:44:30,290 from -01:44:31,660 */
-	if (strchr(s+1, '-')) {
-		s++;	/* ignore the switch charactor '+' or '-' */
-		if ((ms = strtoms(s, NULL, NULL)) == -1) {
-			return -1;
-		}
-		s = strchr(s, '-');
-		if (strtoms(++s, NULL, NULL) == -1) {
-			return -1;
-		}
-		ms -= strtoms(s, NULL, NULL);
-		return ms;
+	for (i = argc = 0; i < optlen; i++) {
+		argc += (opts[i] == 0);
 	}
-	/* process the form of [+-]01:44:31,660 */
-	if ((ms = strtoms(s, NULL, NULL)) != -1) {
-		return ms;
+	if ((argv = malloc((argc + 1) * sizeof(char *))) == NULL) {
+		return serve_reply(fout, -1, "out of memory", 13);
 	}
-	/* or it's simply a number by milliseconds [+-]134600 */
-	ms = strtol(s, &endp, 0);
-	if (*endp == 0) {
-		return ms;
+	for (i = argc = 0; i < optlen; i += strlen(opts + i) + 1) {
+		argv[argc++] = opts + i;
 	}
-	return -1;
+	argv[argc] = NULL;
+
+	/* the server options are the default */
+	if ((job = subsync_dup(ctx)) == NULL) {
+		free(argv);
+		return serve_reply(fout, -1, "out of memory", 13);
+	}
+	/* the diagnostics of the library are the reply of the failure */
+	*msg = 0;
+	subsync_report(job, report_keep, msg);
+	for (av = argv, ac = argc; ac > 0; ac--, av++) {
+		opts = *av;
+		if ((rc = subsync_option(job, &ac, &av)) <= 0) {
+			if (rc == 0) {
+				snprintf(msg, sizeof(msg), 
+					"%s: unknown parameter.", opts);
+			}
+			subsync_free(job);
+			free(argv);
+			return serve_reply(fout, -1, msg, strlen(msg));
+		}
+	}
+	if ((rc = subsync_buffer(job, body, len, &out, &outlen)) != 0) {
+		if (*msg == 0) {
+			snprintf(msg, sizeof(msg), "failed to retime (%d).", rc);
+		}
+		serve_reply(fout, rc, msg, strlen(msg));
+	} else {
+		serve_reply(fout, 0, out, outlen);
+	}
+	subsync_free(job);
+	free(argv);
+	free(out);
+	return rc;
 }
 
-static int is_number(char *s)
+static int serve_reply(FILE *fout, int status, char *s, size_t len)
 {
-	if (!isdigit(*s)) {
-		return 0;
-	}
-	while (isdigit(*s)) s++;
-	return (*s > 0x20) ? 0 : 1;
+	fprintf(fout, "%d %lu\n", status, (unsigned long) len);
+	fwrite(s, 1, len, fout);
+	return status;
 }
 
 static FILE *safe_open(char *pathname, char *mode, char **nominee)
@@ -754,10 +833,23 @@ static int safe_swapname(const char *fixname, char *dyname)
 	return 0;
 }
 
-static int help_tools(int argc, char **argv)
+/* print the diagnostics of the library */
+static void report_stderr(void *data, char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+}
+
+/* keep the last diagnostic of the library in 'data', 256 bytes */
+static void report_keep(void *data, char *msg)
+{
+	snprintf(data, 256, "%s", msg);
+}
+
+static int help_tools(SUBCTX *ctx, int argc, char **argv)
 {
 	time_t	ms;
 	double	tmp;
+	char	stmp[32];
 
 	if (!strcmp(*argv,  "--help-strtoms")) {
 		test_str_to_ms();
@@ -766,25 +858,32 @@ static int help_tools(int argc, char **argv)
 			fprintf(stderr, "Two time stamps required.\n");
 			return 1;
 		}
-		ms = arg_offset(argv[1]);
-		ms -= arg_offset(argv[2]);
+		ms = subsync_offset(argv[1]);
+		ms -= subsync_offset(argv[2]);
 		printf("Time difference is %s (%ld ms)\n", 
-				mstostr(ms, 0), (long)ms);
+				subsync_mstostr(ms, 0, stmp), (long)ms);
 	} else if (!strncmp(*argv, "--help-divide", 10)) {
 		if (argc < 3) {
 			fprintf(stderr, "Two time stamps required.\n");
 			return 1;
 		}
-		ms = arg_offset(argv[1]);
-		tmp = (double)ms / (double)arg_offset(argv[2]);
+		ms = subsync_offset(argv[1]);
+		tmp = (double)ms / (double)subsync_offset(argv[2]);
 		printf("Time scale ratio is %f\n", tmp);
 	} else if (!strcmp(*argv, "--help-debug")) {
-		printf("Time Stamp Offset:   %ld\n", (long)tm_offset);
-		printf("Time Stamp Scaling:  %f\n", tm_scale);
-		printf("Time Stamp range:    from %ld to %ld\n", 
-				(long)tm_range[0], (long)tm_range[1]);
-		printf("SRT serial Number:   from %d\n", tm_srtsn);
-		printf("Subtitle chopping:   from %d to %d\n", tm_chop[0], tm_chop[1]);
+		subsync_dump(ctx, stdout);
+	} else if (!strcmp(*argv, "--help-bench")) {
+		if (argc < 2) {
+			fprintf(stderr, "Subtitle file required.\n");
+			return 1;
+		}
+		return test_bench(ctx, argv[1], (argc > 2) ? atoi(argv[2]) : 1000);
+	} else if (!strcmp(*argv, "--help-client")) {
+		if (argc < 3) {
+			fprintf(stderr, "Socket and subtitle file required.\n");
+			return 1;
+		}
+		return test_client(argv[1], argv[2], argc - 3, argv + 3);
 	} else if (!strcmp(*argv, "--help-example")) {
 		puts(subsync_help_example);
 	} else {
@@ -797,7 +896,7 @@ static void test_str_to_ms(void)
 {
 	int	i, n, style;
 	time_t	ms;
-	char	*testbl[] = {
+	char	stmp[32], *testbl[] = {
 		"00:02:09,996",
 		"12:34:56,789",
 		"1,2;3-456",
@@ -813,6 +912,9 @@ static void test_str_to_ms(void)
 		" -12:34:56,789",
 		"+0:0:2.0",
 		"+0:0:2.0:9",
+		"00:02:17.440",
+		"02:17.440",
+		"100:00:00.001",
 		"abc",
 		"12abc",
 		"::::",
@@ -820,8 +922,202 @@ static void test_str_to_ms(void)
 	};
 
 	for (i = 0; testbl[i]; i++) {
-		ms = strtoms(testbl[i], &n, &style);
-		printf("%s(%d): %s =%ld\n", testbl[i], n, mstostr(ms, style), (long)ms);
+		ms = subsync_strtoms(testbl[i], &n, &style);
+		printf("%s(%d): %s =%ld\n", testbl[i], n, subsync_mstostr(ms, style, stmp), (long)ms);
+	}
+}
+
+static double bench_time(SUBCTX *ctx, FILE *fin, FILE *fout)
+{
+	struct	timeval	tv1, tv2;
+
+	rewind(fin);
+	gettimeofday(&tv1, NULL);
+	subsync_retime(ctx, fin, fout);
+	fflush(fout);
+	gettimeofday(&tv2, NULL);
+	return (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1e6;
+}
+
+/* the writer before the output spans, which copied the input byte by byte
+ * into the cache and flushed it every line, as the baseline of the bench */
+static double bench_bytes(FILE *fin, FILE *fout)
+{
+	struct	timeval	tv1, tv2;
+	UTFB	*utf;
+	char	buf[UTF_MAX_BUF], *s;
+
+	rewind(fin);
+	if ((utf = utf_open(fin, NULL, NULL)) == NULL) {
+		return -1;
+	}
+	gettimeofday(&tv1, NULL);
+	while (utf_gets(utf, fin, buf, sizeof(buf)-1)) {
+		for (s = buf; *s; s++) {
+			utf_cache(utf, fout, s, 1);
+		}
+		utf_cache(utf, fout, NULL, 0);
+	}
+	fflush(fout);
+	gettimeofday(&tv2, NULL);
+	utf_close(utf);
+	return (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1e6;
+}
+
+/* set the retiming option of the benchmark */
+static int bench_option(SUBCTX *ctx, char *opt)
+{
+	char	**argv = &opt;
+	int	argc = 1;
+
+	return subsync_option(ctx, &argc, &argv);
+}
+
+/* scale up the subtitle file by repeating it in UTF-8, then compare the 
+ * throughput of the byte by byte writer, the line buffered reading, the 
+ * memory mapped reading and the cue table */
+static int test_bench(SUBCTX *ctx, char *fname, int count)
+{
+	SUBCTX	*job;
+	FILE	*fin, *fbig, *fout;
+	double	sec;
+	long	size;
+	int	i;
+
+	if ((fbig = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if ((fin = safe_open(fname, "rb", NULL)) == NULL) {
+			perror(fname);
+			fclose(fbig);
+			return -1;
+		}
+		subsync_retime(ctx, fin, fbig);
+		fclose(fin);
+	}
+	fflush(fbig);
+	size = ftell(fbig);
+
+	if ((fout = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		fclose(fbig);
+		return -1;
+	}
+	/* make sure every time stamp is rewritten; the repeated file has 
+	 * overlapped cues, which are not the matter of the bench */
+	bench_option(ctx, "+1000");
+	subsync_report(ctx, NULL, NULL);
+	printf("Benchmark %s x %d: %.2f MB (%s)\n", 
+			fname, count, size / 1e6, scan_isa());
+
+	sec = bench_bytes(fbig, fout);
+	printf("  byte by byte:   %8.3f sec  %8.2f MB/s\n", sec, size / sec / 1e6);
+
+	subsync_nomap(ctx, 1);
+	sec = bench_time(ctx, fbig, fout);
+	printf("  line buffered:  %8.3f sec  %8.2f MB/s\n", sec, size / sec / 1e6);
+
+	subsync_nomap(ctx, 0);
+	sec = bench_time(ctx, fbig, fout);
+	printf("  memory mapped:  %8.3f sec  %8.2f MB/s\n", sec, size / sec / 1e6);
+
+	if ((job = subsync_dup(ctx)) != NULL) {
+		bench_option(job, "--table");
+		sec = bench_time(job, fbig, fout);
+		printf("  cue table:      %8.3f sec  %8.2f MB/s\n", 
+				sec, size / sec / 1e6);
+		subsync_free(job);
 	}
+
+	fclose(fout);
+	fclose(fbig);
+	return 0;
+}
+
+/* send the subtitle file to the server and print the reply */
+static int test_client(char *sockname, char *fname, int argc, char **argv)
+{
+#ifdef	CFG_UNIX_SOCKET
+	struct	sockaddr_un	addr;
+	FILE	*fin, *fsock;
+	char	*body;
+	long	len, optlen;
+	int	i, sock, status;
+
+	if ((fin = safe_open(fname, "rb", NULL)) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	fseek(fin, 0, SEEK_END);
+	len = ftell(fin);
+	rewind(fin);
+	if ((body = malloc(len + 1)) == NULL) {
+		fclose(fin);
+		return -1;
+	}
+	len = fread(body, 1, len, fin);
+	fclose(fin);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sockname, sizeof(addr.sun_path) - 1);
+	if (((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+			connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		perror(sockname);
+		free(body);
+		return -1;
+	}
+
+	/* the request; only one request so the server will end the session */
+	if ((fsock = fdopen(dup(sock), "w")) != NULL) {
+		for (i = optlen = 0; i < argc; i++) {
+			optlen += strlen(argv[i]) + 1;
+		}
+		fprintf(fsock, "%ld %ld\n", len, optlen);
+		for (i = 0; i < argc; i++) {
+			fwrite(argv[i], 1, strlen(argv[i]) + 1, fsock);
+		}
+		fwrite(body, 1, len, fsock);
+		fclose(fsock);
+	}
+	shutdown(sock, SHUT_WR);
+	free(body);
+
+	/* the reply */
+	if ((fsock = fdopen(sock, "r")) == NULL) {
+		close(sock);
+		return -1;
+	}
+	if (fscanf(fsock, "%d %ld", &status, &len) != 2) {
+		fprintf(stderr, "%s: bad reply.\n", sockname);
+		fclose(fsock);
+		return -1;
+	}
+	fgetc(fsock);	/* skip the '\n' */
+	copy_file(fsock, status ? stderr : stdout);
+	if (status) {
+		fputc('\n', stderr);
+	}
+	fclose(fsock);
+	return status;
+#else
+	fprintf(stderr, "%s: unix domain socket not supported.\n", sockname);
+	return -1;
+#endif
+}
+
+static int copy_file(FILE *fin, FILE *fout)
+{
+	char	buf[65536];
+	size_t	n;
+
+	while ((n = fread(buf, 1, sizeof(buf), fin)) > 0) {
+		if (fwrite(buf, 1, n, fout) != n) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
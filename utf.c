@@ -6,8 +6,15 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/param.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "utf.h"
+#include "scan.h"
+
+#ifdef	CFG_MMAP
+#include <sys/mman.h>
+#endif
 
 static	MMTAB	bom_codepage[] = {
 	{ "\xEF\xBB\xBF",	3,	"UTF-8" },
@@ -18,6 +25,11 @@ static	MMTAB	bom_codepage[] = {
 	{ NULL, 0, NULL }
 };
 
+static int utf_span_queue(UTFB *utf, FILE *fp, char *s, size_t len);
+static int utf_span_flush(UTFB *utf, FILE *fp);
+static int utf_writev(FILE *fp, UTFSPAN *iov, int cnt);
+static int utf_map_check(UTFB *utf, size_t start);
+static int utf_map_start(UTFB *utf, size_t start);
 static size_t utf_pump(UTFB *utf, FILE *fp);
 static size_t utf_flush(UTFB *utf, char *buf, size_t len);
 static int utf_bom_detect(UTFB *utf, FILE *fp);
@@ -26,6 +38,32 @@ static int magic_length(MMTAB *mtab);
 static int magic_match(MMTAB *mtab, char *s, int len);
 static MMTAB *magic_search(MMTAB *mtab, char *s, int len);
 static int idname(char *s);
+static int utf_iconv_bom(const char *code);
+static void utf_iconv_key(const char *code, char *key, int len);
+static int utf_native(char *code);
+static size_t utf_decode(UTFB *utf, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft);
+static size_t utf_encode(UTFB *utf, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft);
+static size_t utf_native_decode(int id, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft);
+static size_t utf_native_encode(int id, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft);
+static int utf_partial(char *s, char *e);
+static int utf_charset_detect(UTFB *utf, char *s, size_t len);
+static char *utf_charset_guess(char *s, size_t len);
+static int utf_cjk_score(unsigned char *s, unsigned char *e, int big5);
+
+/* The iconv descriptors are kept for reusing after utf_close(), which saves
+ * the iconv_open() in the batch processing and the server mode */
+static	struct	{
+	char	tocode[64];
+	char	fromcode[64];
+	iconv_t	cd;
+	int	busy;
+} iconv_cache[UTF_MAX_ICONV];
+static	unsigned long	iconv_hit, iconv_miss;
+static	pthread_mutex_t	iconv_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #ifdef UTF_MAIN
 typedef int (*getchar_t)(FILE *);
@@ -42,6 +80,7 @@ UTFB *utf_open(FILE *fp, char *decode, char *encode)
 	}
 	memset(utf, 0, sizeof(UTFB));
 	utf->cd_dec = utf->cd_enc = (iconv_t) -1;
+	utf->bad_off = -1;
 	utf->inbuf  = utf->ibuffer;
 	utf->inidx  = 0;
 	utf->outbuf = utf->obuffer;
@@ -49,7 +88,8 @@ UTFB *utf_open(FILE *fp, char *decode, char *encode)
 	utf->ccidx  = 0;
 
 	if (!decode || !*decode) {
-		utf_bom_detect(utf, fp);
+		/* without BOM, the charset would be detected by contents */
+		utf->autodet = utf_bom_detect(utf, fp) < 0;
 	} else {
 		StrNCpy(utf->na_dec, decode, sizeof(utf->na_dec));
 		/* if specified the input coding, by default the output coding
@@ -59,11 +99,12 @@ UTFB *utf_open(FILE *fp, char *decode, char *encode)
 
 	/* if the input source is not UTF-8, we need the iconv to decode
 	 * the source stream to UTF-8 */
-	if (utf->na_dec[0] && (idname(utf->na_dec) != idname("utf8"))) {
-		utf->cd_dec = iconv_open("UTF-8", utf->na_dec);
+	if (utf->na_dec[0] && (idname(utf->na_dec) != idname("utf8")) &&
+			!(utf->nc_dec = utf_native(utf->na_dec))) {
+		utf->cd_dec = utf_iconv_open("UTF-8", utf->na_dec);
 		if (utf->cd_dec == (iconv_t) -1) {
-			utf_close(utf);
 			fprintf(stderr, "utf_open: decoding %s\n", utf->na_dec);
+			utf_close(utf);
 			return NULL;
 		}
 		utf->outbuf = utf->obuffer;
@@ -90,8 +131,9 @@ UTFB *utf_open(FILE *fp, char *decode, char *encode)
 		/* if the output target is not UTF-8, we need the iconv to
 		 * encode the target codepage. 
 		 * Reference to libiconv-1.18/lib/encodings.def */
-		if (strcmp(encode, "CP65001") && (eid != idname("utf8"))) {
-			utf->cd_enc = iconv_open(utf->na_enc, "UTF-8");
+		if (strcmp(encode, "CP65001") && (eid != idname("utf8")) &&
+				!(utf->nc_enc = utf_native(utf->na_enc))) {
+			utf->cd_enc = utf_iconv_open(utf->na_enc, "UTF-8");
 			if (utf->cd_enc == (iconv_t) -1) {
 				utf_close(utf);
 				fprintf(stderr, "utf_open: encoding %s\n", encode);
@@ -104,15 +146,133 @@ UTFB *utf_open(FILE *fp, char *decode, char *encode)
 
 void utf_close(UTFB *utf)
 {
+	if (utf->line) {
+		free(utf->line);
+	}
+	if (utf->decin) {
+		free(utf->decin);
+	}
+	if (utf->map && utf->mapheap) {
+		free(utf->map);
+	}
+#ifdef	CFG_MMAP
+	else if (utf->map && !utf->maplink) {
+		munmap(utf->map, utf->mapsize);
+	}
+#endif
 	if (utf->cd_dec != (iconv_t) -1) {
-		iconv_close(utf->cd_dec);
+		utf_iconv_close(utf->cd_dec);
 	}
 	if (utf->cd_enc != (iconv_t) -1) {
-		iconv_close(utf->cd_enc);
+		utf_iconv_close(utf->cd_enc);
 	}
 	free(utf);
 }
 
+/* same as iconv_open() but take the idle descriptor from the cache first.
+ * The new descriptor would be put in the cache if there's free slot, or
+ * replace an idle one */
+iconv_t utf_iconv_open(const char *tocode, const char *fromcode)
+{
+	char	tokey[64], fromkey[64];
+	iconv_t	cd;
+	int	i, slot = -1;
+
+	/* the codings without endianness learn it from the BOM, which can't
+	 * be reset by iconv(cd, NULL, NULL, NULL, NULL) */
+	if (utf_iconv_bom(tocode) || utf_iconv_bom(fromcode)) {
+		pthread_mutex_lock(&iconv_lock);
+		iconv_miss++;
+		pthread_mutex_unlock(&iconv_lock);
+		return iconv_open(tocode, fromcode);
+	}
+	utf_iconv_key(tocode, tokey, sizeof(tokey));
+	utf_iconv_key(fromcode, fromkey, sizeof(fromkey));
+
+	pthread_mutex_lock(&iconv_lock);
+	for (i = 0; i < UTF_MAX_ICONV; i++) {
+		if (iconv_cache[i].cd == NULL) {
+			slot = i;	/* prefer the empty slot */
+		} else if (iconv_cache[i].busy) {
+			continue;
+		} else if (!strcmp(iconv_cache[i].tocode, tokey) &&
+				!strcmp(iconv_cache[i].fromcode, fromkey)) {
+			iconv_cache[i].busy = 1;
+			iconv_hit++;
+			pthread_mutex_unlock(&iconv_lock);
+			/* reset to the initial state */
+			iconv(iconv_cache[i].cd, NULL, NULL, NULL, NULL);
+			return iconv_cache[i].cd;
+		} else if ((slot < 0) || iconv_cache[slot].cd) {
+			slot = i;	/* the idle one to be replaced */
+		}
+	}
+	iconv_miss++;
+	cd = iconv_open(tocode, fromcode);
+	if ((cd != (iconv_t) -1) && (slot >= 0)) {
+		if (iconv_cache[slot].cd) {
+			iconv_close(iconv_cache[slot].cd);
+		}
+		strcpy(iconv_cache[slot].tocode, tokey);
+		strcpy(iconv_cache[slot].fromcode, fromkey);
+		iconv_cache[slot].cd = cd;
+		iconv_cache[slot].busy = 1;
+	}
+	pthread_mutex_unlock(&iconv_lock);
+	return cd;
+}
+
+/* the number of descriptors reused from the cache and opened by iconv */
+void utf_iconv_stat(unsigned long *hit, unsigned long *miss)
+{
+	pthread_mutex_lock(&iconv_lock);
+	*hit = iconv_hit;
+	*miss = iconv_miss;
+	pthread_mutex_unlock(&iconv_lock);
+}
+
+/* normalize the coding name as the cache key so "UTF-16LE" and "utf16le"
+ * would share the same descriptors. Other names are only case insensitive,
+ * because iconv may not take "GB-2312" for "gb2312" */
+static void utf_iconv_key(const char *code, char *key, int len)
+{
+	int	id = idname((char *) code);
+
+	if (id > 0) {
+		snprintf(key, len, "utf#%x", id);
+		return;
+	}
+	for (len--; *code && (len > 0); code++, len--) {
+		*key++ = tolower((unsigned char) *code);
+	}
+	*key = 0;
+}
+
+static int utf_iconv_bom(const char *code)
+{
+	int	id = idname((char *) code);
+
+	return (id == idname("utf16")) || (id == idname("utf32")) ||
+		(id == idname("ucs2")) || (id == idname("ucs4"));
+}
+
+/* return the descriptor to the cache, or close it if it's not cached */
+int utf_iconv_close(iconv_t cd)
+{
+	int	i;
+
+	pthread_mutex_lock(&iconv_lock);
+	for (i = 0; i < UTF_MAX_ICONV; i++) {
+		if (iconv_cache[i].cd == cd) {
+			iconv_cache[i].busy = 0;
+			pthread_mutex_unlock(&iconv_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&iconv_lock);
+	return iconv_close(cd);
+}
+
 /* It normally doesn't produce BOM for utf-8 content. However, if utf-8 
  * is explicitly specified by "utf->na_enc", it would output the BOM.
  * For example, Windows notepad may need this */
@@ -133,41 +293,69 @@ int utf_write_bom(UTFB *utf, FILE *fp)
 	return -2;
 }
 
+/* Copy the contents to the cache and queue it for writing. 
+ * The queue would be written when the cache or the queue is full, 
+ * or flushed by utf_cache(utf, fp, NULL, 0) */
 int utf_cache(UTFB *utf, FILE *fp, char *s, size_t len)
 {
-	if (!s || !len) {	/* flush the cache */
-		if (utf->ccidx) {
-			len = utf->ccidx;
-			utf->ccidx = 0;
-			return utf_write(utf, fp, utf->cache, len);
-		}
+	if (!s) {	/* flush the cache */
+		return utf_span_flush(utf, fp);
+	}
+	if (!len) {
 		return 0;
 	}
-	if (utf->ccidx + len >= sizeof(utf->cache)) {
-		utf_write(utf, fp, utf->cache, utf->ccidx);
-		utf->ccidx = 0;
+	if ((utf->ccidx + len > sizeof(utf->cache)) || 
+			(utf->spidx >= UTF_MAX_SPAN)) {
+		utf_span_flush(utf, fp);
 	}
-	if (utf->ccidx + len >= sizeof(utf->cache)) {
-		return utf_write(utf, fp, s, len);
+	if (len > sizeof(utf->cache)) {
+		return utf_write(utf, fp, s, len);	/* too big to cache */
 	}
 	memcpy(utf->cache + utf->ccidx, s, len);
+	utf_span_queue(utf, fp, utf->cache + utf->ccidx, len);
 	utf->ccidx += len;
-	//utf->cache[utf->ccidx] = 0;
-	return utf->ccidx;
+	return len;
 }
 
+/* Queue the span of contents for writing. If the span is inside the memory
+ * mapping, which is stable until utf_close(), it is queued by reference so 
+ * no copying is needed. Otherwise it goes to the cache */
+int utf_span(UTFB *utf, FILE *fp, char *s, size_t len)
+{
+	if (!s) {
+		return utf_span_flush(utf, fp);
+	}
+	if (!len) {
+		return 0;
+	}
+	if (!utf->map || (s < utf->map) || (s + len > utf->map + utf->mapsize)) {
+		return utf_cache(utf, fp, s, len);
+	}
+	return utf_span_queue(utf, fp, s, len);
+}
 
 int utf_puts(UTFB *utf, FILE *fp, char *buf)
 {
 	return utf_write(utf, fp, buf, strlen(buf));
 }
 
+/* Encode and write the contents. utf_write(utf, fp, NULL, 0) ends the
+ * output by the shift sequence of the stateful encoding, like UTF-7 */
 int utf_write(UTFB *utf, FILE *fp, char *buf, size_t len)
 {
 	size_t	n, rc, inleft, outleft;
-	char	*inbuf, *outbuf, lbuf[64];
+	char	*inbuf, *outbuf, lbuf[APP_MAX_BUF];
 
-	if (utf->cd_enc == (iconv_t) -1) {
+	if (buf == NULL) {
+		if (utf->cd_enc == (iconv_t) -1) {
+			return 0;
+		}
+		outleft = sizeof(lbuf);
+		outbuf = lbuf;
+		iconv(utf->cd_enc, NULL, NULL, &outbuf, &outleft);
+		return fwrite(lbuf, 1, sizeof(lbuf) - outleft, fp);
+	}
+	if (!UTFENC(utf)) {
 		return fwrite(buf, 1, len, fp);
 	}
 
@@ -176,16 +364,18 @@ int utf_write(UTFB *utf, FILE *fp, char *buf, size_t len)
 	while (inleft > 0) {
 		outleft = sizeof(lbuf);
 		outbuf = lbuf;
-		rc = iconv(utf->cd_enc, &inbuf, &inleft, &outbuf, &outleft);
+		rc = utf_encode(utf, &inbuf, &inleft, &outbuf, &outleft);
 		if ((n = sizeof(lbuf) - outleft) > 0) {
 			fwrite(lbuf, 1, n, fp);
 		}
 		if (rc == (size_t) -1) {
-			if (errno == EILSEQ) {	/* illegal character */
+			/* the incomplete char in the end of the span can
+			 * never be completed, so it is illegal as well */
+			if ((errno == EILSEQ) || (errno == EINVAL)) {
 				inleft--;	/* skip one char and try again */
 				inbuf++;
 				utf->enc_err++;
-			} else if ((errno != EINVAL) && (errno != E2BIG)) {
+			} else if (errno != E2BIG) {
 				break;	/* fatal error */
 			}
 		}
@@ -198,7 +388,7 @@ char *utf_gets(UTFB *utf, FILE *fp, char *buf, int len)
 	char	*obuf = buf;
 	size_t	n = 0, curr, rc;
 
-	if (utf->cd_dec == (iconv_t) -1) {	/* default or utf-8 */
+	if (!UTFDEC(utf)) {	/* default or utf-8 */
 		if (utf->inidx > 0) {	/* buffered BOM reading */
 			/* transfer the buffered BOM reading to the output
 			 * buffer so utf_flush() can flush them */
@@ -207,12 +397,14 @@ char *utf_gets(UTFB *utf, FILE *fp, char *buf, int len)
 			utf->inidx = 0;
 			
 			n = utf_flush(utf, buf, len);
-			if (n && (*(buf-1) == 0xa)) {
+			if (n && (buf[n-1] == 0xa)) {
 				return buf;
 			}
 		}
 		curr = ftell(fp);
-		obuf = fgets(buf + n, len - n, fp);
+		if ((fgets(buf + n, len - n, fp) == NULL) && !n) {
+			return NULL;
+		}
 		curr = ftell(fp) - curr;
 		if ((rc = utf_bin_detect(utf, buf, curr)) > 0) {
 			//WARNX("utf_gets: binary detected %ld (%ld)\n", rc, curr);
@@ -239,33 +431,431 @@ char *utf_gets(UTFB *utf, FILE *fp, char *buf, int len)
 	return obuf;
 }
 
-void hexdump(char *prompt, char *s, int len)
+/* Read a whole line of any length into the line buffer of 'utf', which is
+ * reused by the next line so no allocation per line. The buffer only grows
+ * by the lines longer than UTF_MAX_BUF. The line is writable and terminated 
+ * by '\0'; return NULL if no more */
+char *utf_getline(UTFB *utf, FILE *fp, size_t *len)
 {
-	printf("%s", prompt ? prompt : "");
-	while (len--) printf("%02x ", (unsigned char) *s++);
-	puts("");
+	char	*p;
+	size_t	n = 0;
+
+	if (utf->line == NULL) {
+		if ((utf->line = malloc(UTF_MAX_BUF)) == NULL) {
+			return NULL;
+		}
+		utf->linecap = UTF_MAX_BUF;
+	}
+	/* utf_gets() splits the long line by the buffer size so keep 
+	 * reading till the line break */
+	for ( ; ; ) {
+		if (utf->linecap - n < APP_MAX_BUF) {
+			if ((p = realloc(utf->line, utf->linecap * 2)) == NULL) {
+				break;
+			}
+			utf->line = p;
+			utf->linecap *= 2;
+		}
+		if (!utf_gets(utf, fp, utf->line + n, (int)(utf->linecap - n))) {
+			break;
+		}
+		n += strlen(utf->line + n);
+		if (n && (utf->line[n-1] == 0xa)) {
+			break;
+		}
+	}
+	utf->line[n] = 0;
+	*len = n;
+	return n ? utf->line : NULL;
+}
+
+/* Map the whole input file into memory so the lines can be read in place.
+ * The private mapping is writable so the time stamps can be rewritten in
+ * place; only the pages written are copied and the file is never changed.
+ * It only works for UTF-8 contents from a regular file. The bytes already
+ * consumed by utf_bom_detect() are rewound so they would be read back as 
+ * a part of the first line, same as utf_gets() does */
+int utf_map(UTFB *utf, FILE *fp)
+{
+#ifdef	CFG_MMAP
+	struct	stat	sb;
+	long	start;
+
+	if (UTFDEC(utf)) {
+		return -1;	/* the input must be decoded first */
+	}
+	if (fstat(fileno(fp), &sb) || !S_ISREG(sb.st_mode) || !sb.st_size) {
+		return -1;	/* pipe, device or empty file */
+	}
+	if ((start = ftell(fp)) < (long) utf->inidx) {
+		return -1;
+	}
+	start -= utf->inidx;
+
+	utf->map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fileno(fp), 0);
+	utf->mapwrite = (utf->map != MAP_FAILED);
+	if (utf->map == MAP_FAILED) {
+		utf->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, 
+				fileno(fp), 0);
+	}
+	if (utf->map == MAP_FAILED) {
+		utf->map = NULL;
+		return -1;
+	}
+#ifdef	MADV_SEQUENTIAL
+	madvise(utf->map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+	utf->mapsize = utf->maplen = sb.st_size;
+	if (utf_map_check(utf, start) < 0) {
+		munmap(utf->map, sb.st_size);
+		utf->map = NULL;
+		utf->mapsize = utf->maplen = 0;
+		utf->mapwrite = 0;
+		return -1;	/* to be decoded by utf_map_decode() */
+	}
+	return utf_map_start(utf, start);
+#else
+	return -1;
+#endif
 }
 
+/* Use the memory buffer as the mapping, which the 'fp' was opened on by
+ * fmemopen(). The buffer is borrowed so it won't be freed by utf_close() */
+int utf_map_buffer(UTFB *utf, FILE *fp, char *buf, size_t len)
+{
+	long	start;
+
+	if (UTFDEC(utf)) {
+		return -1;	/* the input must be decoded first */
+	}
+	if (!buf || !len || ((start = ftell(fp)) < (long) utf->inidx)) {
+		return -1;
+	}
+	utf->map = buf;
+	utf->mapsize = utf->maplen = len;
+	utf->maplink = 1;
+	if (utf_map_check(utf, start - utf->inidx) < 0) {
+		utf->map = NULL;
+		utf->mapsize = utf->maplen = 0;
+		return -1;	/* to be decoded by utf_map_decode() */
+	}
+	return utf_map_start(utf, start - utf->inidx);
+}
+
+/* Decode the input by iconv in large blocks into the heap, which is used 
+ * as the mapping so the lines can be read in place, same as the UTF-8 file.
+ * It saves the per-line copying of utf_gets(). The incomplete line in the
+ * end of the block is moved to the next block. The UTF-8 input which can
+ * not be mapped, or is to be repaired, goes through the native decoder for
+ * validating. Return -1 if no more */
+int utf_map_decode(UTFB *utf, FILE *fp)
+{
+	char	*inbuf, *outbuf, *p;
+	size_t	n, rc, rest, used, outleft;
+
+	if (utf->bin_err || utf->bad_err) {
+		return -1;
+	}
+	if (utf->map == NULL) {		/* the first block */
+		utf->mapcap = UTF_DEC_BLOCK * 2;
+		if ((utf->map = malloc(utf->mapcap)) == NULL) {
+			return -1;
+		}
+		utf->mapheap = utf->mapwrite = 1;
+		if ((utf->decin = malloc(UTF_DEC_BLOCK)) == NULL) {
+			return -1;
+		}
+		/* the reading of BOM detection comes first */
+		memcpy(utf->decin, utf->ibuffer, utf->inidx);
+		utf->decidx = utf->inidx;
+		utf->inidx = 0;
+
+		/* the stream without BOM is probed before decoding */
+		if (utf->autodet) {
+			utf->decidx += fread(utf->decin + utf->decidx, 1,
+					UTF_DET_PROBE - utf->decidx, fp);
+			utf_charset_detect(utf, utf->decin, utf->decidx);
+		}
+	}
+	if (!UTFDEC(utf)) {
+		utf->nc_dec = idname("utf8");
+	}
+
+	/* move the incomplete line to the head */
+	rest = utf->mapsize - utf->maplen;
+	memmove(utf->map, utf->map + utf->maplen, rest);
+	used = rest;
+	do {
+		n = fread(utf->decin + utf->decidx, 1, 
+				UTF_DEC_BLOCK - utf->decidx, fp);
+		utf->decidx += n;
+		inbuf = utf->decin;
+		while (utf->decidx > 0) {
+			outbuf  = utf->map + used;
+			outleft = utf->mapcap - used;
+			rc = utf_decode(utf, &inbuf, &utf->decidx, 
+					&outbuf, &outleft);
+			used = outbuf - utf->map;
+			if (rc != (size_t) -1) {
+				break;
+			}
+			if ((errno == E2BIG) || (outleft < 3)) {
+				if ((p = realloc(utf->map, utf->mapcap * 2)) == NULL) {
+					break;
+				}
+				utf->map = p;
+				utf->mapcap *= 2;
+			} else if ((errno == EILSEQ) || (n == 0)) {
+				/* illegal char, or incomplete in the end */
+				if (utf->bad_off < 0) {
+					utf->bad_off = utf->decoff + 
+						(long)(inbuf - utf->decin);
+				}
+				utf->dec_err++;
+				if (utf->bad_mode == UTF_BAD_REJECT) {
+					utf->bad_err = 1;
+					break;
+				}
+				if ((utf->bad_mode == UTF_BAD_KEEP) && 
+					(utf->nc_dec == idname("utf8"))) {
+					utf->map[used++] = *inbuf;
+				} else {
+					memcpy(utf->map + used, "\xEF\xBF\xBD", 3);
+					used += 3;
+				}
+				inbuf++;
+				utf->decidx--;
+			} else {
+				break;	/* EINVAL: incomplete char in the end */
+			}
+		}
+		/* the incomplete char goes to the next block */
+		utf->decoff += (long)(inbuf - utf->decin);
+		memmove(utf->decin, inbuf, utf->decidx);
+
+		/* look for the last line break in the new contents */
+		for (p = utf->map + used; p > utf->map + rest; p--) {
+			if (p[-1] == 0xa) break;
+		}
+	} while (!utf->bad_err && (n > 0) && (p == utf->map + rest));
+
+	if (utf->bad_err) {	/* drop the line with the ill-formed input */
+		used = (p > utf->map + rest) ? (size_t)(p - utf->map) : 0;
+		n = 0;
+	}
+	if (used == 0) {
+		return -1;	/* end of file */
+	}
+	utf->mapsize = used;
+	utf->maplen = (n > 0) ? (size_t)(p - utf->map) : used;
+	if (utf->bin_acc == 0) {
+		return utf_map_start(utf, 0);	/* the first block */
+	}
+	utf->mapidx = 0;
+	return 0;
+}
+
+/* Validate the mapped UTF-8 contents in one pass before reading, so the 
+ * ill-formed file can be rejected before any output. Return -1 if it is 
+ * to be repaired, or detected as other charset, which must be decoded by
+ * utf_map_decode() instead */
+static int utf_map_check(UTFB *utf, size_t start)
+{
+	char	*p;
+	size_t	ctrl = 0;
+
+	if (utf->autodet && utf_charset_detect(utf, utf->map + start,
+				MIN(utf->maplen - start, UTF_DET_PROBE))) {
+		return -1;
+	}
+	p = scan_utf8(utf->map + start, utf->map + utf->maplen, &ctrl);
+	if (p == utf->map + utf->maplen) {
+		return 0;
+	}
+	utf->bad_off = (long)(p - utf->map);
+	if (utf->bad_mode == UTF_BAD_REJECT) {
+		utf->bad_err = 1;
+	}
+	return (utf->bad_mode == UTF_BAD_REPAIR) ? -1 : 0;
+}
+
+/* the mapping is read from 'start' where the BOM was read by utf_open() */
+static int utf_map_start(UTFB *utf, size_t start)
+{
+	char	*p;
+	int	rc;
+
+	utf->mapidx = start;
+	utf->inidx = 0;		/* the BOM reading is in the mapping */
+
+	/* only detecting the first 1Kb, same as utf_gets() does. 
+	 * The line with the binary code and the rest would be dropped */
+	rc = utf_bin_detect(utf, utf->map + start, 
+			MIN(utf->maplen - start, UTF_BIN_PROBE));
+	if (rc > 0) {
+		for (p = utf->map + start + rc; p > utf->map + start; p--) {
+			if (p[-1] == 0xa) break;
+		}
+		utf->maplen = p - utf->map;
+	}
+	return 0;
+}
+
+/* return the next line in the memory mapping, including the line break.
+ * Note that the line is NOT terminated by '\0' */
+char *utf_mapline(UTFB *utf, size_t *len)
+{
+	char	*s, *p;
+
+	if (!utf->map || (utf->mapidx >= utf->maplen)) {
+		return NULL;
+	}
+	s = utf->map + utf->mapidx;
+	if ((p = scan_eol(s, utf->map + utf->maplen)) == NULL) {
+		*len = utf->maplen - utf->mapidx;
+	} else {
+		*len = (size_t)(p - s) + 1;
+	}
+	utf->mapidx += *len;
+	return s;
+}
+
+/* Create a slice of the memory mapping from 'from' to 'to' so it can be 
+ * processed by another thread. The slice borrows the mapping so it must be
+ * closed before the 'utf'. It has its own output queue and encoder */
+UTFB *utf_slice(UTFB *utf, size_t from, size_t to)
+{
+	UTFB	*slice;
+
+	if (!utf->map || (from > to) || (to > utf->maplen)) {
+		return NULL;
+	}
+	if ((slice = malloc(sizeof(UTFB))) == NULL) {
+		return NULL;
+	}
+	memset(slice, 0, sizeof(UTFB));
+	slice->cd_dec = slice->cd_enc = (iconv_t) -1;
+	slice->bad_off = -1;
+	slice->inbuf  = slice->ibuffer;
+	slice->outbuf = slice->obuffer;
+	slice->outidx = sizeof(slice->obuffer);
+	strcpy(slice->na_dec, utf->na_dec);
+	strcpy(slice->na_enc, utf->na_enc);
+
+	/* iconv descriptors keep the conversion state so can't be shared */
+	slice->nc_enc = utf->nc_enc;
+	if (utf->cd_enc != (iconv_t) -1) {
+		slice->cd_enc = utf_iconv_open(slice->na_enc, "UTF-8");
+		if (slice->cd_enc == (iconv_t) -1) {
+			free(slice);
+			return NULL;
+		}
+	}
+	slice->map     = utf->map;
+	slice->mapsize = utf->mapsize;
+	slice->mapidx  = from;
+	slice->maplen  = to;
+	slice->maplink = 1;
+	slice->mapwrite = utf->mapwrite;	/* the slices never overlap */
+	return slice;
+}
+
+
+static int utf_span_queue(UTFB *utf, FILE *fp, char *s, size_t len)
+{
+	UTFSPAN	*last;
+
+	if (utf->spidx > 0) {
+		/* merge the adjacent spans */
+		last = &utf->span[utf->spidx - 1];
+		if ((char *) last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return len;
+		}
+	}
+	if (utf->spidx >= UTF_MAX_SPAN) {
+		utf_span_flush(utf, fp);
+	}
+	utf->span[utf->spidx].iov_base = s;
+	utf->span[utf->spidx].iov_len  = len;
+	utf->spidx++;
+	return len;
+}
+
+static int utf_span_flush(UTFB *utf, FILE *fp)
+{
+	int	i, n = 0;
+
+	if (utf->spidx == 0) {
+		return 0;
+	}
+	/* the encoder must go through span by span */
+	if (UTFENC(utf) ||
+			(utf_writev(fp, utf->span, utf->spidx) < 0)) {
+		for (i = 0; i < utf->spidx; i++) {
+			n += utf_write(utf, fp, utf->span[i].iov_base, 
+					utf->span[i].iov_len);
+		}
+	} else {
+		for (i = 0; i < utf->spidx; i++) {
+			n += utf->span[i].iov_len;
+		}
+	}
+	utf->spidx = 0;
+	utf->ccidx = 0;
+	return n;
+}
+
+/* gathering all spans by one system call. It returns -1 if the stream 
+ * can not be written directly, like a memory stream */
+static int utf_writev(FILE *fp, UTFSPAN *iov, int cnt)
+{
+#ifdef	CFG_WRITEV
+	ssize_t	n;
+	int	fd;
+
+	if ((fd = fileno(fp)) < 0) {
+		return -1;
+	}
+	fflush(fp);	/* keep the order with the buffered stream */
+	while (cnt > 0) {
+		if ((n = writev(fd, iov, cnt)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -2;
+		}
+		/* skip the spans which have been written completely */
+		for ( ; cnt && (n >= (ssize_t) iov->iov_len); cnt--, iov++) {
+			n -= iov->iov_len;
+		}
+		if (cnt) {	/* partially written */
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
 
 static size_t utf_pump(UTFB *utf, FILE *fp)
 {
-	size_t	n, rc;
+	size_t	n, rc, prod;
 
 	n = fread(utf->ibuffer + utf->inidx, 1, UTFBUFF(utf), fp);
 	WARNX("utf_pump: input=%ld (+%ld) output=%ld\n", utf->inidx, n, UTFPROD(utf));
-	if (n <= 0) {
+	if ((n <= 0) || utf->bin_err) {
 		return 0;	/* the remains in the iconv buffer cannot decode anyway */
 	}
 
 	utf->inidx += n;
-	if ((rc = utf_bin_detect(utf, utf->ibuffer, utf->inidx)) > 0) {
-		WARNX("utf_pump: binary detected %ld (%ld)\n", rc, n);
-		return -1;
-	}
-	
 	utf->inbuf = utf->ibuffer;
+	prod = UTFPROD(utf);
 	while (utf->inidx > 0) {
-		rc = iconv(utf->cd_dec, &utf->inbuf, &utf->inidx, &utf->outbuf, &utf->outidx);
+		rc = utf_decode(utf, &utf->inbuf, &utf->inidx, &utf->outbuf, &utf->outidx);
 		if (rc != (size_t) -1) {
 			break;
 		}
@@ -287,6 +877,13 @@ static size_t utf_pump(UTFB *utf, FILE *fp)
 		/* relocate the unused chars to the head of the buffer */
 		memmove(utf->ibuffer, utf->inbuf, utf->inidx);
 	}
+	/* the binary is detected in the decoded contents, otherwise the
+	 * UTF-16/32 would look like full of control codes */
+	if ((rc = utf_bin_detect(utf, utf->obuffer + prod, 
+					UTFPROD(utf) - prod)) > 0) {
+		WARNX("utf_pump: binary detected %ld (%ld)\n", rc, n);
+		return 0;
+	}
 	WARNX("utf_pump: input=%ld  output=%ld\n", utf->inidx, UTFPROD(utf));
 	return UTFPROD(utf);
 }
@@ -344,38 +941,485 @@ static int utf_bom_detect(UTFB *utf, FILE *fp)
 	/* assume the input and output the same coding */
 	StrNCpy(utf->na_enc, mtab->magic_name, sizeof(utf->na_enc));
 
-	/* since the BOM is included in the input stream,
-	 * we must NOT specify the endianness in the iconv name,
-	 * otherwise iconv will produce double BOM output */
+	/* the endianness is specified in the iconv name so the BOM must be 
+	 * removed from the input stream, otherwise iconv will produce double
+	 * BOM output. The UTF-8 BOM is kept for the memory mapping */
 	p = utf->na_dec + strlen(utf->na_dec) - 2;
 	if (!strcmp(p, "le") || !strcmp(p, "LE") || !strcmp(p, "be")
 			|| !strcmp(p, "BE")) {
-		*p = 0;
+		utf->inidx -= mtab->magic_len;
+		memmove(utf->ibuffer, utf->ibuffer + mtab->magic_len, utf->inidx);
+		utf->decoff = mtab->magic_len;	/* the input offset */
 	}
 	return 0;
 }
 
 
+/* Detect the binary contents by the density of the control codes in the
+ * first UTF_BIN_PROBE bytes. Return the length to the control code which
+ * exceeds the limit, or 0 if it looks like text */
 static int utf_bin_detect(UTFB *utf, char *s, size_t len)
 {
-	int	i, acc;
+	char	*p, *e;
+	size_t	ctrl = 0, n = 0;
 
-	/* only detecting the first 1Kb */
+	/* without the UTFB, only the buffer itself is probed */
 	if (utf) {
-		if (utf->bin_acc > 1024) return 0;
+		if (utf->bin_acc >= UTF_BIN_PROBE) {
+			return 0;
+		}
+		len = MIN(len, (size_t)(UTF_BIN_PROBE - utf->bin_acc));
 		utf->bin_acc += len;
+		ctrl = n = utf->bin_ctl;
+	} else {
+		len = MIN(len, UTF_BIN_PROBE);
 	}
 
-	for (i = acc = 0; len; len--, s++, i++) {
-		if (*s == 0) {
-			acc++;
+	/* the ill-formed UTF-8 is skipped over, which is not binary */
+	for (p = s, e = s + len; (p = scan_utf8(p, e, &n)) < e; p++);
+	if (utf) {
+		utf->bin_ctl = n;
+	}
+	if (n <= UTF_BIN_PROBE / 32) {
+		return 0;
+	}
+	if (utf) {
+		utf->bin_err = 1;
+	}
+	for (p = s; p < e; p++) {
+		if (SCAN_CTRL((unsigned char) *p) && 
+				(++ctrl > UTF_BIN_PROBE / 32)) {
+			break;
+		}
+	}
+	return (int)(p - s) + 1;
+}
+
+/* The most frequent characters and punctuations in the Chinese subtitles,
+ * sorted by the code for binary searching */
+static	const	unsigned short	cjk_gb2312[] = {
+	0xa1a2, 0xa1a3, 0xa1ad, 0xa1b0, 0xa1b1, 0xa3a1, 0xa3a8, 0xa3a9,
+	0xa3ac, 0xa3ba, 0xa3bb, 0xa3bf, 0xb0a1, 0xb0c9, 0xb2bb, 0xb3c9,
+	0xb3f6, 0xb4f3, 0xb5b1, 0xb5bd, 0xb5c0, 0xb5c3, 0xb5c4, 0xb5d8,
+	0xb6a8, 0xb6af, 0xb6bc, 0xb6d4, 0xb6e0, 0xb6f8, 0xb7a2, 0xb7a8,
+	0xb7bd, 0xb7d6, 0xb8f6, 0xb9fa, 0xb9fd, 0xbac3, 0xbacd, 0xbaf3,
+	0xbbb9, 0xbbe1, 0xbcd2, 0xbdf8, 0xbead, 0xbecd, 0xbfb4, 0xbfc9,
+	0xc0b4, 0xc0ef, 0xc1cb, 0xc2f0, 0xc3b4, 0xc3bb, 0xc3c7, 0xc3e6,
+	0xc4c7, 0xc4d8, 0xc4dc, 0xc4e3, 0xc4ea, 0xc6f0, 0xc8a5, 0xc8bb,
+	0xc8cb, 0xc8e7, 0xc9cf, 0xc9fa, 0xcab1, 0xcab2, 0xcac2, 0xcac7,
+	0xcbb5, 0xcbf9, 0xcbfb, 0xcbfd, 0xccec, 0xcdac, 0xceaa, 0xced2,
+	0xcfc2, 0xcfd6, 0xcfeb, 0xd0a1, 0xd0d0, 0xd1a7, 0xd2aa, 0xd2b2,
+	0xd2bb, 0xd2d4, 0xd3c3, 0xd3d0, 0xd3da, 0xd4da, 0xd4f5, 0xd5e2,
+	0xd6aa, 0xd6ae, 0xd6d0, 0xd6d6, 0xd7c5, 0xd7d3, 0xd7d4, 0xd7f7
+};
+
+static	const	unsigned short	cjk_big5[] = {
+	0xa141, 0xa142, 0xa143, 0xa146, 0xa147, 0xa148, 0xa149, 0xa14b,
+	0xa15d, 0xa15e, 0xa1a7, 0xa1a8, 0xa440, 0xa446, 0xa448, 0xa455,
+	0xa457, 0xa45d, 0xa46a, 0xa46c, 0xa470, 0xa4a3, 0xa4a4, 0xa4a7,
+	0xa4b0, 0xa4c0, 0xa4d1, 0xa4e8, 0xa548, 0xa54c, 0xa558, 0xa568,
+	0xa569, 0xa5cd, 0xa5ce, 0xa650, 0xa661, 0xa662, 0xa668, 0xa66e,
+	0xa66f, 0xa670, 0xa67e, 0xa6a8, 0xa6b3, 0xa6d3, 0xa6db, 0xa6e6,
+	0xa740, 0xa741, 0xa761, 0xa7da, 0xa853, 0xa8ba, 0xa8c6, 0xa8d3,
+	0xa8ec, 0xa94d, 0xa94f, 0xa977, 0xa9d2, 0xa9f3, 0xaa6b, 0xaaba,
+	0xaabe, 0xabe1, 0xabe7, 0xac4f, 0xacb0, 0xacdd, 0xad6e, 0xadb1,
+	0xadcc, 0xadd3, 0xae61, 0xaec9, 0xafe0, 0xb05f, 0xb0ca, 0xb0da,
+	0xb0ea, 0xb16f, 0xb27b, 0xb36f, 0xb3a3, 0xb44e, 0xb54d, 0xb56f,
+	0xb5db, 0xb669, 0xb6dc, 0xb751, 0xb77c, 0xb7ed, 0xb867, 0xb8cc,
+	0xb944, 0xb94c, 0xb9ef, 0xbad8, 0xbba1, 0xbbf2, 0xbec7, 0xc1d9
+};
+
+#define CJK_TABLE(t)	(int)(sizeof(t) / sizeof(t[0]))
+
+/* Set the decoder by the charset detected from the contents without BOM.
+ * Only works once in the first block. Return 1 if the input needs to be
+ * decoded, or 0 if it's UTF-8 as default */
+static int utf_charset_detect(UTFB *utf, char *s, size_t len)
+{
+	char	*name;
+
+	utf->autodet = 0;
+	if ((name = utf_charset_guess(s, len)) == NULL) {
+		return 0;
+	}
+	/* the output coding is not changed, which is UTF-8 by default */
+	StrNCpy(utf->na_dec, name, sizeof(utf->na_dec));
+	if ((utf->nc_dec = utf_native(utf->na_dec)) == 0) {
+		utf->cd_dec = utf_iconv_open("UTF-8", utf->na_dec);
+		if (utf->cd_dec == (iconv_t) -1) {
+			utf->na_dec[0] = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Guess the charset in one pass of the first block:
+ * the UTF-16/32 are known by the pattern of NUL in the ASCII characters;
+ * the UTF-8 is known by the validity, while a few ill-formed codes are 
+ * tolerated; otherwise the GB18030 and Big5 are scored by the most 
+ * frequent characters. Return NULL for UTF-8 */
+static char *utf_charset_guess(char *s, size_t len)
+{
+	unsigned char	*p = (unsigned char *) s;
+	size_t	i, q, nul[4] = { 0, 0, 0, 0 }, high, bad;
+	char	*e = s + len;
+	int	gb, big5;
+
+	for (i = 0, q = len / 4; i < q * 4; i++) {
+		if (p[i] == 0) {
+			nul[i & 3]++;
+		}
+	}
+	if ((q >= 4) && (nul[3] == q) && (nul[2] >= q / 2)) {
+		return "UTF-32LE";
+	}
+	if ((q >= 4) && (nul[0] == q) && (nul[1] >= q / 2)) {
+		return "UTF-32BE";
+	}
+	if ((nul[1] + nul[3] >= q / 4) && (nul[0] + nul[2] < (nul[1] + nul[3]) / 4)) {
+		return "UTF-16LE";
+	}
+	if ((nul[0] + nul[2] >= q / 4) && (nul[1] + nul[3] < (nul[0] + nul[2]) / 4)) {
+		return "UTF-16BE";
+	}
+
+	/* count the ill-formed UTF-8 against the non-ASCII bytes */
+	for (i = high = 0; i < len; i++) {
+		high += p[i] >> 7;
+	}
+	for (bad = 0; (s = scan_utf8(s, e, &i)) < e; s++) {
+		if (utf_partial(s, e)) {
+			break;	/* cut by the end of the block */
+		}
+		bad++;
+	}
+	if (bad * 16 <= high) {
+		return NULL;
+	}
+	gb   = utf_cjk_score(p, p + len, 0);
+	big5 = utf_cjk_score(p, p + len, 1);
+	if ((gb < 0) && (big5 < 0)) {
+		return NULL;
+	}
+	return (big5 > gb) ? "BIG5" : "GB18030";
+}
+
+/* Score the double byte coding by the frequent characters. The GB18030 is
+ * a superset of GBK and GB2312 so it has the 4-byte form. Return -1 if 
+ * it's more than 1/32 ill-formed */
+static int utf_cjk_score(unsigned char *s, unsigned char *e, int big5)
+{
+	const	unsigned short	*tab;
+	int	n, lo, hi, mid, hit = 0, pair = 0, bad = 0;
+	unsigned	c;
+
+	tab = big5 ? cjk_big5 : cjk_gb2312;
+	n = big5 ? CJK_TABLE(cjk_big5) : CJK_TABLE(cjk_gb2312);
+	while (s + 1 < e) {
+		if (*s < 0x80) {
+			s++;
+			continue;
+		}
+		if ((*s == 0x80) || (*s == 0xff)) {
+			bad++;
+			s++;
+			continue;
+		}
+		if (!big5 && (s[1] >= 0x30) && (s[1] <= 0x39)) {
+			if ((s + 3 < e) && (s[2] >= 0x81) && (s[2] != 0xff) &&
+					(s[3] >= 0x30) && (s[3] <= 0x39)) {
+				pair++;
+				s += 4;
+			} else {
+				bad++;
+				s++;
+			}
+			continue;
+		}
+		if ((s[1] < 0x40) || (s[1] == 0x7f) || (s[1] == 0xff) ||
+				(big5 && (s[1] > 0x7e) && (s[1] < 0xa1))) {
+			bad++;
+			s++;
+			continue;
+		}
+		pair++;
+		c = (s[0] << 8) | s[1];
+		for (lo = 0, hi = n - 1; lo <= hi; ) {
+			mid = (lo + hi) / 2;
+			if (tab[mid] == c) {
+				hit++;
+				break;
+			} else if (tab[mid] < c) {
+				lo = mid + 1;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		s += 2;
+	}
+	if (bad * 32 > pair) {
+		return -1;
+	}
+	return hit;
+}
+
+/* Use the native transcoder for UTF-16 and UTF-32 with the explicit 
+ * endianness. Return the idname() of the coding, or 0 for iconv */
+static int utf_native(char *code)
+{
+	int	id = idname(code);
+
+	if ((id < 0) || (id & 0xf00)) {
+		return 0;	/* not UTF, the UCS goes to iconv */
+	}
+	if (((id & 0xf) != 2) && ((id & 0xf) != 3)) {
+		return 0;
+	}
+	if (((id & 0xf0) != 0x10) && ((id & 0xf0) != 0x20)) {
+		return 0;	/* iconv would detect the BOM */
+	}
+	return id;
+}
+
+static size_t utf_decode(UTFB *utf, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft)
+{
+	if (utf->nc_dec) {
+		return utf_native_decode(utf->nc_dec, inbuf, inleft, 
+				outbuf, outleft);
+	}
+	return iconv(utf->cd_dec, inbuf, inleft, outbuf, outleft);
+}
+
+static size_t utf_encode(UTFB *utf, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft)
+{
+	if (utf->nc_enc) {
+		return utf_native_encode(utf->nc_enc, inbuf, inleft, 
+				outbuf, outleft);
+	}
+	return iconv(utf->cd_enc, inbuf, inleft, outbuf, outleft);
+}
+
+#define UTF_GET16(p,be)	((be) ? ((p)[0] << 8) | (p)[1] : ((p)[1] << 8) | (p)[0])
+#define UTF_GET32(p,be)	((be) ? \
+	((unsigned long)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3] : \
+	((unsigned long)(p)[3] << 24) | ((p)[2] << 16) | ((p)[1] << 8) | (p)[0])
+
+/* Decode UTF-16/32 to UTF-8 the same way as iconv(), including the errno:
+ * E2BIG for the full output, EILSEQ for the illegal character and EINVAL
+ * for the incomplete character in the end of the input. The runs of ASCII
+ * in UTF-16 are narrowed by the SIMD scanner. UTF-8 is validated by the 
+ * SIMD scanner and copied */
+static size_t utf_native_decode(int id, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft)
+{
+	unsigned char	*s = (unsigned char *) *inbuf;
+	unsigned char	*d = (unsigned char *) *outbuf;
+	size_t	n, ctrl, in = *inleft, out = *outleft;
+	unsigned long	c, lo;
+	int	be = (id & 0xf0) == 0x20;
+	int	wide = 1 << ((id & 0xf) - 1);
+	int	len, err = 0;
+
+	if (wide == 1) {
+		n = MIN(in, out);
+		len = (int)((unsigned char *) scan_utf8((char *) s, 
+					(char *) s + n, &ctrl) - s);
+		memcpy(d, s, len);
+		s += len, in -= len;
+		d += len, out -= len;
+		if ((size_t) len < n) {
+			err = utf_partial((char *) s, (char *) s + n - len) ?
+				((n < *inleft) ? E2BIG : EINVAL) : EILSEQ;
+		} else if (n < *inleft) {
+			err = E2BIG;
+		}
+	}
+	while ((wide > 1) && (in >= (size_t) wide)) {
+		if (wide == 2) {
+			n = scan_narrow16((char *) d, (char *) s, 
+					MIN(in / 2, out), be);
+			s += n * 2, in -= n * 2;
+			d += n, out -= n;
+			if (in < 2) {
+				break;
+			}
+			c = UTF_GET16(s, be);
+			len = 2;
+			if ((c >= 0xdc00) && (c <= 0xdfff)) {
+				err = EILSEQ;	/* the lone low surrogate */
+				break;
+			}
+			if ((c >= 0xd800) && (c <= 0xdbff)) {
+				if (in < 4) {
+					err = EINVAL;
+					break;
+				}
+				lo = UTF_GET16(s + 2, be);
+				if ((lo < 0xdc00) || (lo > 0xdfff)) {
+					err = EILSEQ;
+					break;
+				}
+				c = 0x10000 + ((c - 0xd800) << 10) + lo - 0xdc00;
+				len = 4;
+			}
+		} else {
+			c = UTF_GET32(s, be);
+			len = 4;
+			if ((c > 0x10ffff) || ((c >= 0xd800) && (c <= 0xdfff))) {
+				err = EILSEQ;
+				break;
+			}
+		}
+
+		n = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+		if (out < n) {
+			err = E2BIG;
+			break;
+		}
+		switch (n) {
+		case 1:
+			d[0] = c;
+			break;
+		case 2:
+			d[0] = 0xc0 | (c >> 6);
+			d[1] = 0x80 | (c & 0x3f);
+			break;
+		case 3:
+			d[0] = 0xe0 | (c >> 12);
+			d[1] = 0x80 | ((c >> 6) & 0x3f);
+			d[2] = 0x80 | (c & 0x3f);
+			break;
+		default:
+			d[0] = 0xf0 | (c >> 18);
+			d[1] = 0x80 | ((c >> 12) & 0x3f);
+			d[2] = 0x80 | ((c >> 6) & 0x3f);
+			d[3] = 0x80 | (c & 0x3f);
+			break;
+		}
+		s += len, in -= len;
+		d += n, out -= n;
+	}
+	if (!err && in) {
+		err = EINVAL;	/* incomplete character */
+	}
+	*inbuf = (char *) s;
+	*inleft = in;
+	*outbuf = (char *) d;
+	*outleft = out;
+	if (err) {
+		errno = err;
+		return (size_t) -1;
+	}
+	return 0;
+}
+
+/* the ill-formed UTF-8 in 's' is only a character cut by the end 'e' */
+static int utf_partial(char *s, char *e)
+{
+	int	c = (unsigned char) *s, len;
+
+	len = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : (c >= 0xc2) ? 2 : 0;
+	if ((c > 0xf4) || (len <= e - s)) {
+		return 0;
+	}
+	for (s++; s < e; s++) {
+		if ((*s & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Encode UTF-8 to UTF-16/32 the same way as iconv(). The overlong forms, 
+ * the surrogates and the code points beyond U+10FFFF are illegal */
+static size_t utf_native_encode(int id, char **inbuf, size_t *inleft, 
+		char **outbuf, size_t *outleft)
+{
+	unsigned char	*s = (unsigned char *) *inbuf;
+	unsigned char	*d = (unsigned char *) *outbuf;
+	size_t	i, n, in = *inleft, out = *outleft;
+	unsigned long	c;
+	int	be = (id & 0xf0) == 0x20;
+	int	wide = ((id & 0xf) == 2) ? 2 : 4;
+	int	len, err = 0;
+
+	while (in > 0) {
+		if (wide == 2) {
+			n = scan_widen16((char *) d, (char *) s, 
+					MIN(in, out / 2), be);
+			s += n, in -= n;
+			d += n * 2, out -= n * 2;
+			if (in == 0) {
+				break;
+			}
+		}
+
+		c = s[0];
+		if (c < 0x80) {
+			len = 1;
+		} else if (c < 0xc2) {
+			err = EILSEQ;	/* continuation or overlong */
+			break;
+		} else if (c < 0xe0) {
+			len = 2, c &= 0x1f;
+		} else if (c < 0xf0) {
+			len = 3, c &= 0x0f;
+		} else if (c < 0xf5) {
+			len = 4, c &= 0x07;
 		} else {
-			acc = 0;
+			err = EILSEQ;
+			break;
 		}
-		if (acc > 4) {
-			if (utf) utf->bin_err = 1;
-			return i;
+		for (i = 1; (i < (size_t) len) && (i < in); i++) {
+			if ((s[i] & 0xc0) != 0x80) {
+				break;
+			}
+			c = (c << 6) | (s[i] & 0x3f);
 		}
+		if (i < (size_t) len) {
+			err = (i == in) ? EINVAL : EILSEQ;
+			break;
+		}
+		if (((len == 3) && ((c < 0x800) || 
+				((c >= 0xd800) && (c <= 0xdfff)))) ||
+				((len == 4) && ((c < 0x10000) || (c > 0x10ffff)))) {
+			err = EILSEQ;
+			break;
+		}
+
+		n = ((wide == 2) && (c < 0x10000)) ? 2 : 4;
+		if (out < n) {
+			err = E2BIG;
+			break;
+		}
+		if (wide == 4) {
+			d[be ? 0 : 3] = c >> 24;
+			d[be ? 1 : 2] = (c >> 16) & 0xff;
+			d[be ? 2 : 1] = (c >> 8) & 0xff;
+			d[be ? 3 : 0] = c & 0xff;
+		} else if (n == 2) {
+			d[!be] = c >> 8;
+			d[be] = c & 0xff;
+		} else {
+			c -= 0x10000;
+			d[!be] = 0xd8 | (c >> 18);
+			d[be] = (c >> 10) & 0xff;
+			d[2 + !be] = 0xdc | ((c >> 8) & 0x3);
+			d[2 + be] = c & 0xff;
+		}
+		s += len, in -= len;
+		d += n, out -= n;
+	}
+	*inbuf = (char *) s;
+	*inleft = in;
+	*outbuf = (char *) d;
+	*outleft = out;
+	if (err) {
+		errno = err;
+		return (size_t) -1;
 	}
 	return 0;
 }
@@ -457,12 +1501,21 @@ static int idname(char *s)
 
 #ifdef	UTF_MAIN
 
+static void hexdump(char *prompt, char *s, int len)
+{
+	printf("%s", prompt ? prompt : "");
+	while (len--) printf("%02x ", (unsigned char) *s++);
+	puts("");
+}
+
 static void dump_utfb(UTFB *utf) 
 {
 	fprintf(stderr, "iconv decoder:          %p\n", utf->cd_dec);
 	fprintf(stderr, "iconv decode name:      %s\n", utf->na_dec[0] ? utf->na_dec : "unknown");
+	fprintf(stderr, "native decoder:         %x\n", utf->nc_dec);
 	fprintf(stderr, "iconv encoder:          %p\n", utf->cd_enc);
 	fprintf(stderr, "iconv encode name:      %s\n", utf->na_enc[0] ? utf->na_enc : "unknown");
+	fprintf(stderr, "native encoder:         %x\n", utf->nc_enc);
 	fprintf(stderr, "input buffer:           %ld (%d)\n", utf->inidx, (int)(utf->inbuf - utf->ibuffer));
 	fprintf(stderr, "output buffer:          %ld (%d)\n", utf->outidx, (int)(utf->outbuf - utf->obuffer));
 }
@@ -656,6 +1709,7 @@ static int test_utf_iconv(char *decode, char *encode, FILE *fin, FILE *fout)
 	while (utf_gets(utf, fin, buf, sizeof(buf))) {
 		utf_puts(utf, fout, buf);
 	}
+	utf_write(utf, fout, NULL, 0);
 	utf_close(utf);
 	return 0;
 }
@@ -4,9 +4,30 @@
 
 #include <iconv.h>
 
+/* memory mapping the input file is not available in MinGW */
+#if !defined(_WIN32) && !defined(CFG_NO_MMAP)
+#define CFG_MMAP
+#endif
+
+/* gathering output by writev() is not available in MinGW */
+#if !defined(_WIN32)
+#define CFG_WRITEV
+#include <sys/uio.h>
+#endif
+
 #define UTF_MAX_BUF	4096
+#define UTF_MAX_SPAN	256
+#define UTF_MAX_ICONV	16	/* cached iconv descriptors */
+#define UTF_DEC_BLOCK	(256 * 1024)	/* the block to be decoded by iconv */
+#define UTF_BIN_PROBE	1024	/* the first bytes probed for binary */
+#define UTF_DET_PROBE	(16 * 1024)	/* the first bytes probed for charset */
 #define APP_MAX_BUF	(UTF_MAX_BUF / 4)
 
+/* the handling of the ill-formed input */
+#define UTF_BAD_KEEP	0	/* pass the ill-formed UTF-8 through */
+#define UTF_BAD_REJECT	1	/* stop reading at the ill-formed input */
+#define UTF_BAD_REPAIR	2	/* replace the ill-formed input by U+FFFD */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,17 +38,34 @@ typedef struct  _MMTAB  {
 	char    *magic_name;
 } MMTAB;
 
+#ifdef	CFG_WRITEV
+typedef struct iovec	UTFSPAN;
+#else
+typedef	struct	{
+	void	*iov_base;
+	size_t	iov_len;
+} UTFSPAN;
+#endif
+
 typedef	struct		_UTFBUF	{
 	iconv_t		cd_dec;
 	char		na_dec[64];	/* decode by bom_codepage */
+	int		nc_dec;		/* decode by the native UTF-16/32 */
 	int		dec_err;
 
 	iconv_t		cd_enc;
 	char		na_enc[64];	/* like UTF-16BE for iconv */
+	int		nc_enc;		/* encode by the native UTF-16/32 */
 	int		enc_err;
+	int		autodet;	/* detect the charset without BOM */
 
 	int		bin_acc;
 	int		bin_err;
+	size_t		bin_ctl;	/* control codes in the probe */
+
+	int		bad_mode;	/* UTF_BAD_KEEP, REJECT or REPAIR */
+	int		bad_err;	/* rejected by the ill-formed input */
+	long		bad_off;	/* the first ill-formed input, or -1 */
 
 	char		ibuffer[UTF_MAX_BUF/4];
 	char		*inbuf;
@@ -37,22 +75,51 @@ typedef	struct		_UTFBUF	{
 	char		*outbuf;
 	size_t		outidx;
 
-	char		cache[UTF_MAX_BUF/4];
+	char		*line;		/* the line buffer of utf_getline() */
+	size_t		linecap;
+
+	char		cache[UTF_MAX_BUF];
 	size_t		ccidx;
+
+	UTFSPAN		span[UTF_MAX_SPAN];	/* output waiting for writing */
+	int		spidx;
+
+	char		*map;		/* memory mapped input file */
+	size_t		maplen;		/* end of the usable mapping */
+	size_t		mapidx;		/* the next line to read */
+	size_t		mapsize;	/* the whole mapping size */
+	int		maplink;	/* the mapping is borrowed, not to unmap */
+	int		mapheap;	/* the mapping is decoded in the heap */
+	int		mapwrite;	/* the mapping can be rewritten in place */
+	size_t		mapcap;		/* the capacity of the heap mapping */
+	char		*decin;		/* the input block for decoding */
+	size_t		decidx;
+	long		decoff;		/* the input offset of the block */
 } UTFB;
 
 #define UTFBUFF(u)	(sizeof((u)->ibuffer) - (u)->inidx)
 #define UTFPROD(u)	(sizeof((u)->obuffer) - (u)->outidx)
+#define UTFDEC(u)	((u)->nc_dec || ((u)->cd_dec != (iconv_t) -1))
+#define UTFENC(u)	((u)->nc_enc || ((u)->cd_enc != (iconv_t) -1))
 
 
 UTFB *utf_open(FILE *fp, char *decode, char *encode);
 void utf_close(UTFB *utf);
+iconv_t utf_iconv_open(const char *tocode, const char *fromcode);
+int utf_iconv_close(iconv_t cd);
+void utf_iconv_stat(unsigned long *hit, unsigned long *miss);
 int utf_write_bom(UTFB *utf, FILE *fp);
 int utf_cache(UTFB *utf, FILE *fp, char *s, size_t len);
+int utf_span(UTFB *utf, FILE *fp, char *s, size_t len);
 int utf_puts(UTFB *utf, FILE *fp, char *buf);
 int utf_write(UTFB *utf, FILE *fp, char *buf, size_t len);
 char *utf_gets(UTFB *utf, FILE *fp, char *buf, int len);
-void hexdump(char *prompt, char *s, int len);
+char *utf_getline(UTFB *utf, FILE *fp, size_t *len);
+int utf_map(UTFB *utf, FILE *fp);
+int utf_map_buffer(UTFB *utf, FILE *fp, char *buf, size_t len);
+int utf_map_decode(UTFB *utf, FILE *fp);
+char *utf_mapline(UTFB *utf, size_t *len);
+UTFB *utf_slice(UTFB *utf, size_t from, size_t to);
 
 #ifdef __cplusplus
 }